@@ -0,0 +1,96 @@
+#ifndef ANIMATOR_HPP
+#define ANIMATOR_HPP
+
+#include <glm/glm.hpp>
+#include <array>
+#include <vector>
+
+#include "jobSystem.hpp"
+#include "mesh.hpp"
+#include "world.hpp"
+
+// Poses a world's nodes from its animations and skins the meshes on them
+// Node transforms are kept as one array per component with parents ahead of
+// their children, so sampling and composing transforms are flat loops over
+// all nodes that the compiler can vectorize. Skinning is split into vertex
+// batches that run as jobs.
+class Animator
+{
+public:
+    // World has to outlive this and keep its nodes, skins and meshes in place
+    Animator(const World* world, JobSystem* jobs);
+
+    // Poses nodes at seconds into the animation, looping over its duration,
+    // and skins the meshes that are loaded
+    void update(size_t animation, float seconds);
+
+    // Indexed like World::nodes
+    const std::vector<glm::mat4>& nodeToWorld() const;
+    // Null if the node isn't skinned or the primitive isn't loaded
+    // Vertices are in world space and alternate between two buffers so that
+    // each update gives new pointers
+    const SkinnedVertices* skinned(const Scene::Node* node, size_t primitive) const;
+
+    // Skinned vertex buffers
+    MemoryUsage memoryUsage() const;
+
+private:
+    // A skinned primitive on a node
+    struct Target {
+        size_t node;
+        size_t skin;
+        const Primitive* primitive;
+        std::array<SkinnedVertices, 2> buffers;
+        size_t current = 0;
+        bool valid = false;
+    };
+
+    // Vertices [begin, end) of a target
+    struct Batch {
+        size_t target;
+        size_t begin;
+        size_t end;
+        glm::vec3 min;
+        glm::vec3 max;
+    };
+
+    void sample(const Animation& animation, float seconds);
+    void compose();
+    void skin();
+
+    const World* _world;
+    JobSystem* _jobs;
+
+    // Nodes are sorted by depth, _order maps to World::nodes and _sorted back
+    // _levels holds the first sorted node of each depth and one past the last
+    std::vector<size_t> _order;
+    std::vector<size_t> _sorted;
+    std::vector<size_t> _parents;
+    std::vector<size_t> _levels;
+
+    // Rest pose and current pose, translation xyz, rotation xyzw and scale xyz
+    std::array<std::vector<float>, 10> _rest;
+    std::array<std::vector<float>, 10> _pose;
+    // Affine node transforms as 3x4 column major, local and in world space
+    std::array<std::vector<float>, 12> _local;
+    std::array<std::vector<float>, 12> _global;
+    // Parent transforms gathered for a level
+    std::array<std::vector<float>, 12> _parent;
+
+    // Per channel keys around the sample time and their weights
+    // Keys are value and tangent before, value and tangent after
+    std::array<std::vector<float>, 16> _keys;
+    std::array<std::vector<float>, 4> _keyWeights;
+    std::array<std::vector<float>, 4> _sampled;
+
+    std::vector<glm::mat4> _nodeToWorld;
+    // Per skin in World::skins order
+    std::vector<std::vector<glm::mat4>> _joints;
+
+    std::vector<Target> _targets;
+    // First target of each node or SIZE_MAX
+    std::vector<size_t> _nodeTargets;
+    std::vector<Batch> _batches;
+};
+
+#endif // ANIMATOR_HPP
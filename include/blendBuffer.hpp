@@ -0,0 +1,42 @@
+#ifndef BLENDBUFFER_HPP
+#define BLENDBUFFER_HPP
+
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "color.hpp"
+#include "frameBuffer.hpp"
+#include "memoryReport.hpp"
+
+// Transparent samples over a region of a frame buffer, summed in any order
+// with weighted blended order-independent transparency (McGuire and Bavoil
+// 2013) and composited over the frame buffer in one go
+// Nearer samples weigh more so the front layers dominate without sorting
+class BlendBuffer
+{
+public:
+    // Empties the buffer and makes it cover [min, max) with the given samples
+    // per pixel, storage is kept when the region shrinks
+    void reset(const glm::uvec2& min, const glm::uvec2& max, uint32_t samples);
+
+    // Expects p in the region and NDC depth
+    void add(const glm::ivec2& p, uint32_t sample, const Color& color, float alpha, float depth);
+
+    // Blends the summed samples over fb's samples in the region
+    void composite(FrameBuffer* fb) const;
+
+    MemoryUsage memoryUsage() const;
+
+private:
+    size_t sampleIndex(const glm::ivec2& p, uint32_t sample) const;
+
+    glm::uvec2 _min = glm::uvec2(0);
+    glm::uvec2 _max = glm::uvec2(0);
+    uint32_t _samples = 1;
+    // Sums of color and alpha, both premultiplied by alpha and weight
+    std::vector<glm::vec4> _accum;
+    // Products of 1 - alpha, how much of the frame buffer shows through
+    std::vector<float> _revealage;
+};
+
+#endif // BLENDBUFFER_HPP
@@ -10,8 +10,13 @@ public:
     void lookAt(const glm::vec3& eye, const glm::vec3& target, const glm::vec3& up);
     void orient(const glm::vec3& eye, const glm::vec3& fwd, const glm::vec3& up);
     void perspective(const float fov, const float ar, const float zN, const float zF);
+    // Box in camera space, looking down -z like perspective()
+    void orthographic(const float left, const float right, const float bottom, const float top, const float zN, const float zF);
 
     const glm::vec3& eye() const;
+    // Unit direction from p towards the viewer, the same everywhere for
+    // orthographic projections
+    glm::vec3 toEye(const glm::vec3& p) const;
     const glm::mat4& worldToCamera() const;
     const glm::mat4& cameraToClip() const;
     const glm::mat4& worldToClip() const;
@@ -21,6 +26,7 @@ private:
     glm::mat4 _worldToClip;
     glm::mat4 _worldToCamera;
     glm::mat4 _cameraToClip;
+    bool _orthographic = false;
 };
 
 #endif // CAMERA_HPP
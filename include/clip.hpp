@@ -6,12 +6,133 @@
 #include <glm/glm.hpp>
 #include <array>
 
+#include "blendBuffer.hpp"
 #include "frameBuffer.hpp"
 
-void drawLine(const glm::vec4& p0, const glm::vec4& p1, const Color& color, FrameBuffer* fb);
+// Per-vertex attributes interpolated over triangles
+struct Varyings {
+    // Shadow map window coordinates and depth
+    glm::vec3 shadowCoord = glm::vec3(0.f);
+    glm::vec3 normal = glm::vec3(0.f);
+    glm::vec2 texCoord0 = glm::vec2(0.f);
+    glm::vec4 tangent = glm::vec4(0.f);
+};
+
+// Fixed function state, each combination has its own pixel loop so simple
+// pipelines don't pay for the features they don't use
+struct RasterState {
+    bool depthTest = true;
+    bool depthWrite = true;
+    bool colorWrite = true;
+    // Also passes on equal depth so a color pass can run over a depth prepass
+    bool depthLessEqual = false;
+};
+
+// How covered pixels get their color
+enum class Shading {
+    // Constant color, no varyings are interpolated
+    Flat,
+    // Diffuse lighting from the interpolated normal
+    Lambert,
+    // Variants that are darkened where the shadow map is closer to the light
+    FlatShadowed,
+    LambertShadowed
+};
+
+// Per-triangle shading parameters, the variant only reads what it needs
+struct ShadingInputs {
+    Color color;
+    // Direction the light travels in world space
+    glm::vec3 lightDir = glm::vec3(0.f, 0.f, -1.f);
+    const FrameBuffer* shadowMap = nullptr;
+    // Subtracted from the shadow depth to keep surfaces from shadowing themselves
+    float shadowBias = 0.f;
+    // Coverage of blended variants
+    float alpha = 1.f;
+    std::array<Varyings, 3> varyings;
+};
+
+// Fixed function state of lines, they never write depth so overlays don't
+// hide each other
+struct LineState {
+    bool depthTest = true;
+    // Pulls lines towards the camera in NDC depth so edges win over the
+    // surfaces they lie on
+    float depthBias = 0.f;
+};
+
+// Clipped line in window space, stepped a pixel at a time along its major
+// axis
+struct LineSetup {
+    // 0 if the line is closer to horizontal, 1 otherwise
+    int32_t major = 0;
+    // Covered pixels [first, last) along the major axis
+    int32_t first = 0;
+    int32_t last = 0;
+    // Minor coordinate and NDC depth at the center of pixel first and their
+    // change per pixel
+    float minor = 0.f;
+    float minorStep = 0.f;
+    float depth = 0.f;
+    float depthStep = 0.f;
+    // Window pixels the line touches -> [pMin, pMax)
+    glm::ivec2 pMin = glm::ivec2(0);
+    glm::ivec2 pMax = glm::ivec2(0);
+};
+
+// Expects non-divided clip coordinates, clips the line against the clip volume
+// before the perspective divide so end points behind the eye work
+// Gives window coordinates and NDC depth of what's left, returns false if the
+// whole line was clipped
+bool clipLine(const glm::vec4& clipP0, const glm::vec4& clipP1, const glm::uvec2& res, glm::vec3* windowP0, glm::vec3* windowP1);
+
+// Expects window coordinates and NDC depth of end points in the window
+// Pixels whose center the line passes are covered, the end pixel is left out
+// so connected lines don't overlap
+// Returns false if the line covers no pixel centers
+bool setupLine(const glm::vec3& windowP0, const glm::vec3& windowP1, const glm::uvec2& res, LineSetup* setup);
+
+// Expects non-divided clip coordinates
+void drawLine(const glm::vec4& clipP0, const glm::vec4& clipP1, const Color& color, const LineState& state, FrameBuffer* fb);
+// Only touches pixels in [scissorMin, scissorMax) so disjoint regions can be
+// drawn in parallel
+void drawLine(const LineSetup& setup, const Color& color, const LineState& state, const glm::uvec2& scissorMin, const glm::uvec2& scissorMax, FrameBuffer* fb);
+
+// True if all vertices are outside the clip volume
+bool outsideClip(const std::array<glm::vec4, 3>& clipVerts);
 
 // Expects non-divided clip coordinates, ccw winding
 // Returns false if whole triangle was clipped
 bool drawTri(const std::array<glm::vec4, 3>& clipVerts, const Color& color, FrameBuffer* fb);
+// Only touches pixels in [scissorMin, scissorMax) so disjoint regions can be
+// drawn in parallel
+bool drawTri(const std::array<glm::vec4, 3>& clipVerts, const Color& color, const glm::uvec2& scissorMin, const glm::uvec2& scissorMax, FrameBuffer* fb);
+
+// Pre-instantiated pipeline variant, works like the scissored drawTri
+using RasterFn = bool (*)(
+    const std::array<glm::vec4, 3>& clipVerts,
+    const ShadingInputs& inputs,
+    const glm::uvec2& scissorMin,
+    const glm::uvec2& scissorMax,
+    FrameBuffer* fb
+);
+
+// Picks the variant once per draw instead of branching per pixel
+// Variants without color writes only rasterize depth whatever the shading
+RasterFn rasterVariant(const RasterState& state, Shading shading);
+
+// Pipeline variant that adds shaded samples to blend instead of writing them
+// to fb, whose depth is only tested. The scissor has to be in blend's region.
+using BlendFn = bool (*)(
+    const std::array<glm::vec4, 3>& clipVerts,
+    const ShadingInputs& inputs,
+    const glm::uvec2& scissorMin,
+    const glm::uvec2& scissorMax,
+    FrameBuffer* fb,
+    BlendBuffer* blend
+);
+
+// Blended samples never write depth so only the depth test of state applies
+BlendFn blendVariant(const RasterState& state, Shading shading);
 
 #endif // CLIP_HPP
@@ -0,0 +1,69 @@
+#ifndef COMMANDLIST_HPP
+#define COMMANDLIST_HPP
+
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "animator.hpp"
+#include "clip.hpp"
+#include "frameArena.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "world.hpp"
+
+// Fixed function state that applies to a draw
+struct DrawState {
+    RasterState raster;
+    bool cullBackFaces = true;
+    // Draw can be skipped if its bounds are hidden behind earlier draws
+    bool occlusionCulling = true;
+};
+
+// Frame-local list of draws that is recorded by the application and
+// executed in bulk by a Renderer
+class CommandList
+{
+public:
+    // Instances use transforms [transform, transform + instanceCount)
+    struct Draw {
+        const Primitive* primitive;
+        size_t transform;
+        size_t instanceCount;
+        const Material* material;
+        DrawState state;
+        // Replaces the primitive's vertices if set
+        const SkinnedVertices* skinned = nullptr;
+    };
+
+    // Drops recorded draws and frees the frame's scratch memory, state is kept
+    void reset();
+
+    // Applies to draws recorded after this
+    void setState(const DrawState& state);
+
+    // Uses the primitive's own material if material is null
+    void drawPrimitive(const Primitive& primitive, const glm::mat4& modelToWorld, const Material* material = nullptr);
+    // Vertices are in world space and have to stay in place until the draw is
+    // executed
+    void drawSkinned(const Primitive& primitive, const SkinnedVertices& vertices);
+    void drawMesh(const Mesh& mesh, const glm::mat4& modelToWorld);
+    // Draws the mesh once per transform, per-mesh work is shared between the
+    // instances
+    void drawMeshInstanced(const Mesh& mesh, const glm::mat4* modelToWorlds, size_t instanceCount);
+    // Records all meshes in the current scene with their stacked transforms
+    // Meshes referenced by many nodes are drawn instanced
+    // Nodes are posed and skinned by animator if set, it has to be updated
+    void drawWorld(const World& world, const Animator* animator = nullptr);
+
+    const std::vector<glm::mat4>& transforms() const;
+    const std::vector<Draw>& draws() const;
+
+private:
+    DrawState _state;
+    // Scratch for recording, e.g. scene traversal
+    FrameArena _arena;
+    std::vector<glm::mat4> _transforms;
+    std::vector<Draw> _draws;
+};
+
+#endif // COMMANDLIST_HPP
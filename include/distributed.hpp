@@ -0,0 +1,102 @@
+#ifndef DISTRIBUTED_HPP
+#define DISTRIBUTED_HPP
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "camera.hpp"
+#include "frameBuffer.hpp"
+#include "jobSystem.hpp"
+#include "memoryReport.hpp"
+#include "world.hpp"
+
+// Renderer and animation state that workers mirror from the compositor every
+// frame
+struct WorkerSettings {
+    bool occlusionCulling = true;
+    bool frameReuse = false;
+    bool depthPrepass = false;
+    // Workers pose their scene at seconds into the first animation, the pose
+    // is kept while animation is off
+    bool animate = true;
+    float seconds = 0.f;
+};
+
+// Part of partCount that draws each node given the triangles each one draws
+// Parts are runs of nodes in World::nodes order with about the same number of
+// triangles, so nodes that an exporter wrote next to each other stay together
+std::vector<size_t> partitionNodes(const std::vector<size_t>& nodeTriangles, size_t partCount);
+
+class SharedFrame;
+
+// Sort-last rendering over worker processes on the same machine
+// Every worker parses the scene but only decodes the meshes and textures of
+// its part of the nodes, animates the whole node hierarchy, skins its own
+// meshes and draws them into color and depth in POSIX shared memory. The
+// compositor keeps the nearest sample of all workers for each pixel. Workers
+// show up as they finish loading, their part of the scene is missing until
+// then.
+// Shadows would only come from a worker's own part and blending over other
+// parts can't survive the depth merge, so workers draw without shadows and
+// draw blended materials opaque. Needs Linux for process shared semaphores,
+// elsewhere creating one throws.
+class DistributedRenderer
+{
+public:
+    // Starts workerCount copies of this executable with the given arguments,
+    // args[0] included, followed by --worker and a shared memory name
+    // With pinnedCores each worker also gets --pin-threads and --first-core so
+    // that worker i runs on cores from i * pinnedCores on
+    DistributedRenderer(
+        JobSystem* jobs,
+        const std::vector<std::string>& args,
+        size_t workerCount,
+        const glm::uvec2& maxRes,
+        uint32_t samples,
+        size_t pinnedCores = 0
+    );
+    // Stops the workers and waits for them to exit
+    ~DistributedRenderer();
+
+    DistributedRenderer(const DistributedRenderer&) = delete;
+    DistributedRenderer& operator=(const DistributedRenderer&) = delete;
+
+    // Draws a frame on all workers that are ready and merges it into fb, which
+    // has to fit in the resolution and samples given on creation
+    // Returns false if no image changed since the last frame, along with
+    // drawn and culled triangle counts. Rethrows worker errors.
+    std::tuple<bool, size_t, size_t> render(const Camera& camera, const WorkerSettings& settings, FrameBuffer* fb);
+
+    // Shared frames of all workers
+    MemoryUsage memoryUsage() const;
+
+private:
+    struct Worker {
+        std::unique_ptr<SharedFrame> frame;
+        // Process id until it has been waited for
+        int pid = -1;
+        bool ready = false;
+    };
+
+    // Throws if the worker exited
+    void checkAlive(Worker* worker);
+    void waitDone(Worker* worker);
+    void merge(const std::vector<const Worker*>& workers, FrameBuffer* fb);
+
+    JobSystem* _jobs;
+    std::vector<Worker> _workers;
+    // Ready workers in the last frame, none at all before the first
+    size_t _mergedCount = SIZE_MAX;
+};
+
+// Body of a worker process started by DistributedRenderer, returns once the
+// compositor stops it
+// Errors after the shared memory is open are posted to the compositor and
+// return false, failing to open it throws
+bool runRenderWorker(const std::string& sharedName, const std::string& scenePath, JobSystem* jobs, bool packVertices);
+
+#endif // DISTRIBUTED_HPP
@@ -0,0 +1,29 @@
+#ifndef DYNAMICRESOLUTION_HPP
+#define DYNAMICRESOLUTION_HPP
+
+#include <glm/glm.hpp>
+
+// Scales the render resolution from frame to frame to keep draw times under a
+// target. Resolution drops as soon as a frame goes over and recovers a little
+// each frame so load spikes don't turn into oscillation.
+class DynamicResolution
+{
+public:
+    // Scale applies to both axes
+    DynamicResolution(const glm::uvec2& maxRes, float targetMillis, float minScale = 0.5f);
+
+    float scale() const;
+    // Resolution for the next frame
+    glm::uvec2 res() const;
+
+    // Feeds back how long the last frame at res() took to draw
+    void update(float millis);
+
+private:
+    glm::uvec2 _maxRes;
+    float _targetMillis;
+    float _minScale;
+    float _scale = 1.f;
+};
+
+#endif // DYNAMICRESOLUTION_HPP
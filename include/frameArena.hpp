@@ -0,0 +1,93 @@
+#ifndef FRAMEARENA_HPP
+#define FRAMEARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Linear allocator for scratch memory that only lives until the next reset
+// Memory is kept between resets so steady state rendering doesn't malloc
+class FrameArena
+{
+public:
+    FrameArena(size_t blockSize = 1 << 16);
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    void* allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+    // No destructors are run on reset
+    template<typename T>
+    T* allocate(size_t count)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "Arena doesn't run destructors");
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+    // Frees everything at once
+    void reset();
+
+    size_t capacity() const;
+
+private:
+    struct Block {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size;
+    };
+
+    size_t _blockSize;
+    std::vector<Block> _blocks;
+    size_t _block = 0;
+    size_t _offset = 0;
+};
+
+// Lets standard containers allocate from an arena, they need to be destroyed
+// before it's reset
+template<typename T>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+
+    ArenaAllocator(FrameArena* arena) :
+        _arena(arena)
+    { }
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) :
+        _arena(other.arena())
+    { }
+
+    T* allocate(size_t count)
+    {
+        return static_cast<T*>(_arena->allocate(count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t count)
+    {
+        (void) p;
+        (void) count;
+    }
+
+    FrameArena* arena() const { return _arena; }
+
+private:
+    FrameArena* _arena;
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+    return a.arena() == b.arena();
+}
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+    return !(a == b);
+}
+
+#endif // FRAMEARENA_HPP
@@ -1,36 +1,69 @@
 #ifndef FRAMEBUFFER_HPP
 #define FRAMEBUFFER_HPP
 
-#include <GL/gl3w.h>
 #include <glm/glm.hpp>
 #include <vector>
 
 #include "color.hpp"
+#include "memoryReport.hpp"
 
 class FrameBuffer
 {
 public:
-    FrameBuffer(const glm::uvec2& res, const glm::uvec2& outRes);
-    ~FrameBuffer();
+    // Sample count of 1, 2, 4 or 8
+    // Storage is allocated for res, the resolution can be lowered later
+    FrameBuffer(const glm::uvec2& res, uint32_t samples = 1);
 
     const glm::uvec2& res() const;
-    float depth(const glm::ivec2& p) const;
+    const glm::uvec2& maxRes() const;
+    // Reuses the storage so changing it every frame is cheap, res has to fit
+    // in maxRes() and contents are undefined after a change
+    void setRes(const glm::uvec2& res);
+    uint32_t samples() const;
+    // Sample positions relative to the pixel center
+    const std::vector<glm::vec2>& sampleOffsets() const;
+    // Resolved colors, rows are res().x long and only the first res().y
+    // are valid
+    const std::vector<Color>& pixels() const;
+    Color sample(const glm::ivec2& p, uint32_t sample) const;
+    float depth(const glm::ivec2& p, uint32_t sample = 0) const;
+    // Depth samples laid out like the colors, rows are res().x * samples()
+    // long
+    const std::vector<float>& depths() const;
 
+    // Writes all samples of the pixel
     void setPixel(const glm::ivec2& p, const Color& color);
+    void setSample(const glm::ivec2& p, uint32_t sample, const Color& color);
     void setDepth(const glm::ivec2& p, float depth);
+    void setDepth(const glm::ivec2& p, uint32_t sample, float depth);
 
-    void display();
     void clear(const Color& color);
     void clearDepth(float value);
+    // Averages samples into the pixels, no-op without multisampling
+    void resolve();
+    // Copies the samples and depth of src to [offset, offset + src.res()),
+    // which has to fit, sample counts have to match
+    void copy(const FrameBuffer& src, const glm::uvec2& offset);
+
+    // Versions for the region [min, max), disjoint regions can be done in parallel
+    void clear(const Color& color, const glm::uvec2& min, const glm::uvec2& max);
+    void clearDepth(float value, const glm::uvec2& min, const glm::uvec2& max);
+    void resolve(const glm::uvec2& min, const glm::uvec2& max);
+
+    // Storage beyond the current resolution counts as wasted
+    MemoryUsage memoryUsage() const;
 
 private:
+    size_t sampleIndex(const glm::ivec2& p, uint32_t sample) const;
+
     glm::uvec2 _res;
-    glm::uvec2 _outRes;
-    std::vector<Color> _pixels;
+    glm::uvec2 _maxRes;
+    uint32_t _samples;
+    std::vector<glm::vec2> _sampleOffsets;
+    // Samples of each pixel are stored next to each other
+    std::vector<Color> _colors;
     std::vector<float> _depth;
-
-    GLuint _fbo;
-    GLuint _textureID;
+    std::vector<Color> _resolved;
 };
 
 #endif // FRAMEBUFFER_HPP
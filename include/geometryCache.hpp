@@ -0,0 +1,71 @@
+#ifndef GEOMETRYCACHE_HPP
+#define GEOMETRYCACHE_HPP
+
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+#include "mesh.hpp"
+#include "world.hpp"
+
+// Writes the geometry of every primitive in world, in mesh order
+// sources are the files world was loaded from, the cache is only valid while
+// their sizes and modification times stay the same
+// The format is native-endian so a cache is only meant for the machine that
+// built it
+// The file is written under path + ".tmp" and renamed to path when complete
+void writeGeometryCache(
+    const std::string& path,
+    const World& world,
+    const std::vector<std::string>& sources,
+    bool packVertices
+);
+
+// Read-only view of a geometry cache that loads single primitives on demand
+// The file is memory mapped where supported so reads don't go through an
+// intermediate buffer and the pages can be dropped right after
+class GeometryCache
+{
+public:
+    struct Entry {
+        uint64_t offset;
+        uint64_t positions;
+        uint64_t normals;
+        uint64_t tangents;
+        uint64_t texCoord0s;
+        uint64_t tris;
+        uint64_t packedPositions;
+        uint64_t packedNormals;
+        uint64_t packedTangents;
+        uint64_t packedTexCoord0s;
+        uint64_t joints;
+        uint64_t weights;
+        glm::vec3 min;
+        glm::vec3 max;
+    };
+
+    // Throws if path isn't a cache of this version, was written with other
+    // packing, any of its sources changed since or its data is cut off
+    GeometryCache(const std::string& path, bool packVertices);
+    ~GeometryCache();
+
+    GeometryCache(const GeometryCache&) = delete;
+    GeometryCache& operator=(const GeometryCache&) = delete;
+
+    size_t primitiveCount() const;
+    const Entry& entry(size_t primitive) const;
+    // Bytes the primitive's attributes take when resident
+    size_t byteSize(size_t primitive) const;
+
+    // Fills the attribute vectors, safe to call from many threads
+    void read(size_t primitive, Primitive* out) const;
+
+private:
+    std::string _path;
+    std::vector<Entry> _entries;
+
+    const uint8_t* _mapping = nullptr;
+    size_t _mappingSize = 0;
+};
+
+#endif // GEOMETRYCACHE_HPP
@@ -0,0 +1,125 @@
+#ifndef JOBSYSTEM_HPP
+#define JOBSYSTEM_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing scheduler shared by loading and rendering
+// Each thread pushes and pops its own deque from the back, idle threads steal
+// the oldest jobs from the front of the others'
+class JobSystem
+{
+public:
+    class Counter;
+
+    // Background jobs go to a queue of their own that threads only take from
+    // when they have nothing else to do or wait on background work, so a
+    // long one never runs inside a wait on normal jobs
+    enum class Priority {
+        Normal,
+        Background
+    };
+
+private:
+    using RangeFn = void (*)(const void* context, size_t begin, size_t end);
+
+    // Either fn or range over [begin, end) is set, ranges don't allocate
+    struct Job {
+        std::function<void()> fn;
+        RangeFn range = nullptr;
+        const void* context = nullptr;
+        size_t begin = 0;
+        size_t end = 0;
+        Counter* counter = nullptr;
+    };
+
+public:
+    // Tracks pending jobs, other jobs can be queued to run once it hits zero
+    class Counter
+    {
+    public:
+        Counter() = default;
+        Counter(const Counter&) = delete;
+        Counter& operator=(const Counter&) = delete;
+
+        bool done() const;
+
+    private:
+        friend class JobSystem;
+
+        std::atomic<size_t> _pending{0};
+        mutable std::mutex _mutex;
+        std::vector<Job> _dependents;
+    };
+
+    // Zero threads uses all hardware threads, the creating thread counts as one
+    // and helps while it waits
+    // Pinned threads go to consecutive cores from firstCore on
+    JobSystem(uint32_t threadCount = 0, bool pinThreads = false, uint32_t firstCore = 0);
+    ~JobSystem();
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    uint32_t threadCount() const;
+    // Index of the calling thread in [0, threadCount) or threadCount for
+    // threads outside the system. Per-thread data is sized threadCount + 1,
+    // so only one outside thread may ask, the first one to do so owns the
+    // last slot.
+    uint32_t threadIndex() const;
+
+    void run(std::function<void()> fn, Counter* counter = nullptr);
+    // Queues fn once dependency has no pending jobs
+    void runAfter(Counter* dependency, std::function<void()> fn, Counter* counter = nullptr);
+    // Runs queued jobs of the given priority until counter has no pending
+    // jobs
+    void wait(Counter* counter, Priority priority = Priority::Normal);
+    // Calls fn(begin, end) for consecutive ranges of at most grain items and
+    // waits for all
+    template<typename Fn>
+    void parallelFor(size_t begin, size_t end, size_t grain, const Fn& fn, Priority priority = Priority::Normal)
+    {
+        const RangeFn range = [](const void* context, size_t b, size_t e){
+            (*static_cast<const Fn*>(context))(b, e);
+        };
+        parallelFor(begin, end, grain, range, &fn, priority);
+    }
+
+private:
+    // Ring buffer that keeps its memory
+    struct Worker {
+        std::mutex mutex;
+        std::vector<Job> ring;
+        size_t head = 0;
+        size_t count = 0;
+
+        void pushBack(Job job);
+        Job popBack();
+        Job popFront();
+    };
+
+    void parallelFor(size_t begin, size_t end, size_t grain, RangeFn range, const void* context, Priority priority);
+    void push(Job job, Priority priority = Priority::Normal);
+    bool tryPop(Job* job);
+    bool tryPopBackground(Job* job);
+    void execute(Job* job);
+    void work(uint32_t index);
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    // Shared by all threads and taken oldest first
+    Worker _background;
+    std::vector<std::thread> _threads;
+    std::atomic<size_t> _queued{0};
+    std::atomic<uint32_t> _nextForeign{0};
+    mutable std::atomic<std::thread::id> _foreignOwner{};
+    std::atomic<bool> _stop{false};
+    std::mutex _sleepMutex;
+    std::condition_variable _wake;
+};
+
+#endif // JOBSYSTEM_HPP
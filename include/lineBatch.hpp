@@ -0,0 +1,108 @@
+#ifndef LINEBATCH_HPP
+#define LINEBATCH_HPP
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "animator.hpp"
+#include "clip.hpp"
+#include "color.hpp"
+#include "commandList.hpp"
+#include "memoryReport.hpp"
+#include "mesh.hpp"
+#include "world.hpp"
+
+// Frame-local list of world space lines, e.g. wireframes and bounds, that is
+// recorded by the application and drawn over a finished frame in one go by a
+// Renderer
+class LineBatch
+{
+public:
+    struct Line {
+        glm::vec3 p0;
+        glm::vec3 p1;
+        Color color;
+        LineState state;
+    };
+
+    // Marks edges that more than two triangles share
+    static const uint32_t SHARED_FACES = UINT32_MAX;
+
+    // Unique edges of a primitive's triangles
+    struct Edges {
+        // Index pairs into the vertices
+        std::vector<glm::uvec2> vertices;
+        // Triangles on either side, open edges have the same one twice
+        std::vector<glm::uvec2> faces;
+    };
+
+    // Edges of a primitive's triangles, its vertices are transformed once
+    // for all of them
+    struct Wireframe {
+        const Primitive* primitive;
+        // Replaces the primitive's vertices if set
+        const SkinnedVertices* skinned;
+        glm::mat4 modelToWorld;
+        const Edges* edges;
+        Color color;
+        LineState state;
+        // Skips edges that only back faces touch, like the triangles a draw
+        // culls
+        bool cullBackFaces;
+    };
+
+    // Drops recorded lines, primitive edges are kept for later frames
+    void reset();
+    // Drops the edges kept for primitives, they have to go before the
+    // primitives do, e.g. when the world is replaced
+    void clearEdges();
+
+    // Applies to lines recorded after this
+    void setState(const LineState& state);
+
+    void addLine(const glm::vec3& p0, const glm::vec3& p1, const Color& color);
+    // Edges of the box [min, max] in model space
+    void addBox(const glm::vec3& min, const glm::vec3& max, const glm::mat4& modelToWorld, const Color& color);
+    // Edges shared by triangles are drawn once
+    void addWireframe(const Primitive& primitive, const glm::mat4& modelToWorld, const Color& color, bool cullBackFaces = true, const SkinnedVertices* skinned = nullptr);
+    // Wireframes of every instance of the recorded draws
+    void addWireframes(const CommandList& commands, const Color& color);
+    // Bounds of every instance of the recorded draws
+    void addBounds(const CommandList& commands, const Color& color);
+    // Bounding volume hierarchy of the current scene's node graph, a box
+    // around each subtree with colors cycling by depth. Nodes are posed by
+    // animator if set.
+    void addHierarchy(const World& world, const Animator* animator = nullptr);
+
+    const std::vector<Line>& lines() const;
+    const std::vector<Wireframe>& wireframes() const;
+    // Lines of all wireframes
+    size_t wireframeLineCount() const;
+
+    // Recorded lines and the edges kept for primitives
+    MemoryUsage memoryUsage() const;
+
+private:
+    // Edges of a primitive's triangles as they were when found
+    struct CachedEdges {
+        const TriIndices* tris = nullptr;
+        size_t triCount = 0;
+        size_t vertexCount = 0;
+        Edges edges;
+    };
+
+    // Found again when the primitive's triangles or vertex count change
+    const Edges& edges(const Primitive& primitive);
+    // Adds boxes of node's subtree and grows [min, max] by its world bounds
+    void addSubtree(const World& world, const Animator* animator, const Scene::Node* node, const glm::mat4& parentToWorld, size_t depth, glm::vec3* min, glm::vec3* max);
+
+    LineState _state;
+    std::vector<Line> _lines;
+    std::vector<Wireframe> _wireframes;
+    size_t _wireframeLines = 0;
+    std::unordered_map<const Primitive*, CachedEdges> _edges;
+};
+
+#endif // LINEBATCH_HPP
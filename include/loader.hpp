@@ -1,12 +1,70 @@
 #ifndef LOADER_HPP
 #define LOADER_HPP
 
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include "jobSystem.hpp"
 #include "mesh.hpp"
 #include "world.hpp"
 
+// Picks the nodes to load given the triangles each node draws, both indexed
+// like World::nodes
+using NodeFilter = std::function<std::vector<uint8_t>(const std::vector<size_t>& nodeTriangles)>;
+
 Mesh loadOBJ(const std::string& path);
-World loadGLTF(const std::string& path);
+// Images and meshes are decoded in parallel on jobs
+// Vertices are optionally packed, see PackedVertices
+// With a filter only the meshes and textures of the nodes it keeps are
+// decoded, the other nodes stay in the scene graph without a mesh
+World loadGLTF(const std::string& path, JobSystem* jobs, bool packVertices = false, const NodeFilter& filter = nullptr);
+
+// Loads a glTF in the background so rendering can start right away
+// The scene graph shows up first with empty primitives, meshes fill in as they
+// are decoded and textures come last
+// Decoding runs as background jobs, see JobSystem::Priority
+class WorldLoader
+{
+public:
+    // Without geometry primitives only get their bounds and stay empty for a
+    // geometry cache to fill in
+    WorldLoader(const std::string& path, JobSystem* jobs, bool packVertices = false, bool geometry = true);
+    // Stops after what is being decoded, parsing can't be interrupted
+    ~WorldLoader();
+
+    WorldLoader(const WorldLoader&) = delete;
+    WorldLoader& operator=(const WorldLoader&) = delete;
+
+    // Moves finished work into world, call between frames with the same world
+    // Returns true once everything is in, rethrows loading errors
+    bool update(World* world);
+
+    // The glTF and its buffer files, set once update() returned true
+    const std::vector<std::string>& sourceFiles() const;
+
+private:
+    void load(const std::string& path);
+
+    JobSystem* _jobs;
+    bool _packVertices;
+    bool _geometry;
+    std::thread _thread;
+    std::atomic<bool> _cancel{false};
+
+    std::mutex _mutex;
+    std::unique_ptr<World> _skeleton;
+    std::vector<std::pair<size_t, Mesh>> _meshes;
+    std::vector<Texture> _textures;
+    std::vector<std::string> _sourceFiles;
+    bool _done = false;
+    std::exception_ptr _error;
+};
 
 #endif // LOADER_HPP
@@ -12,6 +12,9 @@ struct Material {
     glm::vec4 baseColorFactor = glm::vec4(1.f);
     float metallicFactor = 1.f;
     float roughnessFactor = 1.f;
+    // Blended over what's behind with the alpha of baseColorFactor, opaque
+    // materials ignore it
+    bool blend = false;
 };
 
 #endif // MATERIAL_HPP
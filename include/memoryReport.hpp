@@ -0,0 +1,91 @@
+#ifndef MEMORYREPORT_HPP
+#define MEMORYREPORT_HPP
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct World;
+
+// Bytes held by containers, reserved but unused capacity is wasted
+struct MemoryUsage {
+    size_t used = 0;
+    size_t reserved = 0;
+
+    template<typename T, typename Alloc>
+    void add(const std::vector<T, Alloc>& values)
+    {
+        used += values.size() * sizeof(T);
+        reserved += values.capacity() * sizeof(T);
+    }
+
+    void add(const MemoryUsage& other)
+    {
+        used += other.used;
+        reserved += other.reserved;
+    }
+
+    size_t wasted() const
+    {
+        return reserved - used;
+    }
+};
+
+enum class MemoryCategory {
+    Textures,
+    // Vertex attributes, skinned ones included
+    Vertices,
+    Indices,
+    FrameBuffers,
+    // Renderer arenas, bins, shadow map and such
+    RenderScratch,
+    Count
+};
+
+const size_t MEMORY_CATEGORY_COUNT = static_cast<size_t>(MemoryCategory::Count);
+
+const char* memoryCategoryName(MemoryCategory category);
+
+// Steady-state footprint of the large buffers at one point in time
+// Sizes are measured from the containers that own them when the report is
+// put together, so streaming and compression show up as they happen
+// Buffers that only live while the scene loads (the parsed glTF, decoded
+// images and meshes waiting to be handed over) aren't counted, neither are
+// copies that only exist for a moment like an arena merging its blocks, so
+// the process peaks higher than the report while loading
+struct MemoryReport {
+    std::array<MemoryUsage, MEMORY_CATEGORY_COUNT> categories;
+    // Vertices and indices, indexed like World::meshes
+    std::vector<MemoryUsage> meshes;
+    // Indexed like World::textures
+    std::vector<MemoryUsage> textures;
+
+    // Replaces the mesh and texture lists
+    void addWorld(const World& world);
+    void add(MemoryCategory category, const MemoryUsage& usage);
+
+    MemoryUsage total() const;
+};
+
+// Keeps the latest report and the peak reserved bytes since creation
+// Peaks are of the reports it was given, not of the process
+class MemoryTracker
+{
+public:
+    void update(MemoryReport report);
+
+    const MemoryReport& current() const;
+    size_t peak(MemoryCategory category) const;
+    size_t peakTotal() const;
+
+    // Current and peak bytes per category and per mesh and texture sizes
+    void writeJson(const std::string& path) const;
+
+private:
+    MemoryReport _current;
+    std::array<size_t, MEMORY_CATEGORY_COUNT> _peaks{};
+    size_t _peakTotal = 0;
+};
+
+#endif // MEMORYREPORT_HPP
@@ -2,6 +2,10 @@
 #define MESH_HPP
 
 #include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+#include <glm/gtc/type_precision.hpp>
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 struct TriIndices {
@@ -19,6 +23,18 @@ struct TriIndices {
 
 struct Material;
 
+// Vertex attributes at 18 bytes per vertex instead of 48
+// Positions are unorm16 within the primitive's bounds, normals and tangents
+// octahedral snorm16 and texture coordinates half floats
+struct PackedVertices {
+    std::vector<glm::u16vec3> positions;
+    std::vector<glm::i16vec2> normals;
+    // Bitangent sign is in the lowest bit of y
+    std::vector<glm::i16vec2> tangents;
+    std::vector<glm::u16vec2> texCoord0s;
+};
+
+// Vertices are either in the float attributes or packed
 struct Primitive {
     glm::vec3 min = glm::vec3(0.f);
     glm::vec3 max = glm::vec3(0.f);
@@ -27,13 +43,65 @@ struct Primitive {
     std::vector<glm::vec4> tangents;
     std::vector<glm::vec2> texCoord0s;
     std::vector<TriIndices> tris;
+    PackedVertices packed;
+    // Skin influences, four per vertex if skinned and empty otherwise
+    std::vector<glm::u16vec4> joints;
+    std::vector<glm::vec4> weights;
     const Material* material = nullptr;
 };
 
+// Attributes that replace a primitive's own for one frame, e.g. when skinned
+// Texture coordinates and triangles still come from the primitive
+struct SkinnedVertices {
+    glm::vec3 min = glm::vec3(0.f);
+    glm::vec3 max = glm::vec3(0.f);
+    std::vector<glm::vec3> positions;
+    // Empty if the primitive has none
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec4> tangents;
+};
+
 struct Mesh {
     glm::vec3 min = glm::vec3(0.f);
     glm::vec3 max = glm::vec3(0.f);
     std::vector<Primitive> primitives;
 };
 
+size_t vertexCount(const Primitive& primitive);
+bool hasNormals(const Primitive& primitive);
+// Exchanges vertex and index data, bounds and material stay
+void swapGeometry(Primitive* a, Primitive* b);
+// Merges vertices whose float attributes and skin influences are identical
+// and drops triangles that collapse, order of the rest is kept
+void weldVertices(Primitive* primitive);
+// Replaces the float attributes with packed ones
+void packVertices(Primitive* primitive);
+
+// Maps packed positions to model space
+glm::mat4 unpackPositionTransform(const Primitive& primitive);
+
+inline glm::vec3 unpackOctahedral(const glm::i16vec2& packed)
+{
+    const glm::vec2 p(
+        glm::unpackSnorm1x16(static_cast<uint16_t>(packed.x)),
+        glm::unpackSnorm1x16(static_cast<uint16_t>(packed.y))
+    );
+    glm::vec3 n(p.x, p.y, 1.f - std::abs(p.x) - std::abs(p.y));
+    // Lower hemisphere is folded over the diagonals
+    const float t = std::max(-n.z, 0.f);
+    n.x += n.x >= 0.f ? -t : t;
+    n.y += n.y >= 0.f ? -t : t;
+    return glm::normalize(n);
+}
+
+inline glm::vec4 unpackTangent(const glm::i16vec2& packed)
+{
+    return glm::vec4(unpackOctahedral(packed), packed.y & 1 ? -1.f : 1.f);
+}
+
+inline glm::vec2 unpackTexCoord(const glm::u16vec2& packed)
+{
+    return glm::vec2(glm::unpackHalf1x16(packed.x), glm::unpackHalf1x16(packed.y));
+}
+
 #endif // MESH_HPP
@@ -0,0 +1,56 @@
+#ifndef OCCLUSIONBUFFER_HPP
+#define OCCLUSIONBUFFER_HPP
+
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "frameBuffer.hpp"
+
+// Window space bounds of a box and the depth of its nearest point
+struct ScreenRect {
+    glm::vec2 min;
+    glm::vec2 max;
+    float depth;
+};
+
+// Coarse buffer of the farthest depth in each tile of a depth buffer
+// Tiles are refreshed lazily from the depth buffer so draws submitted
+// front-to-back act as occluders for the ones after them
+class OcclusionBuffer
+{
+public:
+    static const uint32_t TILE_SIZE = 8;
+
+    OcclusionBuffer(const glm::uvec2& res);
+
+    const glm::uvec2& res() const;
+    // Keeps the storage when shrinking, contents are reset like clear()
+    void setRes(const glm::uvec2& res);
+
+    // Resets to match a depth buffer cleared to 1
+    void clear();
+
+    // Returns false if the box crosses the near plane and can't be bounded
+    static bool project(const glm::vec3& min, const glm::vec3& max, const glm::mat4& modelToClip, const glm::uvec2& res, ScreenRect* rect);
+
+    // Returns true if some part of rect could pass the depth test in fb
+    bool visible(const ScreenRect& rect, const FrameBuffer& fb);
+
+    // Marks tiles under rect for refreshing after drawing into them
+    void invalidate(const ScreenRect& rect);
+    void invalidateAll();
+
+    MemoryUsage memoryUsage() const;
+
+private:
+    glm::uvec2 tileMin(const ScreenRect& rect) const;
+    glm::uvec2 tileMax(const ScreenRect& rect) const;
+    float tileDepth(const glm::uvec2& tile, const FrameBuffer& fb);
+
+    glm::uvec2 _res;
+    glm::uvec2 _tiles;
+    std::vector<float> _maxDepth;
+    std::vector<uint8_t> _dirty;
+};
+
+#endif // OCCLUSIONBUFFER_HPP
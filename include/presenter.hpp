@@ -0,0 +1,198 @@
+#ifndef PRESENTER_HPP
+#define PRESENTER_HPP
+
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frameBuffer.hpp"
+
+// Target for finished frames
+// begin(), end() and flush() are called on the render thread, write() on the
+// presenter's worker thread for the same slot in between
+class PresentBackend
+{
+public:
+    virtual ~PresentBackend() = default;
+
+    virtual void begin(size_t slot) { (void) slot; }
+    virtual void write(const FrameBuffer& fb, size_t slot) = 0;
+    virtual void end(size_t slot) { (void) slot; }
+    // Shows the last ended frame again
+    virtual void repeat() { }
+    // Waits until ended frames are out of the backend's hands, throws if any
+    // of them failed
+    virtual void flush() { }
+
+    // Host memory the backend keeps frames in, safe to call on the render
+    // thread while frames are written
+    virtual MemoryUsage memoryUsage() const { return {}; }
+};
+
+// Double/triple buffered presentation
+// Frame N is written out on a worker thread while the render thread fills
+// the next back buffer, at the cost of one frame of latency
+class Presenter
+{
+public:
+    Presenter(
+        std::unique_ptr<PresentBackend> backend,
+        const glm::uvec2& res,
+        uint32_t samples = 1,
+        size_t bufferCount = 2
+    );
+    ~Presenter();
+
+    Presenter(const Presenter&) = delete;
+    Presenter& operator=(const Presenter&) = delete;
+
+    FrameBuffer& backBuffer();
+
+    // Hands the back buffer over and waits until the next one is free
+    // Rethrows the first error the backend hit writing a frame
+    void present();
+    // Shows the last presented frame again instead of a new one
+    void repeat();
+    // Waits until all presented frames have been written and the backend is
+    // done with them, rethrows errors like present()
+    // The destructor can't report errors, call this before it to see those of
+    // the last frames
+    void flush();
+
+    // Back buffers and what the backend keeps
+    MemoryUsage memoryUsage() const;
+
+private:
+    struct InFlight {
+        size_t slot;
+        size_t frame;
+    };
+
+    void retireOldest();
+    void work();
+
+    std::unique_ptr<PresentBackend> _backend;
+    std::vector<FrameBuffer> _buffers;
+    size_t _current = 0;
+    size_t _presented = 0;
+    std::deque<InFlight> _inFlight;
+
+    std::thread _worker;
+    std::mutex _mutex;
+    std::condition_variable _queued;
+    std::condition_variable _written;
+    std::deque<size_t> _queue;
+    size_t _writtenFrames = 0;
+    // First error of the worker thread, thrown on the render thread
+    std::exception_ptr _error;
+    bool _stop = false;
+};
+
+// Streams frames through pixel unpack buffers into a texture that is blitted
+// to the default framebuffer
+// Frames can be smaller than res, they are uploaded to a corner of the texture
+// and scaled up to outRes by the blit
+class GLPresentBackend : public PresentBackend
+{
+public:
+    GLPresentBackend(const glm::uvec2& res, const glm::uvec2& outRes, size_t bufferCount = 2);
+    ~GLPresentBackend();
+
+    void begin(size_t slot) override;
+    void write(const FrameBuffer& fb, size_t slot) override;
+    void end(size_t slot) override;
+    void repeat() override;
+
+private:
+    void blit();
+
+    glm::uvec2 _res;
+    glm::uvec2 _outRes;
+    size_t _byteSize;
+    // Resolution of the frame in each slot and of the one in the texture
+    std::vector<glm::uvec2> _slotRes;
+    glm::uvec2 _shownRes;
+
+    GLuint _fbo;
+    GLuint _textureID;
+    std::vector<GLuint> _pbos;
+    std::vector<void*> _mapped;
+};
+
+// Discards frames, for headless benchmarking
+class NullPresentBackend : public PresentBackend
+{
+public:
+    void write(const FrameBuffer& fb, size_t slot) override;
+};
+
+enum class ImageFormat {
+    // Binary ppm, no encoding at all
+    Ppm,
+    // Quite OK Image format, fast lossless compression
+    Qoi,
+    Png
+};
+
+// Writes frames as numbered images into a directory
+// write() only copies the frame into a recycled buffer and worker threads
+// encode and save it. Once every buffer is queued write() blocks so slow
+// encoding or disks hold rendering back instead of piling up frames.
+class FilePresentBackend : public PresentBackend
+{
+public:
+    // Zero threads uses all hardware threads, each gets two buffers
+    FilePresentBackend(const std::string& directory, ImageFormat format = ImageFormat::Ppm, uint32_t threadCount = 0);
+    // Finishes queued frames, their errors are dropped
+    ~FilePresentBackend();
+
+    FilePresentBackend(const FilePresentBackend&) = delete;
+    FilePresentBackend& operator=(const FilePresentBackend&) = delete;
+
+    // Rethrows the first error a worker hit
+    void write(const FrameBuffer& fb, size_t slot) override;
+    // Waits until all written frames are saved, rethrows the first error
+    void flush() override;
+
+    // Frame copies and encoding buffers
+    MemoryUsage memoryUsage() const override;
+
+private:
+    // Resolved pixels with rows top to bottom
+    struct Frame {
+        size_t index;
+        glm::uvec2 res;
+        std::vector<Color> pixels;
+    };
+
+    void work();
+
+    std::string _directory;
+    ImageFormat _format;
+    size_t _frame = 0;
+    size_t _bufferCount;
+
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _queued;
+    std::condition_variable _recycled;
+    std::deque<std::unique_ptr<Frame>> _queue;
+    std::vector<std::unique_ptr<Frame>> _free;
+    std::exception_ptr _error;
+    bool _stop = false;
+
+    // Kept up to date by whichever thread resizes a buffer since the buffers
+    // move between threads
+    std::atomic<size_t> _usedBytes{0};
+    std::atomic<size_t> _reservedBytes{0};
+};
+
+#endif // PRESENTER_HPP
@@ -0,0 +1,288 @@
+#ifndef RENDERER_HPP
+#define RENDERER_HPP
+
+#include <glm/glm.hpp>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "camera.hpp"
+#include "clip.hpp"
+#include "color.hpp"
+#include "commandList.hpp"
+#include "frameArena.hpp"
+#include "frameBuffer.hpp"
+#include "jobSystem.hpp"
+#include "lineBatch.hpp"
+#include "occlusionBuffer.hpp"
+#include "residency.hpp"
+
+// Executes command lists front-to-back in waves: vertex work runs in parallel
+// per draw, the resulting triangles are binned to screen tiles and tiles are
+// rasterized in parallel
+class Renderer
+{
+public:
+    static const uint32_t TILE_SIZE = 64;
+    static const uint32_t SHADOW_MAP_SIZE = 1024;
+
+    // Frame buffer to draw a camera's view into
+    struct View {
+        const Camera* camera;
+        FrameBuffer* fb;
+    };
+
+    Renderer(JobSystem* jobs);
+
+    // Skips draws whose bounds are hidden behind earlier draws, on top of
+    // their own state
+    void setOcclusionCulling(bool enabled);
+    // Requests visible primitives from residency and draws the bounds of the
+    // ones that aren't loaded yet
+    void setResidency(ResidencyManager* residency);
+    // Lets beginFrame() keep tiles that no changed draw touches
+    void setFrameReuse(bool enabled);
+    // Lays down depth for all draws that write it before shading so only
+    // visible pixels get shaded
+    void setDepthPrepass(bool enabled);
+    // Renders a depth-only shadow map from the light in execute() and darkens
+    // pixels that it hides. The map covers what the camera sees and is only
+    // redrawn when a caster or the camera changes.
+    void setShadows(bool enabled);
+
+    // Compares commands with what was drawn before to find the tiles of fb
+    // that are out of date. clear(), execute() and resolve() skip the other
+    // tiles until the next call. Returns false if nothing changed since the
+    // last frame so the previous image can be shown again.
+    bool beginFrame(const CommandList& commands, const Camera& camera, const FrameBuffer& fb);
+
+    void clear(const Color& color, float depth, FrameBuffer* fb);
+    void resolve(FrameBuffer* fb);
+
+    // Draws are sorted front-to-back to get the most out of the depth test
+    // State changes are free here so they don't affect the order
+    // Draws with blended materials go last, they are tested against the
+    // depth of all others and summed per tile in any order, see BlendBuffer
+    // Returns drawn and culled triangle counts
+    std::tuple<size_t, size_t> execute(const CommandList& commands, const Camera& camera, FrameBuffer* fb);
+    // Draws the commands into several views at once, e.g. stereo pairs or
+    // cubemap faces. Vertices are transformed to world space once for all
+    // views, then each view culls and rasterizes in parallel. Frame buffers
+    // are drawn whole and have to be cleared beforehand.
+    // Writes drawn and culled triangle counts of each view to counts, which
+    // has to hold viewCount
+    void executeViews(const CommandList& commands, const View* views, size_t viewCount, std::tuple<size_t, size_t>* counts);
+    // Draws the lines over what's in fb, before it is resolved. Lines are
+    // clipped and transformed in parallel, binned to screen tiles in
+    // recording order and tiles are rasterized in parallel.
+    // Returns the number of lines that weren't clipped away
+    size_t drawLines(const LineBatch& lines, const Camera& camera, FrameBuffer* fb);
+
+    // Memory kept between frames, including the shadow map and the renderers
+    // of executeViews() views
+    MemoryUsage memoryUsage() const;
+
+private:
+    // What executeDraws() writes to the frame buffer
+    enum class Pass {
+        // Shaded color and depth
+        Color,
+        // Depth only for the prepass
+        Depth,
+        // Color of the pixels whose depth matches what the prepass left
+        ColorOverDepth,
+        // Depth only from the light into every tile
+        Shadow,
+        // Color of blended draws, summed per tile and composited over it
+        Transparent
+    };
+
+    // Single instance of a recorded draw
+    struct Instance {
+        size_t draw;
+        size_t transform;
+        // View depth of the bounds' center
+        float depth;
+        // Bounding sphere is outside the view frustum
+        bool outside;
+        // Culled as occluded in the depth prepass
+        bool hidden;
+    };
+
+    struct Triangle {
+        std::array<glm::vec4, 3> clipVerts;
+        RasterFn raster;
+        // Used instead of raster in the transparent pass
+        BlendFn blend;
+        ShadingInputs inputs;
+        // Covered bins -> [min, max)
+        glm::uvec2 binMin;
+        glm::uvec2 binMax;
+    };
+
+    // Draw that made it into the current wave
+    // Triangles live in the arena of the thread that processed the draw
+    struct WaveDraw {
+        size_t instance;
+        bool bounded;
+        ScreenRect rect;
+        Triangle* tris;
+        size_t triCount;
+        size_t culledTris;
+    };
+
+    // What an instance drew, compared between frames
+    struct DrawKey {
+        const Primitive* primitive;
+        // Geometry is swapped in place when it's loaded or evicted
+        const void* positions;
+        const void* tris;
+        const Material* material;
+        DrawState state;
+        glm::mat4 transform;
+    };
+
+    // Line ready to rasterize in the bins [binMin, binMax)
+    struct BinnedLine {
+        LineSetup setup;
+        Color color;
+        LineState state;
+        glm::uvec2 binMin;
+        glm::uvec2 binMax;
+    };
+
+    // Bins covered by rect -> [min, max), everything if it isn't bounded
+    void rectBins(const ScreenRect& rect, bool bounded, const glm::uvec2& res, glm::uvec2* min, glm::uvec2* max) const;
+    bool binDirty(size_t bin) const;
+
+    // Culls instances against the frustum and sorts them front-to-back
+    void sortDraws(const CommandList& commands, const Camera& camera);
+    // Runs the passes over the draws sorted for camera
+    std::tuple<size_t, size_t> drawSorted(const CommandList& commands, const Camera& camera, FrameBuffer* fb);
+    std::tuple<size_t, size_t> executeDraws(const CommandList& commands, const Camera& camera, Pass pass, FrameBuffer* fb);
+    static DrawKey drawKey(const CommandList::Draw& draw, const glm::mat4& modelToWorld);
+    static bool sameDraw(const DrawKey& a, const DrawKey& b);
+
+    // Fits the light's view around what the cameras see and the casters
+    // between it and them. Marks the shadow map stale if the fit or any
+    // caster changed since it was drawn.
+    void fitShadowMap(const CommandList& commands, const Camera* const* cameras, size_t cameraCount);
+    // Fills _shadowMap from the light fitted last
+    void renderShadowMap(const CommandList& commands);
+    // Makes room for world space vertices of instances inside any of the
+    // first viewCount views
+    void shareVertices(const CommandList& commands, size_t viewCount);
+    // Primitive that gets drawn in place of draw's and its transform
+    const Primitive& drawnPrimitive(const CommandList::Draw& draw) const;
+    glm::mat4 drawnTransform(const CommandList::Draw& draw, const glm::mat4& modelToWorld) const;
+    void processDraw(const CommandList& commands, const Camera& camera, const glm::uvec2& res, Pass pass, WaveDraw* waveDraw) const;
+    void rasterizeBins(FrameBuffer* fb);
+    // Adds the transparent triangles of each bin to the bin's blend buffer
+    void blendBins(FrameBuffer* fb);
+    // Composites the blend buffers of the transparent pass over their bins
+    void compositeBins(FrameBuffer* fb);
+
+    // Calls fn(min, max) in parallel for each dirty bin's pixel region
+    template<typename Fn>
+    void forEachBin(const glm::uvec2& res, const Fn& fn);
+
+    JobSystem* _jobs;
+    // Scratch memory for each job thread and one for the outside thread that
+    // drives the renderer, see JobSystem::threadIndex. Reset after every wave
+    std::vector<std::unique_ptr<FrameArena>> _arenas;
+
+    std::vector<Instance> _instances;
+    // Instance order of the last frame, usually only needs a few swaps to be
+    // valid again
+    std::vector<size_t> _order;
+
+    bool _occlusionCulling = true;
+    bool _frameReuse = false;
+    bool _depthPrepass = false;
+    bool _shadows = false;
+    ResidencyManager* _residency = nullptr;
+    // Unit cube standing in for primitives that aren't resident
+    Primitive _proxy;
+    std::unique_ptr<OcclusionBuffer> _occlusion;
+
+    std::unique_ptr<FrameBuffer> _shadowMap;
+    Camera _light;
+    // World space to shadow map window coordinates and depth
+    glm::mat4 _worldToShadow = glm::mat4(1.f);
+    // Casters the map was last fitted to, it is only redrawn when they or
+    // the fit change
+    std::vector<DrawKey> _shadowKeys;
+    std::vector<DrawKey> _nextShadowKeys;
+    bool _shadowStale = true;
+    // Instance order of the last shadow pass
+    std::vector<size_t> _shadowOrder;
+
+    // Renderers of executeViews() views, they point back here for shared data
+    std::vector<std::unique_ptr<Renderer>> _views;
+    // Cameras of the views the shadow map is fitted to
+    std::vector<const Camera*> _viewCameras;
+    Renderer* _shared = nullptr;
+    // World space vertices of instances in recording order starting at
+    // _sharedFirst, filled by whichever view draws the instance first
+    std::vector<size_t> _sharedFirst;
+    // Grows with the instance count and is reset in place every call
+    std::unique_ptr<std::atomic<uint8_t>[]> _sharedStates;
+    size_t _sharedStateCapacity = 0;
+    std::vector<glm::vec4> _sharedPositions;
+    std::vector<Varyings> _sharedVaryings;
+
+    // Instances and covered bins -> (min, max) of the last frame and tiles that changed in
+    // each of the last few, frame buffers are redrawn based on their age
+    std::vector<DrawKey> _drawKeys;
+    std::vector<glm::uvec4> _drawBins;
+    std::vector<DrawKey> _nextKeys;
+    std::vector<glm::uvec4> _nextBins;
+    // Shadow map texels (min, max) instances covered, with shadows on a
+    // changed caster dirties the receivers under it
+    std::vector<glm::vec4> _shadowRects;
+    std::vector<glm::vec4> _nextShadowRects;
+    // Rects of changed casters before and after, kept to avoid reallocating
+    std::vector<glm::vec4> _shadowChanges;
+    glm::mat4 _lastWorldToClip = glm::mat4(0.f);
+    glm::uvec2 _lastRes = glm::uvec2(0);
+    size_t _frame = 0;
+    std::vector<std::vector<uint8_t>> _changes;
+    std::unordered_map<const FrameBuffer*, size_t> _drawnFrames;
+    // Empty if every bin is redrawn
+    std::vector<uint8_t> _dirtyBins;
+
+    // Reused between waves and frames to avoid reallocating
+    std::vector<WaveDraw> _wave;
+    size_t _waveSize = 0;
+    glm::uvec2 _binCount = glm::uvec2(0);
+    std::vector<std::vector<const Triangle*>> _bins;
+    // Blend buffer of each bin, created when glass first covers it. Sums of
+    // the transparent pass carry over between its waves.
+    std::vector<std::unique_ptr<BlendBuffer>> _blendBins;
+    // Bins whose blend buffer is in use in the current transparent pass
+    std::vector<uint8_t> _blendUsed;
+    // Lines of drawLines() in recording order, those that were clipped away
+    // have empty bins
+    std::vector<BinnedLine> _lines;
+    std::vector<std::vector<uint32_t>> _lineBins;
+};
+
+template<typename Fn>
+void Renderer::forEachBin(const glm::uvec2& res, const Fn& fn)
+{
+    const glm::uvec2 binCount = (res + TILE_SIZE - 1u) / TILE_SIZE;
+    _jobs->parallelFor(0, binCount.x * binCount.y, 1, [&](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i) {
+            if (!binDirty(i))
+                continue;
+            const glm::uvec2 bin(i % binCount.x, i / binCount.x);
+            const glm::uvec2 min = bin * TILE_SIZE;
+            fn(min, glm::min(min + TILE_SIZE, res));
+        }
+    });
+}
+
+#endif // RENDERER_HPP
@@ -0,0 +1,92 @@
+#ifndef RESIDENCY_HPP
+#define RESIDENCY_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "geometryCache.hpp"
+#include "world.hpp"
+
+// Keeps primitive geometry paged in from a cache under a memory budget
+// The renderer requests what it sees each frame and draws bounding boxes for
+// primitives that aren't resident yet. Reads happen on a thread of its own so
+// they don't hold up rendering jobs, but update() is the only place resident
+// data changes so it must not overlap rendering. Primitives larger than the
+// whole budget are never loaded.
+class ResidencyManager
+{
+public:
+    // Drops the geometry of every primitive in world, cache has to be built
+    // from the same world
+    // Primitives loaded without geometry take their bounds from the cache
+    ResidencyManager(World* world, const GeometryCache* cache, size_t budgetBytes);
+    ~ResidencyManager();
+
+    ResidencyManager(const ResidencyManager&) = delete;
+    ResidencyManager& operator=(const ResidencyManager&) = delete;
+
+    bool resident(const Primitive* primitive) const;
+    // Marks the primitive as used this frame and queues it for loading if
+    // needed, higher priority loads first
+    // Views rendering in parallel can call this at the same time
+    void request(const Primitive* primitive, float priority);
+
+    // Commits finished loads, evicts least recently used primitives and starts
+    // loads for this frame's requests
+    void update();
+
+    size_t budgetBytes() const;
+    // Resident and in flight geometry
+    size_t usedBytes() const;
+
+private:
+    enum class State {
+        Evicted,
+        Loading,
+        Resident
+    };
+
+    struct Slot {
+        size_t index;
+        Primitive* primitive;
+        size_t bytes;
+        State state = State::Evicted;
+        size_t lastUsed = 0;
+        float priority = 0.f;
+        // Filled by the loader thread
+        std::unique_ptr<Primitive> staging;
+        std::atomic<bool> loaded{false};
+        std::string error;
+    };
+
+    void evict(Slot* slot);
+    // Frees least recently used slots that weren't used this frame
+    bool makeRoom(size_t bytes);
+    void work();
+
+    const GeometryCache* _cache;
+    size_t _budgetBytes;
+
+    std::vector<std::unique_ptr<Slot>> _slots;
+    std::unordered_map<const Primitive*, size_t> _slotIndices;
+    std::mutex _requestMutex;
+    std::vector<size_t> _requests;
+    size_t _usedBytes = 0;
+    size_t _frame = 1;
+    size_t _inFlight = 0;
+
+    std::thread _loader;
+    std::mutex _mutex;
+    std::condition_variable _queued;
+    std::deque<Slot*> _queue;
+    bool _stop = false;
+};
+
+#endif // RESIDENCY_HPP
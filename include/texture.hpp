@@ -5,6 +5,7 @@
 #include <tiny_gltf.h>
 
 #include "color.hpp"
+#include "memoryReport.hpp"
 
 class Texture
 {
@@ -13,13 +14,15 @@ public:
     Texture(const tinygltf::Image& image);
 
     Texture(const Texture&) = delete;
-    Texture(const Texture&& other);
+    Texture(Texture&& other);
     Texture& operator=(const Texture&) = delete;
-    Texture& operator=(const Texture&& other);
+    Texture& operator=(Texture&& other);
 
     // Nearest sampling
     Color sample(const glm::vec2& uv) const;
 
+    MemoryUsage memoryUsage() const;
+
 private:
     glm::uvec2 pixelCoord(const glm::vec2& uv) const;
 
@@ -3,6 +3,7 @@
 
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
+#include <cstddef>
 #include <vector>
 
 #include "material.hpp"
@@ -11,10 +12,49 @@
 
 struct Model;
 
+struct Skin {
+    // Indices into World::nodes
+    std::vector<size_t> joints;
+    // Per joint, identity if the asset has none
+    std::vector<glm::mat4> inverseBinds;
+};
+
+// Keyframed node transforms
+struct Animation {
+    enum class Path {
+        Translation,
+        Rotation,
+        Scale
+    };
+
+    enum class Interpolation {
+        Step,
+        Linear,
+        CubicSpline
+    };
+
+    struct Channel {
+        // Index into World::nodes
+        size_t node;
+        Path path;
+        Interpolation interpolation;
+        std::vector<float> times;
+        // Rotations are xyzw quaternions, cubic splines have an in-tangent,
+        // value and out-tangent per key
+        std::vector<glm::vec4> values;
+    };
+
+    std::vector<Channel> channels;
+    // Last key time of all channels
+    float duration = 0.f;
+};
+
 struct Scene {
     struct Node {
         std::vector<Node*> children;
         const Mesh* mesh = nullptr;
+        // Skinned meshes follow the joints and ignore the node's transform
+        const Skin* skin = nullptr;
         glm::vec3 translation = glm::vec3(0.f);
         glm::quat rotation = glm::quat(1.f, 0.f, 0.f, 0.f);
         glm::vec3 scale = glm::vec3(1.f);
@@ -28,6 +68,8 @@ struct World {
     std::vector<Material> materials;
     std::vector<Mesh> meshes;
     std::vector<Scene::Node> nodes;
+    std::vector<Skin> skins;
+    std::vector<Animation> animations;
     std::vector<Scene> scenes;
     size_t currentScene = 0;
 };
@@ -0,0 +1,444 @@
+#include "animator.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+    // Vertices skinned per job
+    const size_t SKIN_BATCH = 1024;
+    const size_t NO_PARENT = std::numeric_limits<size_t>::max();
+
+    // First pose component of each path
+    size_t poseOffset(Animation::Path path)
+    {
+        switch (path) {
+        case Animation::Path::Translation:
+            return 0;
+        case Animation::Path::Rotation:
+            return 3;
+        default:
+            return 7;
+        }
+    }
+}
+
+Animator::Animator(const World* world, JobSystem* jobs) :
+    _world(world),
+    _jobs(jobs)
+{
+    const auto& nodes = world->nodes;
+    const size_t count = nodes.size();
+
+    std::vector<size_t> parents(count, NO_PARENT);
+    for (size_t n = 0; n < count; ++n) {
+        for (const auto* child : nodes[n].children)
+            parents[child - nodes.data()] = n;
+    }
+
+    // Breadth first from the roots puts every level after the one above it
+    for (size_t n = 0; n < count; ++n) {
+        if (parents[n] == NO_PARENT)
+            _order.push_back(n);
+    }
+    _levels.push_back(0);
+    size_t levelEnd = _order.size();
+    for (size_t i = 0; i < _order.size(); ++i) {
+        if (i == levelEnd) {
+            _levels.push_back(levelEnd);
+            levelEnd = _order.size();
+        }
+        for (const auto* child : nodes[_order[i]].children)
+            _order.push_back(child - nodes.data());
+    }
+    _levels.push_back(_order.size());
+
+    _sorted.resize(count, NO_PARENT);
+    for (size_t i = 0; i < _order.size(); ++i)
+        _sorted[_order[i]] = i;
+    _parents.resize(_order.size());
+    for (size_t i = 0; i < _order.size(); ++i) {
+        const size_t parent = parents[_order[i]];
+        _parents[i] = parent == NO_PARENT ? NO_PARENT : _sorted[parent];
+    }
+
+    // Nodes outside the hierarchy, e.g. in a cycle, are left out
+    const size_t sortedCount = _order.size();
+    for (auto& component : _rest)
+        component.resize(sortedCount);
+    for (size_t i = 0; i < sortedCount; ++i) {
+        const Scene::Node& node = nodes[_order[i]];
+        for (uint32_t c = 0; c < 3; ++c) {
+            _rest[c][i] = node.translation[c];
+            _rest[7 + c][i] = node.scale[c];
+        }
+        _rest[3][i] = node.rotation.x;
+        _rest[4][i] = node.rotation.y;
+        _rest[5][i] = node.rotation.z;
+        _rest[6][i] = node.rotation.w;
+    }
+    for (auto& component : _local)
+        component.resize(sortedCount);
+    for (auto& component : _global)
+        component.resize(sortedCount);
+    for (auto& component : _parent)
+        component.resize(sortedCount);
+    _nodeToWorld.resize(count, glm::mat4(1.f));
+
+    _joints.resize(world->skins.size());
+    for (size_t s = 0; s < world->skins.size(); ++s)
+        _joints[s].resize(world->skins[s].joints.size(), glm::mat4(1.f));
+
+    // Every primitive of a skinned node gets a target so they can be found
+    // by index
+    _nodeTargets.resize(count, std::numeric_limits<size_t>::max());
+    for (size_t n = 0; n < count; ++n) {
+        const Scene::Node& node = nodes[n];
+        if (node.mesh == nullptr || node.skin == nullptr)
+            continue;
+
+        _nodeTargets[n] = _targets.size();
+        for (const auto& primitive : node.mesh->primitives) {
+            Target target;
+            target.node = n;
+            target.skin = node.skin - world->skins.data();
+            target.primitive = &primitive;
+            _targets.push_back(std::move(target));
+        }
+    }
+}
+
+void Animator::update(size_t animation, float seconds)
+{
+    _pose = _rest;
+    if (animation < _world->animations.size())
+        sample(_world->animations[animation], seconds);
+    compose();
+
+    for (size_t s = 0; s < _world->skins.size(); ++s) {
+        const Skin& skin = _world->skins[s];
+        for (size_t j = 0; j < skin.joints.size(); ++j)
+            _joints[s][j] = _nodeToWorld[skin.joints[j]] * skin.inverseBinds[j];
+    }
+    skin();
+}
+
+const std::vector<glm::mat4>& Animator::nodeToWorld() const
+{
+    return _nodeToWorld;
+}
+
+const SkinnedVertices* Animator::skinned(const Scene::Node* node, size_t primitive) const
+{
+    const size_t first = _nodeTargets[node - _world->nodes.data()];
+    if (first == std::numeric_limits<size_t>::max())
+        return nullptr;
+
+    const Target& target = _targets[first + primitive];
+    return target.valid ? &target.buffers[target.current] : nullptr;
+}
+
+MemoryUsage Animator::memoryUsage() const
+{
+    MemoryUsage usage;
+    for (const auto& target : _targets) {
+        for (const auto& buffer : target.buffers) {
+            usage.add(buffer.positions);
+            usage.add(buffer.normals);
+            usage.add(buffer.tangents);
+        }
+    }
+    return usage;
+}
+
+void Animator::sample(const Animation& animation, float seconds)
+{
+    const size_t count = animation.channels.size();
+    for (auto& key : _keys)
+        key.resize(count);
+    for (auto& weight : _keyWeights)
+        weight.resize(count);
+    for (auto& component : _sampled)
+        component.resize(count);
+
+    float time = 0.f;
+    if (animation.duration > 0.f) {
+        time = std::fmod(seconds, animation.duration);
+        if (time < 0.f)
+            time += animation.duration;
+    }
+
+    // Finding the keys is a search per channel, blending them is the same
+    // weighted sum for every interpolation
+    for (size_t c = 0; c < count; ++c) {
+        const auto& channel = animation.channels[c];
+        const auto& times = channel.times;
+        const size_t next = std::upper_bound(times.begin(), times.end(), time) - times.begin();
+        const size_t k0 = next == 0 ? 0 : next - 1;
+        const size_t k1 = std::min(next, times.size() - 1);
+        const float span = times[k1] - times[k0];
+        const float t = span > 0.f ? (time - times[k0]) / span : 0.f;
+
+        std::array<glm::vec4, 4> keys{};
+        std::array<float, 4> weights{1.f, 0.f, 0.f, 0.f};
+        switch (channel.interpolation) {
+        case Animation::Interpolation::Step:
+            keys[0] = channel.values[k0];
+            break;
+        case Animation::Interpolation::Linear:
+            keys[0] = channel.values[k0];
+            keys[2] = channel.values[k1];
+            weights = {1.f - t, 0.f, t, 0.f};
+            if (channel.path == Animation::Path::Rotation) {
+                // Slerp along the shorter arc, nearly equal keys lerp and get
+                // normalized
+                float d = glm::dot(keys[0], keys[2]);
+                if (d < 0.f) {
+                    keys[2] = -keys[2];
+                    d = -d;
+                }
+                if (d < 0.9995f) {
+                    const float angle = std::acos(d);
+                    const float s = std::sin(angle);
+                    weights[0] = std::sin((1.f - t) * angle) / s;
+                    weights[2] = std::sin(t * angle) / s;
+                }
+            }
+            break;
+        case Animation::Interpolation::CubicSpline: {
+            // Hermite with tangents scaled to the key span
+            keys[0] = channel.values[3 * k0 + 1];
+            keys[1] = channel.values[3 * k0 + 2] * span;
+            keys[2] = channel.values[3 * k1 + 1];
+            keys[3] = channel.values[3 * k1] * span;
+            const float t2 = t * t;
+            const float t3 = t2 * t;
+            weights = {
+                2.f * t3 - 3.f * t2 + 1.f,
+                t3 - 2.f * t2 + t,
+                -2.f * t3 + 3.f * t2,
+                t3 - t2
+            };
+            break;
+        }
+        }
+
+        for (uint32_t k = 0; k < 4; ++k) {
+            _keyWeights[k][c] = weights[k];
+            for (uint32_t i = 0; i < 4; ++i)
+                _keys[k * 4 + i][c] = keys[k][i];
+        }
+    }
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        float* out = _sampled[i].data();
+        const float* w0 = _keyWeights[0].data();
+        const float* w1 = _keyWeights[1].data();
+        const float* w2 = _keyWeights[2].data();
+        const float* w3 = _keyWeights[3].data();
+        const float* v0 = _keys[i].data();
+        const float* m0 = _keys[4 + i].data();
+        const float* v1 = _keys[8 + i].data();
+        const float* m1 = _keys[12 + i].data();
+        for (size_t c = 0; c < count; ++c)
+            out[c] = w0[c] * v0[c] + w1[c] * m0[c] + w2[c] * v1[c] + w3[c] * m1[c];
+    }
+
+    for (size_t c = 0; c < count; ++c) {
+        const auto& channel = animation.channels[c];
+        if (channel.node >= _sorted.size() || _sorted[channel.node] == NO_PARENT)
+            continue;
+
+        const size_t node = _sorted[channel.node];
+        const size_t offset = poseOffset(channel.path);
+        if (channel.path == Animation::Path::Rotation) {
+            glm::vec4 q(_sampled[0][c], _sampled[1][c], _sampled[2][c], _sampled[3][c]);
+            const float length = glm::length(q);
+            q = length > 0.f ? q / length : glm::vec4(0.f, 0.f, 0.f, 1.f);
+            for (uint32_t i = 0; i < 4; ++i)
+                _pose[offset + i][node] = q[i];
+        } else {
+            for (uint32_t i = 0; i < 3; ++i)
+                _pose[offset + i][node] = _sampled[i][c];
+        }
+    }
+}
+
+void Animator::compose()
+{
+    const size_t count = _order.size();
+
+    // Translation, rotation and scale to an affine transform, columns are
+    // scaled rotation axes followed by the translation
+    {
+        const float* tx = _pose[0].data();
+        const float* ty = _pose[1].data();
+        const float* tz = _pose[2].data();
+        const float* qx = _pose[3].data();
+        const float* qy = _pose[4].data();
+        const float* qz = _pose[5].data();
+        const float* qw = _pose[6].data();
+        const float* sx = _pose[7].data();
+        const float* sy = _pose[8].data();
+        const float* sz = _pose[9].data();
+        std::array<float*, 12> l;
+        for (uint32_t k = 0; k < 12; ++k)
+            l[k] = _local[k].data();
+        for (size_t i = 0; i < count; ++i) {
+            const float x = qx[i];
+            const float y = qy[i];
+            const float z = qz[i];
+            const float w = qw[i];
+            l[0][i] = (1.f - 2.f * (y * y + z * z)) * sx[i];
+            l[1][i] = 2.f * (x * y + w * z) * sx[i];
+            l[2][i] = 2.f * (x * z - w * y) * sx[i];
+            l[3][i] = 2.f * (x * y - w * z) * sy[i];
+            l[4][i] = (1.f - 2.f * (x * x + z * z)) * sy[i];
+            l[5][i] = 2.f * (y * z + w * x) * sy[i];
+            l[6][i] = 2.f * (x * z + w * y) * sz[i];
+            l[7][i] = 2.f * (y * z - w * x) * sz[i];
+            l[8][i] = (1.f - 2.f * (x * x + y * y)) * sz[i];
+            l[9][i] = tx[i];
+            l[10][i] = ty[i];
+            l[11][i] = tz[i];
+        }
+    }
+
+    // Roots are in world space as is
+    if (_levels.size() > 1) {
+        for (uint32_t k = 0; k < 12; ++k)
+            std::copy_n(_local[k].begin(), _levels[1], _global[k].begin());
+    }
+
+    // Each level only depends on the one above, gathering the parents first
+    // leaves a plain loop over the level
+    std::array<float*, 12> p;
+    std::array<const float*, 12> l;
+    std::array<float*, 12> w;
+    for (uint32_t k = 0; k < 12; ++k) {
+        p[k] = _parent[k].data();
+        l[k] = _local[k].data();
+        w[k] = _global[k].data();
+    }
+    for (size_t level = 1; level + 1 < _levels.size(); ++level) {
+        const size_t begin = _levels[level];
+        const size_t end = _levels[level + 1];
+        for (uint32_t k = 0; k < 12; ++k) {
+            for (size_t i = begin; i < end; ++i)
+                p[k][i] = w[k][_parents[i]];
+        }
+        for (uint32_t c = 0; c < 4; ++c) {
+            for (uint32_t r = 0; r < 3; ++r) {
+                float* out = w[c * 3 + r];
+                const float* p0 = p[r];
+                const float* p1 = p[3 + r];
+                const float* p2 = p[6 + r];
+                const float* l0 = l[c * 3];
+                const float* l1 = l[c * 3 + 1];
+                const float* l2 = l[c * 3 + 2];
+                // Points pick up the parent's translation, axes don't
+                const float* t = c == 3 ? p[9 + r] : nullptr;
+                if (t != nullptr) {
+                    for (size_t i = begin; i < end; ++i)
+                        out[i] = p0[i] * l0[i] + p1[i] * l1[i] + p2[i] * l2[i] + t[i];
+                } else {
+                    for (size_t i = begin; i < end; ++i)
+                        out[i] = p0[i] * l0[i] + p1[i] * l1[i] + p2[i] * l2[i];
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        glm::mat4& m = _nodeToWorld[_order[i]];
+        for (uint32_t c = 0; c < 4; ++c)
+            m[c] = glm::vec4(w[c * 3][i], w[c * 3 + 1][i], w[c * 3 + 2][i], c == 3 ? 1.f : 0.f);
+    }
+}
+
+void Animator::skin()
+{
+    _batches.clear();
+    for (size_t t = 0; t < _targets.size(); ++t) {
+        Target& target = _targets[t];
+        const Primitive& primitive = *target.primitive;
+        const size_t vertices = vertexCount(primitive);
+        // Streamed out or not loaded yet
+        target.valid =
+            vertices > 0 &&
+            !_joints[target.skin].empty() &&
+            primitive.joints.size() == vertices &&
+            primitive.weights.size() == vertices;
+        if (!target.valid)
+            continue;
+
+        target.current ^= 1;
+        SkinnedVertices& out = target.buffers[target.current];
+        out.positions.resize(vertices);
+        out.normals.resize(hasNormals(primitive) ? vertices : 0);
+        const bool tangents = !primitive.tangents.empty() || !primitive.packed.tangents.empty();
+        out.tangents.resize(tangents ? vertices : 0);
+
+        for (size_t begin = 0; begin < vertices; begin += SKIN_BATCH)
+            _batches.push_back({t, begin, std::min(begin + SKIN_BATCH, vertices), glm::vec3(0.f), glm::vec3(0.f)});
+    }
+
+    _jobs->parallelFor(0, _batches.size(), 1, [&](size_t begin, size_t end){
+        for (size_t b = begin; b < end; ++b) {
+            Batch& batch = _batches[b];
+            Target& target = _targets[batch.target];
+            const Primitive& primitive = *target.primitive;
+            const PackedVertices& packed = primitive.packed;
+            const bool isPacked = primitive.positions.empty();
+            const glm::mat4 unpack = isPacked ? unpackPositionTransform(primitive) : glm::mat4(1.f);
+            const std::vector<glm::mat4>& joints = _joints[target.skin];
+            const size_t lastJoint = joints.size() - 1;
+            SkinnedVertices& out = target.buffers[target.current];
+
+            batch.min = glm::vec3(std::numeric_limits<float>::max());
+            batch.max = glm::vec3(std::numeric_limits<float>::lowest());
+            for (size_t v = batch.begin; v < batch.end; ++v) {
+                const glm::u16vec4& j = primitive.joints[v];
+                glm::vec4 weights = primitive.weights[v];
+                const float sum = weights.x + weights.y + weights.z + weights.w;
+                weights = sum > 0.f ? weights / sum : glm::vec4(1.f, 0.f, 0.f, 0.f);
+
+                // Most vertices follow one or two joints
+                glm::mat4 m = joints[std::min<size_t>(j.x, lastJoint)] * weights.x;
+                for (uint32_t i = 1; i < 4; ++i) {
+                    if (weights[i] != 0.f)
+                        m += joints[std::min<size_t>(j[i], lastJoint)] * weights[i];
+                }
+
+                const glm::vec4 position = isPacked ?
+                    unpack * glm::vec4(glm::vec3(packed.positions[v]), 1.f) :
+                    glm::vec4(primitive.positions[v], 1.f);
+                out.positions[v] = glm::vec3(m * position);
+                batch.min = glm::min(batch.min, out.positions[v]);
+                batch.max = glm::max(batch.max, out.positions[v]);
+
+                // Joints aren't expected to shear so normals skip the inverse
+                // transpose
+                if (!out.normals.empty()) {
+                    const glm::vec3 n = isPacked ? unpackOctahedral(packed.normals[v]) : primitive.normals[v];
+                    out.normals[v] = glm::normalize(glm::vec3(m * glm::vec4(n, 0.f)));
+                }
+                if (!out.tangents.empty()) {
+                    const glm::vec4 t = isPacked ? unpackTangent(packed.tangents[v]) : primitive.tangents[v];
+                    out.tangents[v] = glm::vec4(glm::normalize(glm::vec3(m * glm::vec4(glm::vec3(t), 0.f))), t.w);
+                }
+            }
+        }
+    });
+
+    for (const auto& batch : _batches) {
+        SkinnedVertices& out = _targets[batch.target].buffers[_targets[batch.target].current];
+        if (batch.begin == 0) {
+            out.min = batch.min;
+            out.max = batch.max;
+        } else {
+            out.min = glm::min(out.min, batch.min);
+            out.max = glm::max(out.max, batch.max);
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#include "blendBuffer.hpp"
+
+#include <algorithm>
+
+namespace {
+    // Weight of a sample by its depth in [0,1] and alpha, equation 10 of the
+    // paper, which spreads well over the non-linear depth we rasterize
+    inline float blendWeight(float depth, float alpha)
+    {
+        const float d = 1.f - depth;
+        return alpha * std::max(1e-2f, 3e3f * d * d * d);
+    }
+}
+
+void BlendBuffer::reset(const glm::uvec2& min, const glm::uvec2& max, uint32_t samples)
+{
+    _min = min;
+    _max = max;
+    _samples = samples;
+    const glm::uvec2 size = max - min;
+    _accum.assign(size.x * size.y * samples, glm::vec4(0.f));
+    _revealage.assign(size.x * size.y * samples, 1.f);
+}
+
+void BlendBuffer::add(const glm::ivec2& p, uint32_t sample, const Color& color, float alpha, float depth)
+{
+    const size_t i = sampleIndex(p, sample);
+    const float weight = blendWeight(depth * 0.5f + 0.5f, alpha);
+    _accum[i] += glm::vec4(color.r, color.g, color.b, 1.f) * (alpha * weight);
+    _revealage[i] *= 1.f - alpha;
+}
+
+void BlendBuffer::composite(FrameBuffer* fb) const
+{
+    for (uint32_t y = _min.y; y < _max.y; ++y) {
+        for (uint32_t x = _min.x; x < _max.x; ++x) {
+            const glm::ivec2 p(x, y);
+            for (uint32_t s = 0; s < _samples; ++s) {
+                const size_t i = sampleIndex(p, s);
+                const glm::vec4& accum = _accum[i];
+                // Nothing transparent landed on the sample
+                if (!(accum.w > 0.f))
+                    continue;
+
+                // Weighted average of the layers covers what doesn't show
+                // through
+                const float revealage = _revealage[i];
+                const glm::vec3 average = glm::vec3(accum) / accum.w;
+                const Color dst = fb->sample(p, s);
+                const glm::vec3 blended =
+                    average * (1.f - revealage) + glm::vec3(dst.r, dst.g, dst.b) * revealage;
+                const glm::uvec3 c(glm::clamp(blended + 0.5f, glm::vec3(0.f), glm::vec3(255.f)));
+                fb->setSample(p, s, Color(c.x, c.y, c.z));
+            }
+        }
+    }
+}
+
+MemoryUsage BlendBuffer::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.add(_accum);
+    usage.add(_revealage);
+    return usage;
+}
+
+size_t BlendBuffer::sampleIndex(const glm::ivec2& p, uint32_t sample) const
+{
+    return ((p.y - _min.y) * (_max.x - _min.x) + (p.x - _min.x)) * _samples + sample;
+}
@@ -43,6 +43,19 @@ void Camera::perspective(const float fov, const float ar, const float zN, const
                              0.f,  tf,                         0.f,  0.f,
                              0.f, 0.f,       (zF + zN) / (zN - zF), -1.f,
                              0.f, 0.f,     2 * zF * zN / (zN - zF),  0.f};
+    _orthographic = false;
+
+    _worldToClip = _cameraToClip * _worldToCamera;
+}
+
+void Camera::orthographic(const float left, const float right, const float bottom, const float top, const float zN, const float zF)
+{
+    // Z in [0,1]
+    _cameraToClip = mat4{          2.f / (right - left),                            0.f,                 0.f, 0.f,
+                                                    0.f,           2.f / (top - bottom),                 0.f, 0.f,
+                                                    0.f,                            0.f,    1.f / (zN - zF), 0.f,
+                         (left + right) / (left - right), (bottom + top) / (bottom - top), zN / (zN - zF), 1.f};
+    _orthographic = true;
 
     _worldToClip = _cameraToClip * _worldToCamera;
 }
@@ -52,6 +65,14 @@ const glm::vec3& Camera::eye() const
     return _eye;
 }
 
+vec3 Camera::toEye(const vec3& p) const
+{
+    // Camera space z points back towards the viewer
+    if (_orthographic)
+        return vec3(row(_worldToCamera, 2));
+    return normalize(_eye - p);
+}
+
 const glm::mat4& Camera::worldToCamera() const
 {
     return _worldToCamera;
@@ -1,5 +1,10 @@
 #include "clip.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
 namespace {
     inline glm::vec4 perspectiveDiv(const glm::vec4& clipP)
     {
@@ -7,9 +12,9 @@ namespace {
         return glm::vec4(glm::vec3(clipP) * invW, invW);
     }
 
-    inline glm::ivec2 NDCToFrag(const glm::vec4& ndcP, const glm::vec2& halfRes)
+    inline glm::vec2 NDCToWindow(const glm::vec4& ndcP, const glm::vec2& halfRes)
     {
-        return glm::ivec2((glm::vec2(ndcP) + 1.f) * halfRes);
+        return (glm::vec2(ndcP) + 1.f) * halfRes;
     }
 
     //  0 -> c is on edge a b
@@ -20,12 +25,236 @@ namespace {
         return (c.y - a.y) * (b.x - a.x) - (c.x - a.x) * (b.y - a.y);
     }
 
-    template<typename T>
-    inline T baryInterp(const std::array<T, 3> values, const glm::vec3& bary)
+    // Change in edgeFunc(a, b, c) when c moves by offset
+    inline float edgeFuncDelta(const glm::vec2& a, const glm::vec2& b, const glm::vec2& offset)
+    {
+        return offset.y * (b.x - a.x) - offset.x * (b.y - a.y);
+    }
+
+    // Edges exactly on a sample are owned by the triangle if they are top or left edges
+    inline bool isTopLeft(const glm::vec2& edge)
+    {
+        return (edge.y == 0 && edge.x > 0) || edge.y > 0;
+    }
+
+    inline bool covers(const glm::vec3& w, const glm::bvec3& topLeft)
+    {
+        return (w.x == 0 ? topLeft.x : w.x > 0) &&
+               (w.y == 0 ? topLeft.y : w.y > 0) &&
+               (w.z == 0 ? topLeft.z : w.z > 0);
+    }
+
+    // Linear function of window coordinates
+    struct Plane {
+        float dx = 0.f;
+        float dy = 0.f;
+        float c = 0.f;
+
+        float at(const glm::vec2& p) const { return dx * p.x + dy * p.y + c; }
+    };
+
+    // edgeFunc(a, b, p) as a plane over p
+    inline Plane edgePlane(const glm::vec2& a, const glm::vec2& b)
+    {
+        return {a.y - b.y, b.x - a.x, a.x * (b.y - a.y) - a.y * (b.x - a.x)};
+    }
+
+    // Plane through the given vertex values
+    inline Plane attributePlane(const std::array<Plane, 3>& baryPlanes, const glm::vec3& values)
+    {
+        return {
+            glm::dot(values, glm::vec3(baryPlanes[0].dx, baryPlanes[1].dx, baryPlanes[2].dx)),
+            glm::dot(values, glm::vec3(baryPlanes[0].dy, baryPlanes[1].dy, baryPlanes[2].dy)),
+            glm::dot(values, glm::vec3(baryPlanes[0].c, baryPlanes[1].c, baryPlanes[2].c))
+        };
+    }
+
+    const size_t VARYING_FLOATS = 12;
+
+    // Triangles are classified by the pixels their bounds touch
+    const uint32_t SMALL_TRI_PIXELS = 4;
+    const uint32_t LARGE_TRI_SIZE = 16;
+    const uint32_t BLOCK_SIZE = 8;
+
+    inline std::array<float, VARYING_FLOATS> flatten(const Varyings& v)
+    {
+        return {
+            v.shadowCoord.x, v.shadowCoord.y, v.shadowCoord.z,
+            v.normal.x, v.normal.y, v.normal.z,
+            v.texCoord0.x, v.texCoord0.y,
+            v.tangent.x, v.tangent.y, v.tangent.z, v.tangent.w
+        };
+    }
+
+    inline Varyings unflatten(const std::array<float, VARYING_FLOATS>& v)
+    {
+        Varyings varyings;
+        varyings.shadowCoord = glm::vec3(v[0], v[1], v[2]);
+        varyings.normal = glm::vec3(v[3], v[4], v[5]);
+        varyings.texCoord0 = glm::vec2(v[6], v[7]);
+        varyings.tangent = glm::vec4(v[8], v[9], v[10], v[11]);
+        return varyings;
+    }
+
+    // Everything fragments need, computed once per triangle
+    struct TriSetup {
+        Plane depth;
+        Plane invW;
+        // Varyings divided by w so that they are linear in window space
+        std::array<Plane, VARYING_FLOATS> varyings;
+    };
+
+    // Shadow map depth read directly, lookups run for every shaded fragment
+    struct ShadowMapView {
+        const float* depth;
+        int32_t width;
+        glm::ivec2 last;
+
+        explicit ShadowMapView(const FrameBuffer& shadowMap) :
+            depth(shadowMap.depths().data()),
+            width(shadowMap.res().x),
+            last(glm::ivec2(shadowMap.res()) - 1)
+        { }
+    };
+
+    // Fraction of the 2x2 shadow map texels around p that aren't closer to
+    // the light than p
+    inline float shadowVisibility(const ShadowMapView& shadowMap, const glm::vec3& p, float bias)
+    {
+        const glm::ivec2 first(glm::floor(glm::vec2(p) - 0.5f));
+        const glm::ivec2 min = glm::clamp(first, glm::ivec2(0), shadowMap.last);
+        const glm::ivec2 max = glm::clamp(first + 1, glm::ivec2(0), shadowMap.last);
+        const float* row0 = shadowMap.depth + min.y * shadowMap.width;
+        const float* row1 = shadowMap.depth + max.y * shadowMap.width;
+        const float depth = p.z - bias;
+        return 0.25f * (
+            static_cast<float>(depth <= row0[min.x]) + static_cast<float>(depth <= row0[max.x]) +
+            static_cast<float>(depth <= row1[min.x]) + static_cast<float>(depth <= row1[max.x])
+        );
+    }
+
+    // Shaders are functors, only the flattened varyings in
+    // [FIRST_VARYING, LAST_VARYING) are interpolated
+    struct FlatShader {
+        static const size_t FIRST_VARYING = 0;
+        static const size_t LAST_VARYING = 0;
+        Color color;
+
+        Color operator()(const Varyings&) const { return color; }
+    };
+
+    struct LambertShader {
+        static const size_t FIRST_VARYING = 3;
+        static const size_t LAST_VARYING = VARYING_FLOATS;
+        glm::vec3 lightDir;
+
+        Color operator()(const Varyings& varyings) const
+        {
+            const float NoL = glm::dot(glm::normalize(varyings.normal), -lightDir);
+            return Color(255 * std::max(NoL, 0.f));
+        }
+    };
+
+    struct FlatShadowedShader {
+        static const size_t FIRST_VARYING = 0;
+        static const size_t LAST_VARYING = 3;
+        Color color;
+        ShadowMapView shadowMap;
+        float bias;
+
+        Color operator()(const Varyings& varyings) const
+        {
+            const float visibility = shadowVisibility(shadowMap, varyings.shadowCoord, bias);
+            return Color(color.r * visibility, color.g * visibility, color.b * visibility);
+        }
+    };
+
+    struct LambertShadowedShader {
+        static const size_t FIRST_VARYING = 0;
+        static const size_t LAST_VARYING = VARYING_FLOATS;
+        glm::vec3 lightDir;
+        ShadowMapView shadowMap;
+        float bias;
+
+        Color operator()(const Varyings& varyings) const
+        {
+            const float NoL = glm::dot(glm::normalize(varyings.normal), -lightDir);
+            if (!(NoL > 0.f))
+                return Color(0);
+            return Color(255 * NoL * shadowVisibility(shadowMap, varyings.shadowCoord, bias));
+        }
+    };
+
+    // Raster kernel, every state combination gets its own branch-free pixel loop
+    // Blend kernels add color samples to blend with inputs' alpha instead
+    template<bool DepthTest, bool LessEqual, bool DepthWrite, bool ColorWrite, bool Blend, typename Shader>
+    bool rasterize(
+        const std::array<glm::vec4, 3>& clipVerts,
+        const Shader& shader,
+        const ShadingInputs& inputs,
+        const glm::uvec2& scissorMin,
+        const glm::uvec2& scissorMax,
+        FrameBuffer* fb,
+        BlendBuffer* blend
+    );
+
+    template<bool DepthTest, bool LessEqual, bool DepthWrite, bool ColorWrite, bool Blend, Shading S>
+    bool shadeEntry(
+        const std::array<glm::vec4, 3>& clipVerts,
+        const ShadingInputs& inputs,
+        const glm::uvec2& scissorMin,
+        const glm::uvec2& scissorMax,
+        FrameBuffer* fb,
+        BlendBuffer* blend)
+    {
+        // Depth-only variants share one kernel that never shades
+        if constexpr (!ColorWrite || S == Shading::Flat)
+            return rasterize<DepthTest, LessEqual, DepthWrite, ColorWrite, Blend>(clipVerts, FlatShader{inputs.color}, inputs, scissorMin, scissorMax, fb, blend);
+        else if constexpr (S == Shading::Lambert)
+            return rasterize<DepthTest, LessEqual, DepthWrite, ColorWrite, Blend>(clipVerts, LambertShader{inputs.lightDir}, inputs, scissorMin, scissorMax, fb, blend);
+        else if constexpr (S == Shading::FlatShadowed)
+            return rasterize<DepthTest, LessEqual, DepthWrite, ColorWrite, Blend>(clipVerts, FlatShadowedShader{inputs.color, ShadowMapView(*inputs.shadowMap), inputs.shadowBias}, inputs, scissorMin, scissorMax, fb, blend);
+        else
+            return rasterize<DepthTest, LessEqual, DepthWrite, ColorWrite, Blend>(clipVerts, LambertShadowedShader{inputs.lightDir, ShadowMapView(*inputs.shadowMap), inputs.shadowBias}, inputs, scissorMin, scissorMax, fb, blend);
+    }
+
+    template<bool DepthTest, bool LessEqual, bool DepthWrite, bool ColorWrite, Shading S>
+    bool rasterEntry(
+        const std::array<glm::vec4, 3>& clipVerts,
+        const ShadingInputs& inputs,
+        const glm::uvec2& scissorMin,
+        const glm::uvec2& scissorMax,
+        FrameBuffer* fb)
     {
-        return bary[0] * values[0] + bary[1] * values[1] + bary[2] * values[2];
+        return shadeEntry<DepthTest, LessEqual, DepthWrite, ColorWrite, false, S>(clipVerts, inputs, scissorMin, scissorMax, fb, nullptr);
     }
 
+    template<bool DepthTest, Shading S>
+    bool blendEntry(
+        const std::array<glm::vec4, 3>& clipVerts,
+        const ShadingInputs& inputs,
+        const glm::uvec2& scissorMin,
+        const glm::uvec2& scissorMax,
+        FrameBuffer* fb,
+        BlendBuffer* blend)
+    {
+        return shadeEntry<DepthTest, false, false, true, true, S>(clipVerts, inputs, scissorMin, scissorMax, fb, blend);
+    }
+
+    template<Shading S, size_t... Indices>
+    constexpr std::array<RasterFn, sizeof...(Indices)> rasterVariants(std::index_sequence<Indices...>)
+    {
+        return {rasterEntry<(Indices & 1) != 0, (Indices & 8) != 0, (Indices & 2) != 0, (Indices & 4) != 0, S>...};
+    }
+
+    // Indexed by depthTest | depthWrite << 1 | colorWrite << 2 | depthLessEqual << 3
+    template<Shading S>
+    const std::array<RasterFn, 16> RASTER_VARIANTS = rasterVariants<S>(std::make_index_sequence<16>());
+
+    // Indexed by depthTest
+    template<Shading S>
+    const std::array<BlendFn, 2> BLEND_VARIANTS = {blendEntry<false, S>, blendEntry<true, S>};
+
     inline bool outsideClip(const glm::vec4& clipP)
     {
         if (clipP.x < -clipP.w || clipP.x > clipP.w)
@@ -37,124 +266,481 @@ namespace {
 
         return false;
     }
+
+    // Narrows [t0, t1] to the part of a line in front of a clip plane, d0 and
+    // d1 are the end points' distances to it
+    inline bool clipParams(float d0, float d1, float* t0, float* t1)
+    {
+        if (d0 < 0.f && d1 < 0.f)
+            return false;
+        if (d0 < 0.f)
+            *t0 = std::max(*t0, d0 / (d0 - d1));
+        else if (d1 < 0.f)
+            *t1 = std::min(*t1, d0 / (d0 - d1));
+        return *t0 <= *t1;
+    }
+
+    // DDA along the major axis, the minor coordinate and depth are evaluated
+    // from the first pixel so scissored parts match drawing the whole line
+    template<bool DepthTest>
+    void rasterizeLine(
+        const LineSetup& setup,
+        const Color& color,
+        float depthBias,
+        const glm::uvec2& scissorMin,
+        const glm::uvec2& scissorMax,
+        FrameBuffer* fb)
+    {
+        const int32_t major = setup.major;
+        const int32_t minor = 1 - major;
+        float first = float(std::max(setup.first, int32_t(scissorMin[major])));
+        float last = float(std::min(setup.last, int32_t(scissorMax[major])));
+
+        // Skip ahead to where the line crosses the scissor on the minor axis,
+        // with a pixel to spare since the loop still checks every pixel
+        if (setup.pMin[minor] < int32_t(scissorMin[minor]) || setup.pMax[minor] > int32_t(scissorMax[minor])) {
+            // Axis aligned lines only cover a single row or column
+            if (setup.minorStep == 0.f)
+                return;
+            const float invMinorStep = 1.f / setup.minorStep;
+            float enter = setup.first + (scissorMin[minor] - setup.minor) * invMinorStep;
+            float exit = setup.first + (scissorMax[minor] - setup.minor) * invMinorStep;
+            if (enter > exit)
+                std::swap(enter, exit);
+            first = std::max(first, std::floor(enter) - 1.f);
+            last = std::min(last, std::ceil(exit) + 1.f);
+        }
+
+        const uint32_t samples = fb->samples();
+        const float minorMin = float(scissorMin[minor]);
+        const float minorMax = float(scissorMax[minor]);
+        for (int32_t i = int32_t(first); i < int32_t(last); ++i) {
+            const float steps = float(i - setup.first);
+            const float b = setup.minor + steps * setup.minorStep;
+            if (b < minorMin || b >= minorMax)
+                continue;
+
+            // Truncating is flooring as b isn't negative
+            glm::ivec2 fragP;
+            fragP[major] = i;
+            fragP[minor] = int32_t(b);
+            // Depth at the pixel center goes for all of its samples
+            const float depth = setup.depth + steps * setup.depthStep - depthBias;
+            for (uint32_t s = 0; s < samples; ++s) {
+                if (!DepthTest || depth <= fb->depth(fragP, s))
+                    fb->setSample(fragP, s, color);
+            }
+        }
+    }
 }
 
-// Adapted from https://en.wikipedia.org/wiki/Bresenham's_line_algorithm
-void drawLine(const glm::vec4& clipP0, const glm::vec4& clipP1, const Color& color, FrameBuffer* fb)
+bool clipLine(const glm::vec4& clipP0, const glm::vec4& clipP1, const glm::uvec2& res, glm::vec3* windowP0, glm::vec3* windowP1)
 {
-    const glm::vec4 ndcP0 = perspectiveDiv(clipP0);
-    const glm::vec4 ndcP1 = perspectiveDiv(clipP1);
+    // Liang-Barsky against the planes w + x, w - x, ... in homogeneous space
+    float t0 = 0.f;
+    float t1 = 1.f;
+    for (int32_t axis = 0; axis < 3; ++axis) {
+        if (!clipParams(clipP0.w + clipP0[axis], clipP1.w + clipP1[axis], &t0, &t1) ||
+            !clipParams(clipP0.w - clipP0[axis], clipP1.w - clipP1[axis], &t0, &t1))
+            return false;
+    }
+    const glm::vec4 p0 = t0 > 0.f ? glm::mix(clipP0, clipP1, t0) : clipP0;
+    const glm::vec4 p1 = t1 < 1.f ? glm::mix(clipP0, clipP1, t1) : clipP1;
+    // Only lines through the eye itself are left with w <= 0
+    if (!(p0.w > 0.f) || !(p1.w > 0.f))
+        return false;
 
-    // TODO: Clamp lines, handle depth
+    const glm::vec2 halfRes(glm::vec2(res) / 2.f);
+    const glm::vec4 ndcP0 = perspectiveDiv(p0);
+    const glm::vec4 ndcP1 = perspectiveDiv(p1);
+    *windowP0 = glm::vec3(NDCToWindow(ndcP0, halfRes), ndcP0.z);
+    *windowP1 = glm::vec3(NDCToWindow(ndcP1, halfRes), ndcP1.z);
+    return true;
+}
 
-    const glm::vec2 halfRes(fb->res() / glm::uvec2(2));
-    const glm::ivec2 windowP0 = NDCToFrag(ndcP0, halfRes);
-    const glm::ivec2 windowP1 = NDCToFrag(ndcP1, halfRes);
+bool setupLine(const glm::vec3& windowP0, const glm::vec3& windowP1, const glm::uvec2& res, LineSetup* setup)
+{
+    const glm::vec3 d = windowP1 - windowP0;
+    const int32_t major = std::abs(d.y) > std::abs(d.x) ? 1 : 0;
+    const int32_t minor = 1 - major;
+    if (d[major] == 0.f)
+        return false;
 
-    const int32_t dx = abs(windowP0.x - windowP1.x);
-    const int32_t sx = windowP0.x < windowP1.x ? 1 : -1;
-    const int32_t dy = -abs(windowP0.y - windowP1.y);
-    const int32_t sy = windowP0.y < windowP1.y ? 1 : -1;
+    // Pixel centers in [p0, p1) along the major axis, clipping can leave end
+    // points a rounding error outside the window
+    const float a0 = windowP0[major];
+    const float a1 = windowP1[major];
+    const float first = std::max(d[major] > 0.f ? std::ceil(a0 - 0.5f) : std::floor(a1 - 0.5f) + 1.f, 0.f);
+    const float last = std::min(d[major] > 0.f ? std::ceil(a1 - 0.5f) : std::floor(a0 - 0.5f) + 1.f, float(res[major]));
+    if (first >= last)
+        return false;
 
-    for (int32_t x = windowP0.x, y = windowP0.y, err = dx + dy;
-         !(x == windowP1.x && y == windowP1.y);) {
-        fb->setPixel(glm::ivec2(x, y), color);
+    const float invMajor = 1.f / d[major];
+    const float offset = first + 0.5f - a0;
+    setup->major = major;
+    setup->first = int32_t(first);
+    setup->last = int32_t(last);
+    setup->minorStep = d[minor] * invMajor;
+    setup->minor = windowP0[minor] + offset * setup->minorStep;
+    setup->depthStep = d.z * invMajor;
+    setup->depth = windowP0.z + offset * setup->depthStep;
 
-        const int32_t windowE2 = 2 * err;
-        if (windowE2 >= dy) {
-            err += dy;
-            x += sx;
-        }
-        if (windowE2 <= dx) {
-            err += dx;
-            y += sy;
-        }
-    }
+    const float minorLast = setup->minor + (last - 1.f - first) * setup->minorStep;
+    setup->pMin[major] = setup->first;
+    setup->pMax[major] = setup->last;
+    setup->pMin[minor] = int32_t(glm::clamp(std::floor(std::min(setup->minor, minorLast)), 0.f, float(res[minor])));
+    setup->pMax[minor] = int32_t(glm::clamp(std::floor(std::max(setup->minor, minorLast)) + 1.f, 0.f, float(res[minor])));
+    return setup->pMin[minor] < setup->pMax[minor];
+}
+
+void drawLine(const glm::vec4& clipP0, const glm::vec4& clipP1, const Color& color, const LineState& state, FrameBuffer* fb)
+{
+    glm::vec3 windowP0;
+    glm::vec3 windowP1;
+    LineSetup setup;
+    if (clipLine(clipP0, clipP1, fb->res(), &windowP0, &windowP1) &&
+        setupLine(windowP0, windowP1, fb->res(), &setup))
+        drawLine(setup, color, state, glm::uvec2(0), fb->res(), fb);
+}
+
+void drawLine(const LineSetup& setup, const Color& color, const LineState& state, const glm::uvec2& scissorMin, const glm::uvec2& scissorMax, FrameBuffer* fb)
+{
+    if (state.depthTest)
+        rasterizeLine<true>(setup, color, state.depthBias, scissorMin, scissorMax, fb);
+    else
+        rasterizeLine<false>(setup, color, state.depthBias, scissorMin, scissorMax, fb);
+}
+
+bool outsideClip(const std::array<glm::vec4, 3>& clipVerts)
+{
+    return outsideClip(clipVerts[0]) && outsideClip(clipVerts[1]) && outsideClip(clipVerts[2]);
 }
 
 bool drawTri(const std::array<glm::vec4, 3>& clipVerts, const Color& color, FrameBuffer* fb)
 {
-    // Rough clipping
-    if (outsideClip(clipVerts[0]) && outsideClip(clipVerts[1]) && outsideClip(clipVerts[2]))
-        return false;
+    return drawTri(clipVerts, color, glm::uvec2(0), fb->res(), fb);
+}
 
-    // NDC convention (clip.xyz / clip.w, 1 / clip.w)
-    const glm::vec4 ndcV0 = perspectiveDiv(clipVerts[0]);
-    const glm::vec4 ndcV1 = perspectiveDiv(clipVerts[1]);
-    const glm::vec4 ndcV2 = perspectiveDiv(clipVerts[2]);
+bool drawTri(const std::array<glm::vec4, 3>& clipVerts, const Color& color, const glm::uvec2& scissorMin, const glm::uvec2& scissorMax, FrameBuffer* fb)
+{
+    ShadingInputs inputs;
+    inputs.color = color;
+    return rasterVariant(RasterState(), Shading::Flat)(clipVerts, inputs, scissorMin, scissorMax, fb);
+}
 
-    // Interpolated per-fragment
-    const std::array<float, 3> ndcDepths = {
-        ndcV0.z,
-        ndcV1.z,
-        ndcV2.z
-    };
+RasterFn rasterVariant(const RasterState& state, Shading shading)
+{
+    const size_t index =
+        state.depthTest | state.depthWrite << 1 | state.colorWrite << 2 | state.depthLessEqual << 3;
+    switch (shading) {
+    case Shading::Flat:
+        return RASTER_VARIANTS<Shading::Flat>[index];
+    case Shading::Lambert:
+        return RASTER_VARIANTS<Shading::Lambert>[index];
+    case Shading::FlatShadowed:
+        return RASTER_VARIANTS<Shading::FlatShadowed>[index];
+    case Shading::LambertShadowed:
+        return RASTER_VARIANTS<Shading::LambertShadowed>[index];
+    }
+    return nullptr;
+}
 
-    // Viewport transformation
-    // Window coordinates bottom-left (0,0), top-right (res.x, res.y)
-    const glm::vec2 res(fb->res());
-    const glm::vec2 halfRes(res / 2.f);
-    const glm::vec2 windowV0 = NDCToFrag(ndcV0, halfRes);
-    const glm::vec2 windowV1 = NDCToFrag(ndcV1, halfRes);
-    const glm::vec2 windowV2 = NDCToFrag(ndcV2, halfRes);
-
-    // Used to enforce top-left rule
-    const glm::vec2 windowE0 = windowV2 - windowV1;
-    const glm::vec2 windowE1 = windowV0 - windowV2;
-    const glm::vec2 windowE2 = windowV1 - windowV0;
-
-    // (Double) tri area for barycentric coordinates
-    const float area = edgeFunc(windowV0, windowV1, windowV2);
-
-    // Viewport clipped bounding box -> [min, max)
-    const glm::vec2 vMin = glm::max(
-        glm::min(windowV0, glm::min(windowV1, windowV2)),
-        glm::vec2(0)
-    );
-    const glm::vec2 vMax = glm::min(
-        glm::max(windowV0, glm::max(windowV1, windowV2)),
-        res
-    );
+BlendFn blendVariant(const RasterState& state, Shading shading)
+{
+    switch (shading) {
+    case Shading::Flat:
+        return BLEND_VARIANTS<Shading::Flat>[state.depthTest];
+    case Shading::Lambert:
+        return BLEND_VARIANTS<Shading::Lambert>[state.depthTest];
+    case Shading::FlatShadowed:
+        return BLEND_VARIANTS<Shading::FlatShadowed>[state.depthTest];
+    case Shading::LambertShadowed:
+        return BLEND_VARIANTS<Shading::LambertShadowed>[state.depthTest];
+    }
+    return nullptr;
+}
 
-    // Check and draw all fragments inside bounding box
-    for (uint32_t x = vMin.x; x < std::ceil(vMax.x); ++x) {
-        for (uint32_t y = vMin.y; y < std::ceil(vMax.y); ++y) {
-            // Use pixel center as usual
-            const glm::vec2 windowP = glm::vec2(x, y) + 0.5f;
-            const glm::vec3 w(
-                edgeFunc(windowV1, windowV2, windowP),
-                edgeFunc(windowV2, windowV0, windowP),
-                edgeFunc(windowV0, windowV1, windowP)
+namespace {
+    template<bool DepthTest, bool LessEqual, bool DepthWrite, bool ColorWrite, bool Blend, typename Shader>
+    bool rasterize(
+        const std::array<glm::vec4, 3>& clipVerts,
+        const Shader& shader,
+        const ShadingInputs& inputs,
+        const glm::uvec2& scissorMin,
+        const glm::uvec2& scissorMax,
+        FrameBuffer* fb,
+        BlendBuffer* blend)
+    {
+        const std::array<Varyings, 3>& varyings = inputs.varyings;
+        // Depth-only passes don't need varyings
+        constexpr bool INTERPOLATE = ColorWrite && Shader::FIRST_VARYING < Shader::LAST_VARYING;
+        constexpr size_t FIRST = Shader::FIRST_VARYING;
+        constexpr size_t LAST = Shader::LAST_VARYING;
+
+        // Rough clipping
+        if (::outsideClip(clipVerts))
+            return false;
+
+        // NDC convention (clip.xyz / clip.w, 1 / clip.w)
+        const glm::vec4 ndcV0 = perspectiveDiv(clipVerts[0]);
+        const glm::vec4 ndcV1 = perspectiveDiv(clipVerts[1]);
+        const glm::vec4 ndcV2 = perspectiveDiv(clipVerts[2]);
+
+        // Viewport transformation
+        // Window coordinates bottom-left (0,0), top-right (res.x, res.y)
+        const glm::vec2 res(fb->res());
+        const glm::vec2 halfRes(res / 2.f);
+        const glm::vec2 windowV0 = NDCToWindow(ndcV0, halfRes);
+        const glm::vec2 windowV1 = NDCToWindow(ndcV1, halfRes);
+        const glm::vec2 windowV2 = NDCToWindow(ndcV2, halfRes);
+
+        // Used to enforce top-left rule
+        const glm::bvec3 topLeft(
+            isTopLeft(windowV2 - windowV1),
+            isTopLeft(windowV0 - windowV2),
+            isTopLeft(windowV1 - windowV0)
+        );
+
+        // (Double) tri area for barycentric coordinates
+        // Degenerate and cw triangles can't cover any samples
+        const float area = edgeFunc(windowV0, windowV1, windowV2);
+        if (!(area > 0.f))
+            return false;
+
+        // Only pixels with a sample inside the scissor clipped bounding box
+        // can be covered -> [pMin, pMax)
+        const uint32_t samples = fb->samples();
+        glm::vec2 offsetMin(0.f);
+        glm::vec2 offsetMax(0.f);
+        for (uint32_t s = 0; s < samples; ++s) {
+            offsetMin = glm::min(offsetMin, fb->sampleOffsets()[s]);
+            offsetMax = glm::max(offsetMax, fb->sampleOffsets()[s]);
+        }
+        const glm::vec2 vMin = glm::min(windowV0, glm::min(windowV1, windowV2));
+        const glm::vec2 vMax = glm::max(windowV0, glm::max(windowV1, windowV2));
+        const glm::vec2 pMinF = glm::max(
+            glm::ceil(vMin - 0.5f - offsetMax),
+            glm::vec2(scissorMin)
+        );
+        const glm::vec2 pMaxF = glm::min(
+            glm::floor(vMax - 0.5f - offsetMin) + 1.f,
+            glm::vec2(scissorMax)
+        );
+        // Tiny triangles that fall between sample positions are culled here
+        if (pMinF.x >= pMaxF.x || pMinF.y >= pMaxF.y)
+            return false;
+        const glm::uvec2 pMin(pMinF);
+        const glm::uvec2 pMax(pMaxF);
+        const glm::uvec2 pSize = pMax - pMin;
+
+        // Triangle setup
+        // Barycentrics are the edge functions divided by area so any attribute
+        // is a plane built from them, fragments then only need adds
+        const std::array<Plane, 3> edgePlanes = {
+            edgePlane(windowV1, windowV2),
+            edgePlane(windowV2, windowV0),
+            edgePlane(windowV0, windowV1)
+        };
+        std::array<Plane, 3> baryPlanes = edgePlanes;
+        const float invArea = 1.f / area;
+        for (auto& plane : baryPlanes) {
+            plane.dx *= invArea;
+            plane.dy *= invArea;
+            plane.c *= invArea;
+        }
+
+        // This makes depth non-linear, though it matches what OpenGL does
+        TriSetup setup;
+        setup.depth = attributePlane(baryPlanes, glm::vec3(ndcV0.z, ndcV1.z, ndcV2.z));
+        setup.invW = attributePlane(baryPlanes, glm::vec3(ndcV0.w, ndcV1.w, ndcV2.w));
+
+        // Edge functions and depth are linear so samples are a constant offset
+        // from the pixel center
+        std::array<glm::vec3, 8> sampleDeltas;
+        std::array<float, 8> sampleDepthDeltas;
+        for (uint32_t s = 0; s < samples; ++s) {
+            const glm::vec2& offset = fb->sampleOffsets()[s];
+            sampleDeltas[s] = glm::vec3(
+                edgeFuncDelta(windowV1, windowV2, offset),
+                edgeFuncDelta(windowV2, windowV0, offset),
+                edgeFuncDelta(windowV0, windowV1, offset)
             );
+            sampleDepthDeltas[s] = setup.depth.dx * offset.x + setup.depth.dy * offset.y;
+        }
 
-            // Half-space check with top-left rule
-            bool overlaps = true;
-            overlaps &= w.x == 0 ? ((windowE0.y == 0 && windowE0.x > 0) || windowE0.y > 0) : (w.x > 0);
-            overlaps &= w.y == 0 ? ((windowE1.y == 0 && windowE1.x > 0) || windowE1.y > 0) : (w.y > 0);
-            overlaps &= w.z == 0 ? ((windowE2.y == 0 && windowE2.x > 0) || windowE2.y > 0) : (w.z > 0);
-
-            if (overlaps) {
-                // All attributes are interpolated with perspective corrected barys
-                const glm::vec3 windowBary(w.x / area, w.y / area, w.z / area);
-                const glm::vec3 correctedBary = [&](){
-                    const glm::vec3 bary(
-                        windowBary.x * ndcV0.w,
-                        windowBary.y * ndcV1.w,
-                        windowBary.z * ndcV2.w
-                    );
-                    return bary / (bary.x + bary.y + bary.z);
-                }();
-
-                // This makes depth non-linear, though it matches what OpenGL does
-                const float depth = baryInterp(ndcDepths, windowBary);
-
-                if (depth < fb->depth(windowP)) {
-                    fb->setPixel(glm::ivec2(windowP), color);
-                    fb->setDepth(glm::ivec2(windowP), depth);
+        // Coverage and depth are resolved per sample, returns the mask of
+        // samples that pass
+        std::array<float, 8> sampleDepths;
+        const auto testSamples = [&](const glm::ivec2& fragP, float depth, bool covered){
+            // Use pixel center as usual
+            const glm::vec2 windowP = glm::vec2(fragP) + 0.5f;
+            glm::vec3 w(0.f);
+            if (!covered) {
+                w = glm::vec3(
+                    edgeFunc(windowV1, windowV2, windowP),
+                    edgeFunc(windowV2, windowV0, windowP),
+                    edgeFunc(windowV0, windowV1, windowP)
+                );
+            }
+
+            uint32_t mask = 0;
+            for (uint32_t s = 0; s < samples; ++s) {
+                if (!covered && !covers(w + sampleDeltas[s], topLeft))
+                    continue;
+
+                const float sampleDepth = depth + sampleDepthDeltas[s];
+                const float bufferDepth = DepthTest ? fb->depth(fragP, s) : 0.f;
+                if (!DepthTest || sampleDepth < bufferDepth || (LessEqual && sampleDepth == bufferDepth)) {
+                    sampleDepths[s] = sampleDepth;
+                    mask |= 1 << s;
                 }
             }
+            return mask;
+        };
+
+        const auto writeSamples = [&](const glm::ivec2& fragP, uint32_t mask, const Color& fragColor){
+            for (uint32_t s = 0; s < samples; ++s) {
+                if (mask & (1 << s)) {
+                    if constexpr (Blend)
+                        blend->add(fragP, s, fragColor, inputs.alpha, sampleDepths[s]);
+                    else if constexpr (ColorWrite)
+                        fb->setSample(fragP, s, fragColor);
+                    if constexpr (DepthWrite)
+                        fb->setDepth(fragP, s, sampleDepths[s]);
+                }
+            }
+        };
+
+        // Small triangles touch a handful of pixels so skip the varying planes
+        // and interpolate directly from the vertices for the few that pass
+        if (pSize.x * pSize.y <= SMALL_TRI_PIXELS) {
+            for (uint32_t y = pMin.y; y < pMax.y; ++y) {
+                for (uint32_t x = pMin.x; x < pMax.x; ++x) {
+                    const glm::ivec2 fragP(x, y);
+                    const glm::vec2 windowP = glm::vec2(fragP) + 0.5f;
+                    const uint32_t mask = testSamples(fragP, setup.depth.at(windowP), false);
+                    if (mask == 0)
+                        continue;
+
+                    // Shading is done once per pixel at the center
+                    Color fragColor;
+                    if constexpr (INTERPOLATE) {
+                        const glm::vec3 bary(
+                            baryPlanes[0].at(windowP) * ndcV0.w,
+                            baryPlanes[1].at(windowP) * ndcV1.w,
+                            baryPlanes[2].at(windowP) * ndcV2.w
+                        );
+                        const glm::vec3 correctedBary = bary / (bary.x + bary.y + bary.z);
+                        const auto v0 = flatten(varyings[0]);
+                        const auto v1 = flatten(varyings[1]);
+                        const auto v2 = flatten(varyings[2]);
+                        std::array<float, VARYING_FLOATS> fragVaryings{};
+                        for (size_t i = FIRST; i < LAST; ++i)
+                            fragVaryings[i] = glm::dot(correctedBary, glm::vec3(v0[i], v1[i], v2[i]));
+                        fragColor = shader(unflatten(fragVaryings));
+                    } else if constexpr (ColorWrite) {
+                        fragColor = shader(Varyings());
+                    }
+                    writeSamples(fragP, mask, fragColor);
+                }
+            }
+            return true;
         }
-    }
 
-    return true;
+        if constexpr (INTERPOLATE) {
+            const auto v0 = flatten(varyings[0]);
+            const auto v1 = flatten(varyings[1]);
+            const auto v2 = flatten(varyings[2]);
+            for (size_t i = FIRST; i < LAST; ++i) {
+                setup.varyings[i] = attributePlane(
+                    baryPlanes,
+                    glm::vec3(v0[i] * ndcV0.w, v1[i] * ndcV1.w, v2[i] * ndcV2.w)
+                );
+            }
+        }
+
+        // Scans [min, max), coverage tests are skipped for covered blocks
+        std::array<float, VARYING_FLOATS> varyingsOverW;
+        const auto scan = [&](const glm::uvec2& min, const glm::uvec2& max, bool covered){
+            for (uint32_t y = min.y; y < max.y; ++y) {
+                // Planes are evaluated once per row and stepped along it
+                const glm::vec2 rowP = glm::vec2(min.x, y) + 0.5f;
+                float depth = setup.depth.at(rowP);
+                float invW = 0.f;
+                if constexpr (INTERPOLATE) {
+                    invW = setup.invW.at(rowP);
+                    for (size_t i = FIRST; i < LAST; ++i)
+                        varyingsOverW[i] = setup.varyings[i].at(rowP);
+                }
+
+                for (uint32_t x = min.x; x < max.x; ++x) {
+                    const glm::ivec2 fragP(x, y);
+                    const uint32_t mask = testSamples(fragP, depth, covered);
+                    if (mask != 0) {
+                        // Shading is done once per pixel at the center
+                        // Varyings are perspective corrected with a single reciprocal
+                        Color fragColor;
+                        if constexpr (INTERPOLATE) {
+                            const float fragW = 1.f / invW;
+                            std::array<float, VARYING_FLOATS> fragVaryings{};
+                            for (size_t i = FIRST; i < LAST; ++i)
+                                fragVaryings[i] = varyingsOverW[i] * fragW;
+                            fragColor = shader(unflatten(fragVaryings));
+                        } else if constexpr (ColorWrite) {
+                            fragColor = shader(Varyings());
+                        }
+                        writeSamples(fragP, mask, fragColor);
+                    }
+
+                    depth += setup.depth.dx;
+                    if constexpr (INTERPOLATE) {
+                        invW += setup.invW.dx;
+                        for (size_t i = FIRST; i < LAST; ++i)
+                            varyingsOverW[i] += setup.varyings[i].dx;
+                    }
+                }
+            }
+        };
+
+        if (pSize.x <= LARGE_TRI_SIZE || pSize.y <= LARGE_TRI_SIZE) {
+            scan(pMin, pMax, false);
+            return true;
+        }
+
+        // Large triangles are walked in blocks that are rejected or accepted
+        // whole when their corners are all outside or all inside the edges
+        // Blocks are grown by a pixel so that sample offsets and rounding in
+        // the per-pixel test can't disagree with the classification
+        for (uint32_t by = pMin.y; by < pMax.y; by += BLOCK_SIZE) {
+            for (uint32_t bx = pMin.x; bx < pMax.x; bx += BLOCK_SIZE) {
+                const glm::uvec2 min(bx, by);
+                const glm::uvec2 max = glm::min(min + BLOCK_SIZE, pMax);
+                const std::array<glm::vec2, 4> corners = {
+                    glm::vec2(min) - 1.f,
+                    glm::vec2(max.x + 1.f, min.y - 1.f),
+                    glm::vec2(min.x - 1.f, max.y + 1.f),
+                    glm::vec2(max) + 1.f
+                };
+
+                bool outside = false;
+                bool inside = true;
+                for (const auto& plane : edgePlanes) {
+                    float cornerMin = std::numeric_limits<float>::max();
+                    float cornerMax = std::numeric_limits<float>::lowest();
+                    for (const auto& corner : corners) {
+                        const float e = plane.at(corner);
+                        cornerMin = std::min(cornerMin, e);
+                        cornerMax = std::max(cornerMax, e);
+                    }
+                    outside |= cornerMax < 0.f;
+                    inside &= cornerMin > 0.f;
+                }
+
+                if (!outside)
+                    scan(min, max, inside);
+            }
+        }
+
+        return true;
+    }
 }
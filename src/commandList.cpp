@@ -0,0 +1,155 @@
+#include "commandList.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+    template<typename T>
+    using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+    template<typename K, typename V>
+    using ArenaMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, ArenaAllocator<std::pair<const K, V>>>;
+
+    template<typename K>
+    using ArenaSet = std::unordered_set<K, std::hash<K>, std::equal_to<K>, ArenaAllocator<K>>;
+}
+
+void CommandList::reset()
+{
+    _transforms.clear();
+    _draws.clear();
+    _arena.reset();
+}
+
+void CommandList::setState(const DrawState& state)
+{
+    _state = state;
+}
+
+void CommandList::drawPrimitive(const Primitive& primitive, const glm::mat4& modelToWorld, const Material* material)
+{
+    _draws.push_back({
+        &primitive,
+        _transforms.size(),
+        1,
+        material != nullptr ? material : primitive.material,
+        _state
+    });
+    _transforms.push_back(modelToWorld);
+}
+
+void CommandList::drawSkinned(const Primitive& primitive, const SkinnedVertices& vertices)
+{
+    _draws.push_back({
+        &primitive,
+        _transforms.size(),
+        1,
+        primitive.material,
+        _state,
+        &vertices
+    });
+    _transforms.push_back(glm::mat4(1.f));
+}
+
+void CommandList::drawMesh(const Mesh& mesh, const glm::mat4& modelToWorld)
+{
+    drawMeshInstanced(mesh, &modelToWorld, 1);
+}
+
+void CommandList::drawMeshInstanced(const Mesh& mesh, const glm::mat4* modelToWorlds, size_t instanceCount)
+{
+    if (instanceCount == 0)
+        return;
+
+    // Primitives share the transforms
+    for (const auto& primitive : mesh.primitives)
+        _draws.push_back({&primitive, _transforms.size(), instanceCount, primitive.material, _state});
+    _transforms.insert(_transforms.end(), modelToWorlds, modelToWorlds + instanceCount);
+}
+
+void CommandList::drawWorld(const World& world, const Animator* animator)
+{
+    // Nothing loaded yet
+    if (world.scenes.empty())
+        return;
+
+    // Traversal state is only needed until the next reset
+    const ArenaAllocator<uint8_t> alloc(&_arena);
+
+    // Instances of each mesh in the order meshes are first seen
+    struct Instance {
+        size_t group;
+        glm::mat4 transform;
+    };
+    ArenaVector<Instance> instances(alloc);
+    ArenaVector<const Mesh*> meshes(alloc);
+    ArenaMap<const Mesh*, size_t> groups(alloc);
+
+    // Go through scene graph using DFS while keeping track of stacked transform
+    ArenaVector<glm::mat4> parentTransforms(1, glm::mat4(1.f), alloc);
+    ArenaSet<Scene::Node*> visited(alloc);
+    const auto& sceneNodes = world.scenes[world.currentScene].nodes;
+    ArenaVector<Scene::Node*> nodeStack(sceneNodes.begin(), sceneNodes.end(), alloc);
+    while (!nodeStack.empty()) {
+        const auto node = nodeStack.back();
+        if (visited.find(node) != visited.end()) {
+            nodeStack.pop_back();
+            parentTransforms.pop_back();
+        } else {
+            visited.emplace(node);
+            nodeStack.insert(nodeStack.end(), node->children.begin(), node->children.end());
+
+            const glm::mat4 transform = animator != nullptr ?
+                animator->nodeToWorld()[node - world.nodes.data()] :
+                parentTransforms.back() *
+                glm::translate(glm::mat4(1.f), node->translation) *
+                glm::mat4_cast(node->rotation) *
+                glm::scale(glm::mat4(1.f), node->scale);
+
+            if (node->mesh != nullptr && node->skin != nullptr && animator != nullptr) {
+                // Skinned vertices are unique to the node, primitives that
+                // aren't loaded yet stay where the node is
+                for (size_t p = 0; p < node->mesh->primitives.size(); ++p) {
+                    const Primitive& primitive = node->mesh->primitives[p];
+                    if (const SkinnedVertices* skinned = animator->skinned(node, p))
+                        drawSkinned(primitive, *skinned);
+                    else
+                        drawPrimitive(primitive, transform);
+                }
+            } else if (node->mesh != nullptr) {
+                const auto group = groups.emplace(node->mesh, meshes.size());
+                if (group.second)
+                    meshes.push_back(node->mesh);
+                instances.push_back({group.first->second, transform});
+            }
+
+            parentTransforms.push_back(std::move(transform));
+        }
+    }
+
+    // Counting sort gives each mesh a contiguous range of transforms
+    ArenaVector<size_t> offsets(meshes.size() + 1, 0, alloc);
+    for (const auto& instance : instances)
+        offsets[instance.group + 1]++;
+    for (size_t i = 1; i < offsets.size(); ++i)
+        offsets[i] += offsets[i - 1];
+
+    ArenaVector<size_t> next(offsets.begin(), offsets.end() - 1, alloc);
+    ArenaVector<glm::mat4> transforms(instances.size(), alloc);
+    for (const auto& instance : instances)
+        transforms[next[instance.group]++] = instance.transform;
+
+    for (size_t i = 0; i < meshes.size(); ++i)
+        drawMeshInstanced(*meshes[i], &transforms[offsets[i]], offsets[i + 1] - offsets[i]);
+}
+
+const std::vector<glm::mat4>& CommandList::transforms() const
+{
+    return _transforms;
+}
+
+const std::vector<CommandList::Draw>& CommandList::draws() const
+{
+    return _draws;
+}
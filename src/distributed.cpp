@@ -0,0 +1,533 @@
+#include "distributed.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#include "animator.hpp"
+#include "commandList.hpp"
+#include "loader.hpp"
+#include "renderer.hpp"
+
+#ifdef __linux__
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+std::vector<size_t> partitionNodes(const std::vector<size_t>& nodeTriangles, size_t partCount)
+{
+    size_t total = 0;
+    for (const size_t triangles : nodeTriangles)
+        total += triangles;
+
+    std::vector<size_t> parts(nodeTriangles.size());
+    size_t part = 0;
+    size_t sum = 0;
+    for (size_t n = 0; n < nodeTriangles.size(); ++n) {
+        parts[n] = part;
+        sum += nodeTriangles[n];
+        if (part + 1 < partCount && sum * partCount >= total * (part + 1))
+            ++part;
+    }
+    return parts;
+}
+
+#ifdef __linux__
+
+namespace {
+    // How often blocked waits check that the other side is still there
+    const long WAIT_POLL_NANOS = 100'000'000;
+    const size_t SHARED_ALIGNMENT = 64;
+
+    // Lives at the start of each worker's shared memory
+    struct SharedHeader {
+        // The compositor posts start for each frame, the worker posts done
+        // once it has loaded and after each frame
+        sem_t start;
+        sem_t done;
+        uint32_t index;
+        uint32_t workerCount;
+        glm::uvec2 maxRes;
+        uint32_t samples;
+
+        // Written by the compositor before start
+        bool quit;
+        glm::uvec2 res;
+        Camera camera;
+        WorkerSettings settings;
+
+        // Written by the worker before done
+        bool changed;
+        size_t drawnTris;
+        size_t culledTris;
+        // Set if the worker failed, it exits after posting done
+        char error[256];
+    };
+
+    size_t alignShared(size_t offset)
+    {
+        return (offset + SHARED_ALIGNMENT - 1) / SHARED_ALIGNMENT * SHARED_ALIGNMENT;
+    }
+
+    size_t colorOffset()
+    {
+        return alignShared(sizeof(SharedHeader));
+    }
+
+    size_t depthOffset(const glm::uvec2& maxRes, uint32_t samples)
+    {
+        return alignShared(colorOffset() + maxRes.x * maxRes.y * samples * sizeof(Color));
+    }
+
+    size_t sharedBytes(const glm::uvec2& maxRes, uint32_t samples)
+    {
+        return depthOffset(maxRes, samples) + maxRes.x * maxRes.y * samples * sizeof(float);
+    }
+
+    // Returns false if alive() does while waiting
+    template<typename Fn>
+    bool waitSemaphore(sem_t* semaphore, const Fn& alive)
+    {
+        while (true) {
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += WAIT_POLL_NANOS;
+            if (deadline.tv_nsec >= 1'000'000'000) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1'000'000'000;
+            }
+            if (sem_timedwait(semaphore, &deadline) == 0)
+                return true;
+            if (errno != ETIMEDOUT && errno != EINTR)
+                throw std::runtime_error("Waiting on a shared semaphore failed");
+            if (!alive())
+                return false;
+        }
+    }
+}
+
+// Shared memory of one worker, the header followed by color and depth samples
+// in the order FrameBuffer keeps them
+class SharedFrame
+{
+public:
+    // Creates the segment, it is unlinked again when this is destroyed
+    SharedFrame(const std::string& name, const glm::uvec2& maxRes, uint32_t samples) :
+        _name(name),
+        _owner(true),
+        _byteSize(sharedBytes(maxRes, samples))
+    {
+        const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+            throw std::runtime_error("Failed to create shared memory " + name);
+        if (ftruncate(fd, _byteSize) != 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+            throw std::runtime_error("Failed to size shared memory " + name);
+        }
+        map(fd);
+
+        SharedHeader* header = new (_data) SharedHeader();
+        header->maxRes = maxRes;
+        header->samples = samples;
+        if (sem_init(&header->start, 1, 0) != 0 || sem_init(&header->done, 1, 0) != 0) {
+            munmap(_data, _byteSize);
+            shm_unlink(name.c_str());
+            throw std::runtime_error("Failed to create shared semaphores");
+        }
+    }
+
+    // Maps one that the compositor created
+    explicit SharedFrame(const std::string& name) :
+        _name(name),
+        _owner(false)
+    {
+        const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open shared memory " + name);
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(SharedHeader)) {
+            close(fd);
+            throw std::runtime_error("Bad shared memory " + name);
+        }
+        _byteSize = info.st_size;
+        map(fd);
+    }
+
+    ~SharedFrame()
+    {
+        if (_owner) {
+            sem_destroy(&header()->start);
+            sem_destroy(&header()->done);
+        }
+        munmap(_data, _byteSize);
+        if (_owner)
+            shm_unlink(_name.c_str());
+    }
+
+    SharedFrame(const SharedFrame&) = delete;
+    SharedFrame& operator=(const SharedFrame&) = delete;
+
+    SharedHeader* header()
+    {
+        return reinterpret_cast<SharedHeader*>(_data);
+    }
+
+    Color* colors()
+    {
+        return reinterpret_cast<Color*>(_data + colorOffset());
+    }
+
+    float* depth()
+    {
+        return reinterpret_cast<float*>(_data + depthOffset(header()->maxRes, header()->samples));
+    }
+
+    size_t byteSize() const
+    {
+        return _byteSize;
+    }
+
+private:
+    void map(int fd)
+    {
+        void* data = mmap(nullptr, _byteSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            if (_owner)
+                shm_unlink(_name.c_str());
+            throw std::runtime_error("Failed to map shared memory " + _name);
+        }
+        _data = static_cast<uint8_t*>(data);
+    }
+
+    std::string _name;
+    bool _owner;
+    size_t _byteSize = 0;
+    uint8_t* _data = nullptr;
+};
+
+DistributedRenderer::DistributedRenderer(
+    JobSystem* jobs,
+    const std::vector<std::string>& args,
+    size_t workerCount,
+    const glm::uvec2& maxRes,
+    uint32_t samples,
+    size_t pinnedCores) :
+    _jobs(jobs),
+    _workers(workerCount)
+{
+    try {
+        for (size_t i = 0; i < workerCount; ++i) {
+            Worker& worker = _workers[i];
+            const std::string name =
+                "/rasterry-" + std::to_string(getpid()) + "-" + std::to_string(i);
+            worker.frame = std::make_unique<SharedFrame>(name, maxRes, samples);
+            worker.frame->header()->index = i;
+            worker.frame->header()->workerCount = workerCount;
+
+            std::vector<std::string> workerArgs = args;
+            if (pinnedCores > 0) {
+                workerArgs.push_back("--pin-threads");
+                workerArgs.push_back("--first-core");
+                workerArgs.push_back(std::to_string(i * pinnedCores));
+            }
+            workerArgs.push_back("--worker");
+            workerArgs.push_back(name);
+            std::vector<char*> argv;
+            for (auto& arg : workerArgs)
+                argv.push_back(&arg[0]);
+            argv.push_back(nullptr);
+
+            // Works no matter how this was started
+            pid_t pid;
+            if (posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, argv.data(), environ) != 0)
+                throw std::runtime_error("Failed to start render worker");
+            worker.pid = pid;
+        }
+    } catch (...) {
+        for (auto& worker : _workers) {
+            if (worker.pid >= 0) {
+                kill(worker.pid, SIGTERM);
+                waitpid(worker.pid, nullptr, 0);
+            }
+        }
+        throw;
+    }
+}
+
+DistributedRenderer::~DistributedRenderer()
+{
+    for (auto& worker : _workers) {
+        if (worker.pid < 0)
+            continue;
+        if (worker.ready) {
+            worker.frame->header()->quit = true;
+            sem_post(&worker.frame->header()->start);
+        } else {
+            // Still loading, there's nothing to finish
+            kill(worker.pid, SIGTERM);
+        }
+        waitpid(worker.pid, nullptr, 0);
+    }
+}
+
+std::tuple<bool, size_t, size_t> DistributedRenderer::render(const Camera& camera, const WorkerSettings& settings, FrameBuffer* fb)
+{
+    if (fb->samples() != _workers.front().frame->header()->samples)
+        throw std::runtime_error("Frame buffer samples don't match the workers'");
+
+    for (auto& worker : _workers) {
+        if (worker.ready)
+            continue;
+        if (sem_trywait(&worker.frame->header()->done) == 0) {
+            if (worker.frame->header()->error[0] != '\0')
+                throw std::runtime_error(std::string("Render worker failed: ") + worker.frame->header()->error);
+            worker.ready = true;
+        } else
+            checkAlive(&worker);
+    }
+
+    std::vector<const Worker*> ready;
+    for (auto& worker : _workers) {
+        if (!worker.ready)
+            continue;
+        SharedHeader* header = worker.frame->header();
+        header->res = fb->res();
+        header->camera = camera;
+        header->settings = settings;
+        sem_post(&header->start);
+        ready.push_back(&worker);
+    }
+
+    // Workers that joined change the image even if their parts didn't
+    bool changed = ready.size() != _mergedCount;
+    size_t drawnTris = 0;
+    size_t culledTris = 0;
+    for (auto& worker : _workers) {
+        if (!worker.ready)
+            continue;
+        waitDone(&worker);
+        const SharedHeader* header = worker.frame->header();
+        changed = changed || header->changed;
+        drawnTris += header->drawnTris;
+        culledTris += header->culledTris;
+    }
+    _mergedCount = ready.size();
+    if (!changed)
+        return std::make_tuple(false, drawnTris, culledTris);
+
+    if (ready.empty()) {
+        fb->clear(Color(0, 0, 0));
+        fb->clearDepth(1.f);
+    } else
+        merge(ready, fb);
+
+    return std::make_tuple(true, drawnTris, culledTris);
+}
+
+MemoryUsage DistributedRenderer::memoryUsage() const
+{
+    MemoryUsage usage;
+    for (const auto& worker : _workers) {
+        usage.used += worker.frame->byteSize();
+        usage.reserved += worker.frame->byteSize();
+    }
+    return usage;
+}
+
+void DistributedRenderer::checkAlive(Worker* worker)
+{
+    if (worker->pid >= 0 && waitpid(worker->pid, nullptr, WNOHANG) == 0)
+        return;
+    worker->pid = -1;
+    throw std::runtime_error("Render worker exited");
+}
+
+void DistributedRenderer::waitDone(Worker* worker)
+{
+    SharedHeader* header = worker->frame->header();
+    waitSemaphore(&header->done, [&]{
+        checkAlive(worker);
+        return true;
+    });
+    if (header->error[0] != '\0')
+        throw std::runtime_error(std::string("Render worker failed: ") + header->error);
+}
+
+void DistributedRenderer::merge(const std::vector<const Worker*>& workers, FrameBuffer* fb)
+{
+    std::vector<const Color*> colors;
+    std::vector<const float*> depths;
+    for (const auto* worker : workers) {
+        colors.push_back(worker->frame->colors());
+        depths.push_back(worker->frame->depth());
+    }
+
+    const glm::uvec2 res = fb->res();
+    const uint32_t samples = fb->samples();
+    _jobs->parallelFor(0, res.y, 8, [&](size_t begin, size_t end){
+        for (size_t y = begin; y < end; ++y) {
+            for (uint32_t x = 0; x < res.x; ++x) {
+                const glm::ivec2 p(x, y);
+                for (uint32_t s = 0; s < samples; ++s) {
+                    const size_t i = (y * res.x + x) * samples + s;
+                    // Ties go to the lower worker so the result is stable
+                    size_t nearest = 0;
+                    float depth = depths[0][i];
+                    for (size_t w = 1; w < depths.size(); ++w) {
+                        if (depths[w][i] < depth) {
+                            depth = depths[w][i];
+                            nearest = w;
+                        }
+                    }
+                    fb->setSample(p, s, colors[nearest][i]);
+                    fb->setDepth(p, s, depth);
+                }
+            }
+        }
+    });
+}
+
+bool runRenderWorker(const std::string& sharedName, const std::string& scenePath, JobSystem* jobs, bool packVertices)
+{
+    SharedFrame shared(sharedName);
+    SharedHeader* header = shared.header();
+    // Workers are orphaned if the compositor dies without stopping them
+    const pid_t parent = getppid();
+
+    try {
+        const size_t part = header->index;
+        const size_t partCount = header->workerCount;
+        World world = loadGLTF(scenePath, jobs, packVertices, [&](const std::vector<size_t>& nodeTriangles){
+            const std::vector<size_t> parts = partitionNodes(nodeTriangles, partCount);
+            std::vector<uint8_t> keep(parts.size());
+            for (size_t n = 0; n < parts.size(); ++n)
+                keep[n] = parts[n] == part;
+            return keep;
+        });
+        // Blending only sees this worker's part, the merge keeps one sample
+        size_t blended = 0;
+        for (auto& material : world.materials) {
+            blended += material.blend;
+            material.blend = false;
+        }
+        if (blended > 0)
+            printf("Drawing %zu blended materials opaque across workers\n", blended);
+
+        // Nodes of other parts are still posed, they can be parents of ours
+        std::unique_ptr<Animator> animator;
+        if (!world.animations.empty() || !world.skins.empty())
+            animator = std::make_unique<Animator>(&world, jobs);
+
+        FrameBuffer fb(header->maxRes, header->samples);
+        Renderer renderer(jobs);
+        CommandList commands;
+        sem_post(&header->done);
+
+        while (waitSemaphore(&header->start, [&]{ return getppid() == parent; }) && !header->quit) {
+            const WorkerSettings& settings = header->settings;
+            renderer.setOcclusionCulling(settings.occlusionCulling);
+            renderer.setFrameReuse(settings.frameReuse);
+            renderer.setDepthPrepass(settings.depthPrepass);
+            fb.setRes(header->res);
+            if (animator != nullptr && settings.animate)
+                animator->update(0, settings.seconds);
+
+            commands.reset();
+            commands.drawWorld(world, animator.get());
+
+            header->changed = renderer.beginFrame(commands, header->camera, fb);
+            header->drawnTris = 0;
+            header->culledTris = 0;
+            if (header->changed) {
+                renderer.clear(Color(0, 0, 0), 1.f, &fb);
+                std::tie(header->drawnTris, header->culledTris) =
+                    renderer.execute(commands, header->camera, &fb);
+
+                const glm::uvec2 res = fb.res();
+                const uint32_t samples = fb.samples();
+                Color* colors = shared.colors();
+                float* depth = shared.depth();
+                jobs->parallelFor(0, res.y, 8, [&](size_t begin, size_t end){
+                    for (size_t y = begin; y < end; ++y) {
+                        for (uint32_t x = 0; x < res.x; ++x) {
+                            const glm::ivec2 p(x, y);
+                            for (uint32_t s = 0; s < samples; ++s) {
+                                const size_t i = (y * res.x + x) * samples + s;
+                                colors[i] = fb.sample(p, s);
+                                depth[i] = fb.depth(p, s);
+                            }
+                        }
+                    }
+                });
+            }
+            sem_post(&header->done);
+        }
+    } catch (const std::exception& e) {
+        // The compositor reports it, exiting beats terminating with the
+        // shared memory still mapped
+        snprintf(header->error, sizeof(header->error), "%s", e.what());
+        sem_post(&header->done);
+        return false;
+    }
+    return true;
+}
+
+#else
+
+class SharedFrame { };
+
+DistributedRenderer::DistributedRenderer(
+    JobSystem* jobs,
+    const std::vector<std::string>& args,
+    size_t workerCount,
+    const glm::uvec2& maxRes,
+    uint32_t samples,
+    size_t pinnedCores) :
+    _jobs(jobs)
+{
+    (void) args;
+    (void) workerCount;
+    (void) maxRes;
+    (void) samples;
+    (void) pinnedCores;
+    throw std::runtime_error("Distributed rendering needs Linux");
+}
+
+DistributedRenderer::~DistributedRenderer() { }
+
+std::tuple<bool, size_t, size_t> DistributedRenderer::render(const Camera& camera, const WorkerSettings& settings, FrameBuffer* fb)
+{
+    (void) camera;
+    (void) settings;
+    (void) fb;
+    return std::make_tuple(false, 0, 0);
+}
+
+MemoryUsage DistributedRenderer::memoryUsage() const
+{
+    return MemoryUsage();
+}
+
+bool runRenderWorker(const std::string& sharedName, const std::string& scenePath, JobSystem* jobs, bool packVertices)
+{
+    (void) sharedName;
+    (void) scenePath;
+    (void) jobs;
+    (void) packVertices;
+    throw std::runtime_error("Distributed rendering needs Linux");
+}
+
+#endif
@@ -0,0 +1,53 @@
+#include "dynamicResolution.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    // Aim a bit under the target to leave room for noise
+    const float HEADROOM = 0.9f;
+    // Largest scale increase per frame
+    const float MAX_STEP_UP = 0.02f;
+    // Changes smaller than this aren't worth a full redraw
+    const float MIN_STEP = 0.01f;
+    // Resolutions are kept to multiples of this
+    const uint32_t RES_ALIGN = 8;
+}
+
+DynamicResolution::DynamicResolution(const glm::uvec2& maxRes, float targetMillis, float minScale) :
+    _maxRes(maxRes),
+    _targetMillis(targetMillis),
+    _minScale(minScale)
+{ }
+
+float DynamicResolution::scale() const
+{
+    return _scale;
+}
+
+glm::uvec2 DynamicResolution::res() const
+{
+    const glm::uvec2 res = glm::uvec2(glm::vec2(_maxRes) * _scale);
+    // Aligned down but never to zero
+    return glm::max(res / RES_ALIGN * RES_ALIGN, glm::min(_maxRes, glm::uvec2(RES_ALIGN)));
+}
+
+void DynamicResolution::update(float millis)
+{
+    if (millis <= 0.f)
+        return;
+
+    // Draw time is mostly proportional to the pixel count
+    const float ideal = std::clamp(
+        _scale * std::sqrt(HEADROOM * _targetMillis / millis),
+        _minScale,
+        1.f
+    );
+    if (std::abs(ideal - _scale) < MIN_STEP)
+        return;
+
+    if (ideal < _scale)
+        _scale = ideal;
+    else
+        _scale = std::min(ideal, _scale + MAX_STEP_UP);
+}
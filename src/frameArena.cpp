@@ -0,0 +1,52 @@
+#include "frameArena.hpp"
+
+#include <algorithm>
+
+FrameArena::FrameArena(size_t blockSize) :
+    _blockSize(blockSize)
+{ }
+
+void* FrameArena::allocate(size_t size, size_t alignment)
+{
+    while (_block < _blocks.size()) {
+        Block& block = _blocks[_block];
+        const uintptr_t base = reinterpret_cast<uintptr_t>(block.data.get());
+        const uintptr_t aligned = (base + _offset + alignment - 1) & ~(uintptr_t(alignment) - 1);
+        const size_t end = aligned - base + size;
+        if (end <= block.size) {
+            _offset = end;
+            return reinterpret_cast<void*>(aligned);
+        }
+
+        _block++;
+        _offset = 0;
+    }
+
+    // Out of blocks, the new one fits at least this allocation
+    const size_t blockSize = std::max(_blockSize, size + alignment);
+    _blocks.push_back({std::make_unique<uint8_t[]>(blockSize), blockSize});
+    _block = _blocks.size() - 1;
+    _offset = 0;
+    return allocate(size, alignment);
+}
+
+void FrameArena::reset()
+{
+    // Merge blocks so that the next frame fits in one
+    if (_blocks.size() > 1) {
+        const size_t size = capacity();
+        _blocks.clear();
+        _blocks.push_back({std::make_unique<uint8_t[]>(size), size});
+    }
+
+    _block = 0;
+    _offset = 0;
+}
+
+size_t FrameArena::capacity() const
+{
+    size_t size = 0;
+    for (const auto& block : _blocks)
+        size += block.size;
+    return size;
+}
@@ -1,77 +1,225 @@
 #include "frameBuffer.hpp"
 
 #include <algorithm>
+#include <stdexcept>
 
-FrameBuffer::
-    FrameBuffer(const glm::uvec2& res, const glm::uvec2& outRes) :
+namespace {
+    // Standard D3D sample patterns in 1/16th of a pixel
+    std::vector<glm::vec2> standardSampleOffsets(uint32_t samples)
+    {
+        std::vector<glm::ivec2> pattern;
+        switch (samples) {
+        case 1:
+            pattern = {{0, 0}};
+            break;
+        case 2:
+            pattern = {{4, 4}, {-4, -4}};
+            break;
+        case 4:
+            pattern = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+            break;
+        case 8:
+            pattern = {
+                {1, -3}, {-1, 3}, {5, 1}, {-3, -5},
+                {-5, 5}, {-7, -1}, {3, 7}, {7, -7}
+            };
+            break;
+        default:
+            throw std::runtime_error("Unsupported sample count");
+        }
+
+        std::vector<glm::vec2> offsets;
+        for (const auto& p : pattern)
+            offsets.emplace_back(glm::vec2(p) / 16.f);
+        return offsets;
+    }
+}
+
+FrameBuffer::FrameBuffer(const glm::uvec2& res, uint32_t samples) :
     _res(res),
-    _outRes(outRes),
-    _pixels(_res.x * _res.y),
-    _depth(_res.x * _res.y)
+    _maxRes(res),
+    _samples(samples),
+    _sampleOffsets(standardSampleOffsets(samples)),
+    _colors(_res.x * _res.y * _samples),
+    _depth(_res.x * _res.y * _samples),
+    _resolved(_samples > 1 ? _res.x * _res.y : 0)
+{ }
+
+const glm::uvec2& FrameBuffer::res() const
+{
+    return _res;
+}
+
+const glm::uvec2& FrameBuffer::maxRes() const
 {
-    glGenFramebuffers(1, &_fbo);
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _fbo);
+    return _maxRes;
+}
 
-    // Generate texture
-    glGenTextures(1, &_textureID);
-    glBindTexture(GL_TEXTURE_2D, _textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, _res.x, _res.y, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-    glBindTexture(GL_TEXTURE_2D, 0);
+void FrameBuffer::setRes(const glm::uvec2& res)
+{
+    if (res.x == 0 || res.y == 0 || res.x > _maxRes.x || res.y > _maxRes.y)
+        throw std::runtime_error("Frame buffer resolution out of range");
 
-    // Bind to fbo
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _textureID, 0);
+    // Rows are packed by the current width
+    _res = res;
 }
 
-FrameBuffer::~FrameBuffer()
+uint32_t FrameBuffer::samples() const
 {
-    glDeleteFramebuffers(1, &_fbo);
-    glDeleteTextures(1, &_textureID);
+    return _samples;
 }
 
-const glm::uvec2& FrameBuffer::res() const
+const std::vector<glm::vec2>& FrameBuffer::sampleOffsets() const
 {
-    return _res;
+    return _sampleOffsets;
 }
 
-float FrameBuffer::depth(const glm::ivec2& p) const
+const std::vector<Color>& FrameBuffer::pixels() const
 {
-    return _depth[p.y * _res.x + p.x];
+    return _samples > 1 ? _resolved : _colors;
+}
+
+Color FrameBuffer::sample(const glm::ivec2& p, uint32_t sample) const
+{
+    return _colors[sampleIndex(p, sample)];
+}
+
+float FrameBuffer::depth(const glm::ivec2& p, uint32_t sample) const
+{
+    return _depth[sampleIndex(p, sample)];
+}
+
+const std::vector<float>& FrameBuffer::depths() const
+{
+    return _depth;
 }
 
 void FrameBuffer::setPixel(const glm::ivec2& p, const Color& color)
 {
-    _pixels[p.y * _res.x + p.x] = color;
+    const size_t first = sampleIndex(p, 0);
+    std::fill(&_colors[first], &_colors[first] + _samples, color);
 }
 
-void FrameBuffer::setDepth(const glm::ivec2& p, float value)
+void FrameBuffer::setSample(const glm::ivec2& p, uint32_t sample, const Color& color)
 {
-    _depth[p.y * _res.x + p.x] = value;
+    _colors[sampleIndex(p, sample)] = color;
 }
 
-void FrameBuffer::display()
+void FrameBuffer::setDepth(const glm::ivec2& p, float value)
 {
-    // Push new frame to buffer
-    glBindTexture(GL_TEXTURE_2D, _textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, _res.x, _res.y, 0, GL_RGB, GL_UNSIGNED_BYTE, _pixels.data());
-    glBindTexture(GL_TEXTURE_2D, 0);
+    const size_t first = sampleIndex(p, 0);
+    std::fill(&_depth[first], &_depth[first] + _samples, value);
+}
 
-    // Blit to default buffer
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-    glBindFramebuffer(GL_READ_FRAMEBUFFER, _fbo);
-    glReadBuffer(GL_COLOR_ATTACHMENT0);
-    glBlitFramebuffer(0, 0, _res.x, _res.y, 0, 0, _outRes.x, _outRes.y, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+void FrameBuffer::setDepth(const glm::ivec2& p, uint32_t sample, float value)
+{
+    _depth[sampleIndex(p, sample)] = value;
 }
 
 void FrameBuffer::clear(const Color& color)
 {
-    std::fill(_pixels.begin(), _pixels.end(), color);
+    std::fill(_colors.begin(), _colors.end(), color);
 }
 
 void FrameBuffer::clearDepth(float value)
 {
     std::fill(_depth.begin(), _depth.end(), value);
 }
+
+void FrameBuffer::resolve()
+{
+    resolve(glm::uvec2(0), _res);
+}
+
+void FrameBuffer::copy(const FrameBuffer& src, const glm::uvec2& offset)
+{
+    if (src._samples != _samples || offset.x + src._res.x > _res.x || offset.y + src._res.y > _res.y)
+        throw std::runtime_error("Copied frame buffer doesn't fit");
+
+    // Rows are contiguous in both
+    const size_t rowSamples = src._res.x * _samples;
+    for (uint32_t y = 0; y < src._res.y; ++y) {
+        const size_t from = src.sampleIndex(glm::ivec2(0, y), 0);
+        const size_t to = sampleIndex(glm::ivec2(offset.x, offset.y + y), 0);
+        std::copy_n(&src._colors[from], rowSamples, &_colors[to]);
+        std::copy_n(&src._depth[from], rowSamples, &_depth[to]);
+    }
+}
+
+void FrameBuffer::clear(const Color& color, const glm::uvec2& min, const glm::uvec2& max)
+{
+    if (min.x >= max.x)
+        return;
+
+    for (uint32_t y = min.y; y < max.y; ++y) {
+        std::fill(
+            &_colors[sampleIndex(glm::ivec2(min.x, y), 0)],
+            &_colors[sampleIndex(glm::ivec2(max.x - 1, y), _samples - 1)] + 1,
+            color
+        );
+    }
+}
+
+void FrameBuffer::clearDepth(float value, const glm::uvec2& min, const glm::uvec2& max)
+{
+    if (min.x >= max.x)
+        return;
+
+    for (uint32_t y = min.y; y < max.y; ++y) {
+        std::fill(
+            &_depth[sampleIndex(glm::ivec2(min.x, y), 0)],
+            &_depth[sampleIndex(glm::ivec2(max.x - 1, y), _samples - 1)] + 1,
+            value
+        );
+    }
+}
+
+void FrameBuffer::resolve(const glm::uvec2& min, const glm::uvec2& max)
+{
+    if (_samples == 1)
+        return;
+
+    for (uint32_t y = min.y; y < max.y; ++y) {
+        for (uint32_t x = min.x; x < max.x; ++x) {
+            const size_t i = y * _res.x + x;
+            const Color* samples = &_colors[i * _samples];
+
+            // Only edge pixels have differing samples
+            bool uniform = true;
+            for (uint32_t s = 1; s < _samples; ++s) {
+                uniform &= samples[s].r == samples[0].r &&
+                           samples[s].g == samples[0].g &&
+                           samples[s].b == samples[0].b;
+            }
+            if (uniform) {
+                _resolved[i] = samples[0];
+                continue;
+            }
+
+            glm::uvec3 sum(0);
+            for (uint32_t s = 0; s < _samples; ++s)
+                sum += glm::uvec3(samples[s].r, samples[s].g, samples[s].b);
+            sum /= _samples;
+            _resolved[i] = Color(sum.x, sum.y, sum.z);
+        }
+    }
+}
+
+MemoryUsage FrameBuffer::memoryUsage() const
+{
+    const size_t samples = _res.x * _res.y * _samples;
+    MemoryUsage usage;
+    usage.used = samples * (sizeof(Color) + sizeof(float));
+    if (_samples > 1)
+        usage.used += _res.x * _res.y * sizeof(Color);
+    usage.reserved =
+        _colors.capacity() * sizeof(Color) +
+        _depth.capacity() * sizeof(float) +
+        _resolved.capacity() * sizeof(Color);
+    return usage;
+}
+
+size_t FrameBuffer::sampleIndex(const glm::ivec2& p, uint32_t sample) const
+{
+    return (p.y * _res.x + p.x) * _samples + sample;
+}
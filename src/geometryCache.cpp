@@ -0,0 +1,349 @@
+#include "geometryCache.hpp"
+
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define GEOMETRYCACHE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif // __unix__ || __APPLE__
+
+namespace {
+    const char MAGIC[4] = {'R', 'G', 'E', 'O'};
+    const uint32_t VERSION = 5;
+    // Longer source paths mean the header is garbage
+    const uint64_t MAX_PATH_LENGTH = 1 << 16;
+    // Attribute arrays start at this alignment
+    const size_t ALIGNMENT = 16;
+
+    size_t align(size_t offset)
+    {
+        return (offset + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    template<typename T>
+    size_t arrayBytes(uint64_t count)
+    {
+        return align(count * sizeof(T));
+    }
+
+    size_t entryBytes(const GeometryCache::Entry& entry)
+    {
+        return arrayBytes<glm::vec3>(entry.positions) +
+               arrayBytes<glm::vec3>(entry.normals) +
+               arrayBytes<glm::vec4>(entry.tangents) +
+               arrayBytes<glm::vec2>(entry.texCoord0s) +
+               arrayBytes<TriIndices>(entry.tris) +
+               arrayBytes<glm::u16vec3>(entry.packedPositions) +
+               arrayBytes<glm::i16vec2>(entry.packedNormals) +
+               arrayBytes<glm::i16vec2>(entry.packedTangents) +
+               arrayBytes<glm::u16vec2>(entry.packedTexCoord0s) +
+               arrayBytes<glm::u16vec4>(entry.joints) +
+               arrayBytes<glm::vec4>(entry.weights);
+    }
+
+    // What a source file looked like when the cache was written
+    struct SourceStamp {
+        uint64_t size;
+        int64_t modified;
+    };
+
+    SourceStamp stampSource(const std::string& path)
+    {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+            throw std::runtime_error("Failed to stat " + path);
+        return {static_cast<uint64_t>(info.st_size), static_cast<int64_t>(info.st_mtime)};
+    }
+
+    template<typename T>
+    void writeValue(std::ofstream& file, const T& value)
+    {
+        file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template<typename T>
+    void readValue(std::ifstream& file, T* value)
+    {
+        file.read(reinterpret_cast<char*>(value), sizeof(T));
+    }
+
+    template<typename T>
+    void writeArray(std::ofstream& file, const std::vector<T>& values)
+    {
+        const size_t bytes = values.size() * sizeof(T);
+        file.write(reinterpret_cast<const char*>(values.data()), bytes);
+        const char padding[ALIGNMENT] = {};
+        file.write(padding, align(bytes) - bytes);
+    }
+
+    template<typename T>
+    const uint8_t* readArray(const uint8_t* data, uint64_t count, std::vector<T>* out)
+    {
+        out->resize(count);
+        std::memcpy(out->data(), data, count * sizeof(T));
+        return data + arrayBytes<T>(count);
+    }
+}
+
+void writeGeometryCache(
+    const std::string& path,
+    const World& world,
+    const std::vector<std::string>& sources,
+    bool packVertices
+)
+{
+    // Stamped first so sources changing while this runs make the cache stale
+    std::vector<SourceStamp> stamps;
+    for (const auto& source : sources)
+        stamps.push_back(stampSource(source));
+
+    std::vector<GeometryCache::Entry> entries;
+    for (const auto& mesh : world.meshes) {
+        for (const auto& primitive : mesh.primitives) {
+            GeometryCache::Entry entry;
+            entry.positions = primitive.positions.size();
+            entry.normals = primitive.normals.size();
+            entry.tangents = primitive.tangents.size();
+            entry.texCoord0s = primitive.texCoord0s.size();
+            entry.tris = primitive.tris.size();
+            entry.packedPositions = primitive.packed.positions.size();
+            entry.packedNormals = primitive.packed.normals.size();
+            entry.packedTangents = primitive.packed.tangents.size();
+            entry.packedTexCoord0s = primitive.packed.texCoord0s.size();
+            entry.joints = primitive.joints.size();
+            entry.weights = primitive.weights.size();
+            entry.min = primitive.min;
+            entry.max = primitive.max;
+            entries.push_back(entry);
+        }
+    }
+
+    // Written next to the cache and moved over it once complete so readers
+    // never see a partial file
+    const std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Failed to open " + tmpPath + " for writing");
+
+    // Header with the sources and entry table come first, data after
+    const uint32_t packed = packVertices;
+    file.write(MAGIC, sizeof(MAGIC));
+    writeValue(file, VERSION);
+    writeValue(file, packed);
+    writeValue(file, static_cast<uint64_t>(sources.size()));
+    for (size_t i = 0; i < sources.size(); ++i) {
+        writeValue(file, static_cast<uint64_t>(sources[i].size()));
+        file.write(sources[i].data(), sources[i].size());
+        writeValue(file, stamps[i]);
+    }
+
+    const uint64_t count = entries.size();
+    const size_t tableBegin = static_cast<size_t>(file.tellp()) + sizeof(count);
+    size_t offset = align(tableBegin + count * sizeof(GeometryCache::Entry));
+    for (auto& entry : entries) {
+        entry.offset = offset;
+        offset += entryBytes(entry);
+    }
+
+    writeValue(file, count);
+    file.write(reinterpret_cast<const char*>(entries.data()), count * sizeof(GeometryCache::Entry));
+    const size_t headerEnd = file.tellp();
+    const char padding[ALIGNMENT] = {};
+    file.write(padding, align(headerEnd) - headerEnd);
+
+    for (const auto& mesh : world.meshes) {
+        for (const auto& primitive : mesh.primitives) {
+            writeArray(file, primitive.positions);
+            writeArray(file, primitive.normals);
+            writeArray(file, primitive.tangents);
+            writeArray(file, primitive.texCoord0s);
+            writeArray(file, primitive.tris);
+            writeArray(file, primitive.packed.positions);
+            writeArray(file, primitive.packed.normals);
+            writeArray(file, primitive.packed.tangents);
+            writeArray(file, primitive.packed.texCoord0s);
+            writeArray(file, primitive.joints);
+            writeArray(file, primitive.weights);
+        }
+    }
+
+    file.close();
+    if (!file) {
+        std::remove(tmpPath.c_str());
+        throw std::runtime_error("Failed to write " + tmpPath);
+    }
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        throw std::runtime_error("Failed to move " + tmpPath + " to " + path);
+    }
+}
+
+GeometryCache::GeometryCache(const std::string& path, bool packVertices) :
+    _path(path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Failed to open " + path);
+
+    char magic[sizeof(MAGIC)];
+    uint32_t version = 0;
+    file.read(magic, sizeof(magic));
+    readValue(file, &version);
+    if (!file || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || version != VERSION)
+        throw std::runtime_error(path + " is not a geometry cache");
+
+    uint32_t packed = 0;
+    uint64_t sourceCount = 0;
+    readValue(file, &packed);
+    readValue(file, &sourceCount);
+    if (!file)
+        throw std::runtime_error("Truncated geometry cache " + path);
+    if (packed != static_cast<uint32_t>(packVertices))
+        throw std::runtime_error(path + " was written with other vertex packing");
+    for (uint64_t i = 0; i < sourceCount; ++i) {
+        uint64_t length = 0;
+        readValue(file, &length);
+        if (!file || length > MAX_PATH_LENGTH)
+            throw std::runtime_error("Truncated geometry cache " + path);
+        std::string source(length, '\0');
+        file.read(&source[0], source.size());
+        SourceStamp stamp;
+        readValue(file, &stamp);
+        if (!file)
+            throw std::runtime_error("Truncated geometry cache " + path);
+
+        // A missing source counts as changed
+        SourceStamp current;
+        try {
+            current = stampSource(source);
+        } catch (const std::runtime_error&) {
+            throw std::runtime_error(path + " is out of date, " + source + " is gone");
+        }
+        if (current.size != stamp.size || current.modified != stamp.modified)
+            throw std::runtime_error(path + " is out of date, " + source + " changed");
+    }
+
+    struct stat fileInfo;
+    if (stat(path.c_str(), &fileInfo) != 0)
+        throw std::runtime_error("Failed to stat " + path);
+    const uint64_t fileSize = fileInfo.st_size;
+
+    uint64_t count = 0;
+    readValue(file, &count);
+    if (!file || count > fileSize / sizeof(Entry))
+        throw std::runtime_error("Truncated geometry cache " + path);
+
+    _entries.resize(count);
+    file.read(reinterpret_cast<char*>(_entries.data()), count * sizeof(Entry));
+    if (!file)
+        throw std::runtime_error("Truncated geometry cache " + path);
+
+    // Data cut off by an interrupted write would only fail once streamed
+    for (const Entry& entry : _entries) {
+        if (entry.offset > fileSize || entryBytes(entry) > fileSize - entry.offset)
+            throw std::runtime_error(path + " is out of date, its data is cut off");
+    }
+
+#ifdef GEOMETRYCACHE_MMAP
+    const int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0) {
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            _mapping = static_cast<const uint8_t*>(mapping);
+            _mappingSize = info.st_size;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#endif // GEOMETRYCACHE_MMAP
+}
+
+GeometryCache::~GeometryCache()
+{
+#ifdef GEOMETRYCACHE_MMAP
+    if (_mapping != nullptr)
+        munmap(const_cast<uint8_t*>(_mapping), _mappingSize);
+#endif // GEOMETRYCACHE_MMAP
+}
+
+size_t GeometryCache::primitiveCount() const
+{
+    return _entries.size();
+}
+
+const GeometryCache::Entry& GeometryCache::entry(size_t primitive) const
+{
+    return _entries[primitive];
+}
+
+size_t GeometryCache::byteSize(size_t primitive) const
+{
+    const Entry& e = _entries[primitive];
+    return e.positions * sizeof(glm::vec3) +
+           e.normals * sizeof(glm::vec3) +
+           e.tangents * sizeof(glm::vec4) +
+           e.texCoord0s * sizeof(glm::vec2) +
+           e.tris * sizeof(TriIndices) +
+           e.packedPositions * sizeof(glm::u16vec3) +
+           e.packedNormals * sizeof(glm::i16vec2) +
+           e.packedTangents * sizeof(glm::i16vec2) +
+           e.packedTexCoord0s * sizeof(glm::u16vec2) +
+           e.joints * sizeof(glm::u16vec4) +
+           e.weights * sizeof(glm::vec4);
+}
+
+void GeometryCache::read(size_t primitive, Primitive* out) const
+{
+    const Entry& e = _entries[primitive];
+    const size_t bytes = entryBytes(e);
+
+    // Fall back to plain reads if mapping failed or isn't supported
+    std::vector<uint8_t> buffer;
+    const uint8_t* data = nullptr;
+    if (_mapping != nullptr) {
+        if (e.offset + bytes > _mappingSize)
+            throw std::runtime_error("Truncated geometry cache " + _path);
+        data = _mapping + e.offset;
+    } else {
+        std::ifstream file(_path, std::ios::binary);
+        file.seekg(e.offset);
+        buffer.resize(bytes);
+        file.read(reinterpret_cast<char*>(buffer.data()), bytes);
+        if (!file)
+            throw std::runtime_error("Truncated geometry cache " + _path);
+        data = buffer.data();
+    }
+
+    const uint8_t* next = data;
+    next = readArray(next, e.positions, &out->positions);
+    next = readArray(next, e.normals, &out->normals);
+    next = readArray(next, e.tangents, &out->tangents);
+    next = readArray(next, e.texCoord0s, &out->texCoord0s);
+    next = readArray(next, e.tris, &out->tris);
+    next = readArray(next, e.packedPositions, &out->packed.positions);
+    next = readArray(next, e.packedNormals, &out->packed.normals);
+    next = readArray(next, e.packedTangents, &out->packed.tangents);
+    next = readArray(next, e.packedTexCoord0s, &out->packed.texCoord0s);
+    next = readArray(next, e.joints, &out->joints);
+    next = readArray(next, e.weights, &out->weights);
+    out->min = e.min;
+    out->max = e.max;
+
+#ifdef GEOMETRYCACHE_MMAP
+    // The copy is what counts against the budget, let the kernel drop the
+    // mapped pages
+    if (_mapping != nullptr) {
+        const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~(pageSize - 1);
+        const uintptr_t end = reinterpret_cast<uintptr_t>(data) + bytes;
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+    }
+#endif // GEOMETRYCACHE_MMAP
+}
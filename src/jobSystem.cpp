@@ -0,0 +1,284 @@
+#include "jobSystem.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif // __linux__
+
+namespace {
+    // Which system and worker slot the current thread belongs to
+    thread_local const JobSystem* tlsSystem = nullptr;
+    thread_local uint32_t tlsIndex = 0;
+
+    // Affinity is only supported on linux for now
+    void pinCurrentThread(uint32_t core)
+    {
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core % std::max(std::thread::hardware_concurrency(), 1u), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+#else
+        (void) core;
+#endif // __linux__
+    }
+}
+
+void JobSystem::Worker::pushBack(Job job)
+{
+    if (count == ring.size()) {
+        // Unroll into a bigger buffer
+        std::vector<Job> grown(std::max(ring.size() * 2, size_t(64)));
+        for (size_t i = 0; i < count; ++i)
+            grown[i] = std::move(ring[(head + i) % ring.size()]);
+        ring.swap(grown);
+        head = 0;
+    }
+
+    ring[(head + count) % ring.size()] = std::move(job);
+    count++;
+}
+
+JobSystem::Job JobSystem::Worker::popBack()
+{
+    count--;
+    return std::move(ring[(head + count) % ring.size()]);
+}
+
+JobSystem::Job JobSystem::Worker::popFront()
+{
+    Job job = std::move(ring[head]);
+    head = (head + 1) % ring.size();
+    count--;
+    return job;
+}
+
+bool JobSystem::Counter::done() const
+{
+    if (_pending > 0)
+        return false;
+
+    // The last job releases the lock only after it's done touching the
+    // counter so the owner can safely destroy it after this
+    std::lock_guard<std::mutex> lock(_mutex);
+    return true;
+}
+
+JobSystem::JobSystem(uint32_t threadCount, bool pinThreads, uint32_t firstCore)
+{
+    if (threadCount == 0)
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for (uint32_t i = 0; i < threadCount; ++i)
+        _workers.emplace_back(std::make_unique<Worker>());
+
+    // Creating thread is worker 0
+    tlsSystem = this;
+    tlsIndex = 0;
+    if (pinThreads)
+        pinCurrentThread(firstCore);
+
+    for (uint32_t i = 1; i < threadCount; ++i) {
+        _threads.emplace_back([this, i, pinThreads, firstCore]{
+            if (pinThreads)
+                pinCurrentThread(firstCore + i);
+            work(i);
+        });
+    }
+}
+
+JobSystem::~JobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(_sleepMutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& thread : _threads)
+        thread.join();
+
+    if (tlsSystem == this)
+        tlsSystem = nullptr;
+}
+
+uint32_t JobSystem::threadCount() const
+{
+    return _workers.size();
+}
+
+uint32_t JobSystem::threadIndex() const
+{
+    if (tlsSystem == this)
+        return tlsIndex;
+
+    std::thread::id owner;
+    const std::thread::id self = std::this_thread::get_id();
+    if (!_foreignOwner.compare_exchange_strong(owner, self))
+        assert(owner == self && "Two outside threads share the last slot");
+    (void) owner;
+    return threadCount();
+}
+
+void JobSystem::run(std::function<void()> fn, Counter* counter)
+{
+    if (counter != nullptr)
+        counter->_pending++;
+
+    Job job;
+    job.fn = std::move(fn);
+    job.counter = counter;
+    push(std::move(job));
+}
+
+void JobSystem::runAfter(Counter* dependency, std::function<void()> fn, Counter* counter)
+{
+    if (counter != nullptr)
+        counter->_pending++;
+
+    Job job;
+    job.fn = std::move(fn);
+    job.counter = counter;
+    {
+        // Pending only hits zero under the lock so either we see zero here or
+        // the last job sees the new dependent
+        std::lock_guard<std::mutex> lock(dependency->_mutex);
+        if (dependency->_pending > 0) {
+            dependency->_dependents.push_back(std::move(job));
+            return;
+        }
+    }
+    push(std::move(job));
+}
+
+void JobSystem::wait(Counter* counter, Priority priority)
+{
+    while (!counter->done()) {
+        Job job;
+        const bool popped = priority == Priority::Background ?
+            tryPopBackground(&job) : tryPop(&job);
+        if (popped)
+            execute(&job);
+        else
+            std::this_thread::yield();
+    }
+}
+
+void JobSystem::parallelFor(size_t begin, size_t end, size_t grain, RangeFn range, const void* context, Priority priority)
+{
+    if (begin >= end)
+        return;
+    grain = std::max(grain, size_t(1));
+
+    // Run the first range on this thread instead of queueing it
+    Counter counter;
+    for (size_t b = begin + grain; b < end; b += grain) {
+        Job job;
+        job.range = range;
+        job.context = context;
+        job.begin = b;
+        job.end = std::min(b + grain, end);
+        job.counter = &counter;
+        counter._pending++;
+        push(std::move(job), priority);
+    }
+    range(context, begin, std::min(begin + grain, end));
+    wait(&counter, priority);
+}
+
+void JobSystem::push(Job job, Priority priority)
+{
+    // Threads outside the system spread their jobs around
+    const uint32_t index = tlsSystem == this ?
+        tlsIndex : _nextForeign++ % _workers.size();
+    _queued++;
+    {
+        Worker& worker = priority == Priority::Background ? _background : *_workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.pushBack(std::move(job));
+    }
+
+    // Taking the lock makes sure a worker can't miss the wake between
+    // checking the queue and going to sleep
+    { std::lock_guard<std::mutex> lock(_sleepMutex); }
+    _wake.notify_one();
+}
+
+bool JobSystem::tryPop(Job* job)
+{
+    const uint32_t self = tlsSystem == this ? tlsIndex : 0;
+    const uint32_t count = _workers.size();
+
+    // Newest own job is likely to still be in cache
+    {
+        Worker& worker = *_workers[self];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.count > 0) {
+            *job = worker.popBack();
+            _queued--;
+            return true;
+        }
+    }
+
+    for (uint32_t i = 1; i < count; ++i) {
+        Worker& victim = *_workers[(self + i) % count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.count > 0) {
+            *job = victim.popFront();
+            _queued--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool JobSystem::tryPopBackground(Job* job)
+{
+    std::lock_guard<std::mutex> lock(_background.mutex);
+    if (_background.count == 0)
+        return false;
+    *job = _background.popFront();
+    _queued--;
+    return true;
+}
+
+void JobSystem::execute(Job* job)
+{
+    if (job->range != nullptr)
+        job->range(job->context, job->begin, job->end);
+    else
+        job->fn();
+
+    Counter* counter = job->counter;
+    if (counter == nullptr)
+        return;
+
+    std::vector<Job> dependents;
+    {
+        std::lock_guard<std::mutex> lock(counter->_mutex);
+        if (--counter->_pending == 0)
+            dependents.swap(counter->_dependents);
+    }
+    for (auto& dependent : dependents)
+        push(std::move(dependent));
+}
+
+void JobSystem::work(uint32_t index)
+{
+    tlsSystem = this;
+    tlsIndex = index;
+
+    while (!_stop) {
+        Job job;
+        if (tryPop(&job) || tryPopBackground(&job)) {
+            execute(&job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(_sleepMutex);
+        _wake.wait(lock, [&]{ return _stop || _queued > 0; });
+    }
+}
@@ -0,0 +1,228 @@
+#include "lineBatch.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <utility>
+
+namespace {
+    // Colors of hierarchy levels, cycled through by depth
+    const std::array<Color, 4> LEVEL_COLORS = {
+        Color(255, 255, 0),
+        Color(0, 255, 255),
+        Color(255, 0, 255),
+        Color(0, 255, 0)
+    };
+
+    // Grows [min, max] by the box [boxMin, boxMax] after transform
+    void growBounds(const glm::vec3& boxMin, const glm::vec3& boxMax, const glm::mat4& transform, glm::vec3* min, glm::vec3* max)
+    {
+        for (uint32_t i = 0; i < 8; ++i) {
+            const glm::vec3 corner(
+                i & 1 ? boxMax.x : boxMin.x,
+                i & 2 ? boxMax.y : boxMin.y,
+                i & 4 ? boxMax.z : boxMin.z
+            );
+            const glm::vec3 p(transform * glm::vec4(corner, 1.f));
+            *min = glm::min(*min, p);
+            *max = glm::max(*max, p);
+        }
+    }
+}
+
+void LineBatch::reset()
+{
+    _lines.clear();
+    _wireframes.clear();
+    _wireframeLines = 0;
+}
+
+void LineBatch::clearEdges()
+{
+    _edges.clear();
+}
+
+void LineBatch::setState(const LineState& state)
+{
+    _state = state;
+}
+
+void LineBatch::addLine(const glm::vec3& p0, const glm::vec3& p1, const Color& color)
+{
+    _lines.push_back({p0, p1, color, _state});
+}
+
+void LineBatch::addBox(const glm::vec3& min, const glm::vec3& max, const glm::mat4& modelToWorld, const Color& color)
+{
+    std::array<glm::vec3, 8> corners;
+    for (uint32_t i = 0; i < 8; ++i) {
+        const glm::vec3 corner(
+            i & 1 ? max.x : min.x,
+            i & 2 ? max.y : min.y,
+            i & 4 ? max.z : min.z
+        );
+        corners[i] = glm::vec3(modelToWorld * glm::vec4(corner, 1.f));
+    }
+    // Corners that differ in one bit share an edge
+    for (uint32_t i = 0; i < 8; ++i) {
+        for (uint32_t bit = 1; bit < 8; bit <<= 1) {
+            if (!(i & bit))
+                addLine(corners[i], corners[i | bit], color);
+        }
+    }
+}
+
+void LineBatch::addWireframe(const Primitive& primitive, const glm::mat4& modelToWorld, const Color& color, bool cullBackFaces, const SkinnedVertices* skinned)
+{
+    // Evicted geometry has nothing to draw, skinning that doesn't match the
+    // primitive is left out like in the renderer
+    const size_t vertices = vertexCount(primitive);
+    if (vertices == 0 || (skinned != nullptr && skinned->positions.size() != vertices))
+        return;
+
+    const Edges& primitiveEdges = edges(primitive);
+    _wireframes.push_back({&primitive, skinned, modelToWorld, &primitiveEdges, color, _state, cullBackFaces});
+    _wireframeLines += primitiveEdges.vertices.size();
+}
+
+void LineBatch::addWireframes(const CommandList& commands, const Color& color)
+{
+    const auto& transforms = commands.transforms();
+    for (const auto& draw : commands.draws()) {
+        for (size_t t = draw.transform; t < draw.transform + draw.instanceCount; ++t)
+            addWireframe(*draw.primitive, transforms[t], color, draw.state.cullBackFaces, draw.skinned);
+    }
+}
+
+void LineBatch::addBounds(const CommandList& commands, const Color& color)
+{
+    const auto& transforms = commands.transforms();
+    for (const auto& draw : commands.draws()) {
+        // Skinned draws have world space bounds of their own
+        const glm::vec3& min = draw.skinned != nullptr ? draw.skinned->min : draw.primitive->min;
+        const glm::vec3& max = draw.skinned != nullptr ? draw.skinned->max : draw.primitive->max;
+        for (size_t t = draw.transform; t < draw.transform + draw.instanceCount; ++t)
+            addBox(min, max, transforms[t], color);
+    }
+}
+
+void LineBatch::addHierarchy(const World& world, const Animator* animator)
+{
+    // Nothing loaded yet
+    if (world.scenes.empty())
+        return;
+
+    for (const Scene::Node* node : world.scenes[world.currentScene].nodes) {
+        glm::vec3 min(std::numeric_limits<float>::max());
+        glm::vec3 max(std::numeric_limits<float>::lowest());
+        addSubtree(world, animator, node, glm::mat4(1.f), 0, &min, &max);
+    }
+}
+
+const std::vector<LineBatch::Line>& LineBatch::lines() const
+{
+    return _lines;
+}
+
+const std::vector<LineBatch::Wireframe>& LineBatch::wireframes() const
+{
+    return _wireframes;
+}
+
+size_t LineBatch::wireframeLineCount() const
+{
+    return _wireframeLines;
+}
+
+MemoryUsage LineBatch::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.add(_lines);
+    usage.add(_wireframes);
+    for (const auto& entry : _edges) {
+        usage.add(entry.second.edges.vertices);
+        usage.add(entry.second.edges.faces);
+    }
+    return usage;
+}
+
+const LineBatch::Edges& LineBatch::edges(const Primitive& primitive)
+{
+    CachedEdges& cached = _edges[&primitive];
+    const size_t vertices = vertexCount(primitive);
+    if (cached.tris == primitive.tris.data() && cached.triCount == primitive.tris.size() &&
+        cached.vertexCount == vertices)
+        return cached.edges;
+
+    // Edges as sorted index pairs next to their triangle, sorting puts the
+    // shared ones next to each other
+    std::vector<std::pair<uint64_t, uint32_t>> keys;
+    keys.reserve(primitive.tris.size() * 3);
+    const auto addEdge = [&](size_t a, size_t b, size_t tri){
+        if (a > b)
+            std::swap(a, b);
+        keys.emplace_back(uint64_t(a) << 32 | uint64_t(b), uint32_t(tri));
+    };
+    for (size_t t = 0; t < primitive.tris.size(); ++t) {
+        const TriIndices& tri = primitive.tris[t];
+        addEdge(tri.v0, tri.v1, t);
+        addEdge(tri.v1, tri.v2, t);
+        addEdge(tri.v2, tri.v0, t);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    cached.tris = primitive.tris.data();
+    cached.triCount = primitive.tris.size();
+    cached.vertexCount = vertices;
+    Edges& edges = cached.edges;
+    edges.vertices.clear();
+    edges.faces.clear();
+    for (size_t first = 0, last = 0; first < keys.size(); first = last) {
+        while (last < keys.size() && keys[last].first == keys[first].first)
+            last++;
+        const uint64_t key = keys[first].first;
+        edges.vertices.emplace_back(uint32_t(key >> 32), uint32_t(key));
+        if (last - first > 2)
+            edges.faces.emplace_back(SHARED_FACES, SHARED_FACES);
+        else
+            edges.faces.emplace_back(keys[first].second, keys[last - 1].second);
+    }
+    edges.vertices.shrink_to_fit();
+    edges.faces.shrink_to_fit();
+    return edges;
+}
+
+void LineBatch::addSubtree(const World& world, const Animator* animator, const Scene::Node* node, const glm::mat4& parentToWorld, size_t depth, glm::vec3* min, glm::vec3* max)
+{
+    const glm::mat4 nodeToWorld = animator != nullptr ?
+        animator->nodeToWorld()[node - world.nodes.data()] :
+        parentToWorld *
+        glm::translate(glm::mat4(1.f), node->translation) *
+        glm::mat4_cast(node->rotation) *
+        glm::scale(glm::mat4(1.f), node->scale);
+
+    glm::vec3 subtreeMin(std::numeric_limits<float>::max());
+    glm::vec3 subtreeMax(std::numeric_limits<float>::lowest());
+    if (node->mesh != nullptr) {
+        const Mesh& mesh = *node->mesh;
+        for (size_t p = 0; p < mesh.primitives.size(); ++p) {
+            const SkinnedVertices* skinned =
+                node->skin != nullptr && animator != nullptr ? animator->skinned(node, p) : nullptr;
+            if (skinned != nullptr)
+                growBounds(skinned->min, skinned->max, glm::mat4(1.f), &subtreeMin, &subtreeMax);
+            else
+                growBounds(mesh.primitives[p].min, mesh.primitives[p].max, nodeToWorld, &subtreeMin, &subtreeMax);
+        }
+    }
+    for (const Scene::Node* child : node->children)
+        addSubtree(world, animator, child, nodeToWorld, depth + 1, &subtreeMin, &subtreeMax);
+
+    // Empty subtrees have no bounds
+    if (subtreeMin.x > subtreeMax.x)
+        return;
+
+    addBox(subtreeMin, subtreeMax, glm::mat4(1.f), LEVEL_COLORS[depth % LEVEL_COLORS.size()]);
+    *min = glm::min(*min, subtreeMin);
+    *max = glm::max(*max, subtreeMax);
+}
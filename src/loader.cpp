@@ -2,9 +2,14 @@
 
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/matrix_decompose.hpp>
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <limits>
 #include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <stb_image.h>
 #include <tiny_gltf.h>
 
 namespace {
@@ -15,32 +20,372 @@ namespace {
         throw std::runtime_error(std::string(err));
     }
 
-    std::vector<Texture> loadTextures(const tinygltf::Model& gltfModel)
+    float readComponent(const uint8_t* data, int componentType, bool normalized)
+    {
+        const auto read = [&](auto value){
+            std::memcpy(&value, data, sizeof(value));
+            return value;
+        };
+        switch (componentType) {
+        case TINYGLTF_COMPONENT_TYPE_BYTE: {
+            const float value = read(int8_t());
+            return normalized ? std::max(value / 127.f, -1.f) : value;
+        }
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE: {
+            const float value = read(uint8_t());
+            return normalized ? value / 255.f : value;
+        }
+        case TINYGLTF_COMPONENT_TYPE_SHORT: {
+            const float value = read(int16_t());
+            return normalized ? std::max(value / 32767.f, -1.f) : value;
+        }
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
+            const float value = read(uint16_t());
+            return normalized ? value / 65535.f : value;
+        }
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+            return static_cast<float>(read(uint32_t()));
+        case TINYGLTF_COMPONENT_TYPE_FLOAT:
+            return read(float());
+        default:
+            throw std::runtime_error("Unsupported accessor component type");
+        }
+    }
+
+    size_t componentBytes(int componentType)
+    {
+        switch (componentType) {
+        case TINYGLTF_COMPONENT_TYPE_BYTE:
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+            return 1;
+        case TINYGLTF_COMPONENT_TYPE_SHORT:
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+            return 2;
+        default:
+            return 4;
+        }
+    }
+
+    // Any component type as floats, normalized integers map to [0, 1] or
+    // [-1, 1] like the spec says
+    std::vector<float> readFloats(const tinygltf::Model& gltfModel, int accessorIndex, size_t components)
+    {
+        const auto& accessor = gltfModel.accessors[accessorIndex];
+        const auto& view = gltfModel.bufferViews[accessor.bufferView];
+        const uint8_t* data =
+            gltfModel.buffers[view.buffer].data.data() + view.byteOffset + accessor.byteOffset;
+
+        const size_t bytes = componentBytes(accessor.componentType);
+        const size_t stride = view.byteStride != 0 ? view.byteStride : components * bytes;
+        std::vector<float> values(accessor.count * components);
+        for (size_t i = 0; i < accessor.count; ++i) {
+            for (size_t c = 0; c < components; ++c) {
+                values[i * components + c] = readComponent(
+                    &data[i * stride + c * bytes], accessor.componentType, accessor.normalized
+                );
+            }
+        }
+        return values;
+    }
+
+    size_t combineHash(size_t seed, size_t hash)
+    {
+        return seed ^ (hash + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+    }
+
+    // Bytes an accessor reads, including whatever is interleaved with them
+    std::string_view accessorBytes(const tinygltf::Model& gltfModel, int accessorIndex)
+    {
+        const auto& accessor = gltfModel.accessors[accessorIndex];
+        if (accessor.bufferView < 0 || accessor.count == 0)
+            return std::string_view();
+
+        const auto& view = gltfModel.bufferViews[accessor.bufferView];
+        const size_t elementBytes =
+            componentBytes(accessor.componentType) * tinygltf::GetNumComponentsInType(accessor.type);
+        const size_t stride = view.byteStride != 0 ? view.byteStride : elementBytes;
+        const auto* data = reinterpret_cast<const char*>(gltfModel.buffers[view.buffer].data.data());
+        return std::string_view(
+            data + view.byteOffset + accessor.byteOffset,
+            (accessor.count - 1) * stride + elementBytes
+        );
+    }
+
+    bool sameAccessors(const tinygltf::Model& gltfModel, int a, int b)
+    {
+        if (a == b)
+            return true;
+        if (a < 0 || b < 0)
+            return false;
+
+        const auto& accessorA = gltfModel.accessors[a];
+        const auto& accessorB = gltfModel.accessors[b];
+        // Sparse values would need to be applied first
+        if (accessorA.sparse.isSparse || accessorB.sparse.isSparse)
+            return false;
+        if (accessorA.componentType != accessorB.componentType ||
+            accessorA.type != accessorB.type ||
+            accessorA.normalized != accessorB.normalized ||
+            accessorA.count != accessorB.count ||
+            accessorA.bufferView < 0 || accessorB.bufferView < 0)
+            return false;
+        if (gltfModel.bufferViews[accessorA.bufferView].byteStride !=
+            gltfModel.bufferViews[accessorB.bufferView].byteStride)
+            return false;
+
+        return accessorBytes(gltfModel, a) == accessorBytes(gltfModel, b);
+    }
+
+    bool sameMeshes(const tinygltf::Model& gltfModel, const tinygltf::Mesh& a, const tinygltf::Mesh& b)
+    {
+        if (a.primitives.size() != b.primitives.size())
+            return false;
+
+        for (size_t p = 0; p < a.primitives.size(); ++p) {
+            const auto& primitiveA = a.primitives[p];
+            const auto& primitiveB = b.primitives[p];
+            if (primitiveA.material != primitiveB.material ||
+                primitiveA.mode != primitiveB.mode ||
+                primitiveA.attributes.size() != primitiveB.attributes.size() ||
+                !sameAccessors(gltfModel, primitiveA.indices, primitiveB.indices))
+                return false;
+
+            for (const auto& [name, accessor] : primitiveA.attributes) {
+                const auto& attribute = primitiveB.attributes.find(name);
+                if (attribute == primitiveB.attributes.end() ||
+                    !sameAccessors(gltfModel, accessor, attribute->second))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // Exporters tend to write a copy of a mesh or an image for every place it
+    // is used, those are loaded once and shared
+    struct Sharing {
+        // Shared texture of each glTF texture and the glTF image of each
+        // shared texture
+        std::vector<size_t> textures;
+        std::vector<size_t> images;
+        // Shared mesh of each glTF mesh and the glTF mesh of each shared mesh
+        std::vector<size_t> meshes;
+        std::vector<size_t> meshSources;
+    };
+
+    // Textures share if their images are the same or encoded the same, meshes
+    // if their primitives read identical data with the same materials
+    // Images are compared encoded so this goes before decodeImages
+    Sharing findSharing(const tinygltf::Model& gltfModel)
+    {
+        Sharing sharing;
+
+        std::vector<size_t> imageTextures(gltfModel.images.size(), SIZE_MAX);
+        std::unordered_map<size_t, std::vector<size_t>> imagesByHash;
+        for (const auto& gltfTexture : gltfModel.textures) {
+            const size_t source = gltfTexture.source;
+            if (imageTextures[source] == SIZE_MAX) {
+                const auto& bytes = gltfModel.images[source].image;
+                const std::string_view encoded(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+                auto& candidates = imagesByHash[std::hash<std::string_view>()(encoded)];
+                for (const size_t texture : candidates) {
+                    if (gltfModel.images[sharing.images[texture]].image == bytes) {
+                        imageTextures[source] = texture;
+                        break;
+                    }
+                }
+                if (imageTextures[source] == SIZE_MAX) {
+                    imageTextures[source] = sharing.images.size();
+                    candidates.push_back(sharing.images.size());
+                    sharing.images.push_back(source);
+                }
+            }
+            sharing.textures.push_back(imageTextures[source]);
+        }
+
+        // Accessors are usually read by a single primitive, hashes are kept
+        // for the ones that aren't
+        std::vector<size_t> accessorHashes(gltfModel.accessors.size());
+        std::vector<char> hashed(gltfModel.accessors.size(), false);
+        const auto accessorHash = [&](int accessor){
+            if (accessor < 0)
+                return size_t(0);
+            if (!hashed[accessor]) {
+                accessorHashes[accessor] = std::hash<std::string_view>()(accessorBytes(gltfModel, accessor));
+                hashed[accessor] = true;
+            }
+            return accessorHashes[accessor];
+        };
+
+        std::unordered_map<size_t, std::vector<size_t>> meshesByHash;
+        for (size_t m = 0; m < gltfModel.meshes.size(); ++m) {
+            const auto& gltfMesh = gltfModel.meshes[m];
+            size_t hash = gltfMesh.primitives.size();
+            for (const auto& gltfPrimitive : gltfMesh.primitives) {
+                hash = combineHash(hash, std::hash<int>()(gltfPrimitive.material));
+                for (const auto& [name, accessor] : gltfPrimitive.attributes) {
+                    hash = combineHash(hash, std::hash<std::string>()(name));
+                    hash = combineHash(hash, accessorHash(accessor));
+                }
+                hash = combineHash(hash, accessorHash(gltfPrimitive.indices));
+            }
+
+            auto& candidates = meshesByHash[hash];
+            size_t shared = SIZE_MAX;
+            for (const size_t mesh : candidates) {
+                if (sameMeshes(gltfModel, gltfModel.meshes[sharing.meshSources[mesh]], gltfMesh)) {
+                    shared = mesh;
+                    break;
+                }
+            }
+            if (shared == SIZE_MAX) {
+                shared = sharing.meshSources.size();
+                candidates.push_back(shared);
+                sharing.meshSources.push_back(m);
+            }
+            sharing.meshes.push_back(shared);
+        }
+
+        return sharing;
+    }
+
+    // Keeps the encoded bytes so that images can be decoded in parallel later
+    bool deferImageDecode(
+        tinygltf::Image* image, const int imageIndex, std::string* err,
+        std::string* warn, int reqWidth, int reqHeight,
+        const unsigned char* bytes, int size, void* userData)
+    {
+        (void) imageIndex;
+        (void) err;
+        (void) warn;
+        (void) reqWidth;
+        (void) reqHeight;
+        (void) userData;
+
+        image->image.assign(bytes, bytes + size);
+        return true;
+    }
+
+    // Images are left encoded, see decodeImages
+    tinygltf::Model parseGLTF(const std::string& path)
+    {
+        tinygltf::Model model;
+        tinygltf::TinyGLTF loader;
+        loader.SetImageLoader(deferImageDecode, nullptr);
+        std::string warn;
+        std::string err;
+
+        const bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, path);
+        if (!warn.empty())
+            throw std::runtime_error(warn);
+        if (!err.empty())
+            throw std::runtime_error(err);
+        if (!ret)
+            throw std::runtime_error("Parsing glTF failed");
+
+        return model;
+    }
+
+    // Decodes the given images, the rest are left as they are
+    void decodeImages(
+        tinygltf::Model* gltfModel,
+        const std::vector<size_t>& images,
+        JobSystem* jobs,
+        JobSystem::Priority priority = JobSystem::Priority::Normal)
+    {
+        // Jobs can't throw so failures are reported once all are done
+        std::vector<char> failed(images.size(), false);
+        jobs->parallelFor(0, images.size(), 1, [&](size_t begin, size_t end){
+            for (size_t i = begin; i < end; ++i) {
+                auto& image = gltfModel->images[images[i]];
+
+                // Match what tinygltf does by default
+                int w, h, comp;
+                const int reqComp = 4;
+                uint8_t* data = stbi_load_from_memory(
+                    image.image.data(),
+                    image.image.size(),
+                    &w, &h, &comp,
+                    reqComp
+                );
+                if (data == nullptr) {
+                    failed[i] = true;
+                    continue;
+                }
+
+                image.width = w;
+                image.height = h;
+                image.component = reqComp;
+                image.bits = 8;
+                image.image.assign(data, data + w * h * reqComp);
+                stbi_image_free(data);
+            }
+        }, priority);
+
+        for (size_t i = 0; i < failed.size(); ++i) {
+            if (failed[i])
+                throw std::runtime_error("Failed to decode image " + gltfModel->images[images[i]].uri);
+        }
+    }
+
+    // One texture per shared image, see Sharing, images that aren't kept
+    // leave theirs empty
+    std::vector<Texture> loadTextures(const tinygltf::Model& gltfModel, const std::vector<size_t>& images, const std::vector<char>& keep)
     {
         std::vector<Texture> textures;
-        for (const auto& gltfTexture : gltfModel.textures)
-            textures.emplace_back(gltfModel.images[gltfTexture.source]);
+        for (size_t i = 0; i < images.size(); ++i)
+            textures.push_back(keep[i] ? Texture(gltfModel.images[images[i]]) : Texture());
+        return textures;
+    }
+
+    // glTF textures a material samples
+    std::vector<int> materialTextures(const tinygltf::Material& gltfMaterial)
+    {
+        std::vector<int> textures;
+        for (const char* name : {"baseColorTexture", "metallicRoughnessTexture"}) {
+            if (const auto& elem = gltfMaterial.values.find(name); elem != gltfMaterial.values.end())
+                textures.push_back(elem->second.TextureIndex());
+        }
+        if (const auto& elem = gltfMaterial.additionalValues.find("normalTexture");
+            elem != gltfMaterial.additionalValues.end())
+            textures.push_back(elem->second.TextureIndex());
         return textures;
     }
 
-    std::vector<Material> loadMaterials(const tinygltf::Model& gltfModel, const std::vector<Texture>& textures)
+    // Triangles each glTF node draws, read from the index accessors
+    std::vector<size_t> nodeTriangles(const tinygltf::Model& gltfModel)
+    {
+        std::vector<size_t> triangles(gltfModel.nodes.size(), 0);
+        for (size_t n = 0; n < gltfModel.nodes.size(); ++n) {
+            const int mesh = gltfModel.nodes[n].mesh;
+            if (mesh < 0)
+                continue;
+            for (const auto& gltfPrimitive : gltfModel.meshes[mesh].primitives) {
+                if (gltfPrimitive.indices > -1)
+                    triangles[n] += gltfModel.accessors[gltfPrimitive.indices].count / 3;
+            }
+        }
+        return triangles;
+    }
+
+    // Texture indices map glTF textures to the shared ones
+    std::vector<Material> loadMaterials(const tinygltf::Model& gltfModel, const std::vector<Texture>& textures, const std::vector<size_t>& textureIndices)
     {
         std::vector<Material> materials;
         for (const auto& gltfMaterial : gltfModel.materials) {
             Material material;
             if (const auto& elem = gltfMaterial.values.find("baseColorTexture");
                 elem != gltfMaterial.values.end()) {
-                material.baseColor = &textures[elem->second.TextureIndex()];
+                material.baseColor = &textures[textureIndices[elem->second.TextureIndex()]];
                 assert(elem->second.TextureTexCoord() == 0);
             }
             if (const auto& elem = gltfMaterial.values.find("metallicRoughnessTexture");
                 elem != gltfMaterial.values.end()) {
-                material.metallicRoughness = &textures[elem->second.TextureIndex()];
+                material.metallicRoughness = &textures[textureIndices[elem->second.TextureIndex()]];
                 assert(elem->second.TextureTexCoord() == 0);
             }
             if (const auto& elem = gltfMaterial.additionalValues.find("normalTexture");
                 elem != gltfMaterial.additionalValues.end()) {
-                material.normal = &textures[elem->second.TextureIndex()];
+                material.normal = &textures[textureIndices[elem->second.TextureIndex()]];
                 assert(elem->second.TextureTexCoord() == 0);
             }
             if (const auto& elem = gltfMaterial.values.find("baseColorFactor");
@@ -55,168 +400,317 @@ namespace {
                 elem != gltfMaterial.values.end()) {
                 material.roughnessFactor = elem->second.Factor();
             }
+            if (const auto& elem = gltfMaterial.additionalValues.find("alphaMode");
+                elem != gltfMaterial.additionalValues.end()) {
+                material.blend = elem->second.string_value == "BLEND";
+            }
             materials.push_back(std::move(material));
         }
         return materials;
     }
 
-    std::vector<Mesh> loadMeshes(const tinygltf::Model& gltfModel, const std::vector<Material>& materials)
+    Mesh loadMesh(const tinygltf::Model& gltfModel, const tinygltf::Mesh& gltfMesh, const std::vector<Material>& materials, bool pack)
     {
-        std::vector<Mesh> meshes;
-        for (const auto& gltfMesh : gltfModel.meshes) {
-            Mesh mesh;
-            for (const auto& gltfPrimitive : gltfMesh.primitives) {
-                // TODO: Support modes other than triangle
-                assert(gltfPrimitive.mode == -1 || gltfPrimitive.mode == 4);
+        Mesh mesh;
+        for (const auto& gltfPrimitive : gltfMesh.primitives) {
+            // TODO: Support modes other than triangle
+            assert(gltfPrimitive.mode == -1 || gltfPrimitive.mode == 4);
 
-                Primitive primitive;
-                // TODO: These are also in the position accessor
-                primitive.min = glm::vec3(std::numeric_limits<float>::max());
-                primitive.max = glm::vec3(std::numeric_limits<float>::min());
-                primitive.positions = [&]{
-                    const auto& attribute = gltfPrimitive.attributes.find("POSITION");
-                    // All primitives should have position data
-                    assert(attribute != gltfPrimitive.attributes.end());
-
-                    const auto& accessor = gltfModel.accessors[attribute->second];
-                    const auto& view = gltfModel.bufferViews[accessor.bufferView];
-                    const uint8_t* data = gltfModel.buffers[view.buffer].data.data();
-
-                    const size_t start = accessor.byteOffset + view.byteOffset;
-                    const size_t dataSize = accessor.count * 3;
-
-                    std::vector<glm::vec3> positions;
-                    for (size_t i = 0; i < dataSize - 2; i += 3) {
-                        positions.emplace_back(glm::make_vec3(
-                            &reinterpret_cast<const float*>(&data[start])[i]
-                        ));
-                        primitive.min = glm::min(primitive.min, positions.back());
-                        primitive.max = glm::max(primitive.max, positions.back());
-                    }
+            Primitive primitive;
+            // TODO: These are also in the position accessor
+            primitive.min = glm::vec3(std::numeric_limits<float>::max());
+            primitive.max = glm::vec3(std::numeric_limits<float>::min());
+            primitive.positions = [&]{
+                const auto& attribute = gltfPrimitive.attributes.find("POSITION");
+                // All primitives should have position data
+                assert(attribute != gltfPrimitive.attributes.end());
 
-                    return positions;
-                }();
-                primitive.normals = [&]{
-                    const auto& attribute = gltfPrimitive.attributes.find("NORMAL");
-                    // We might not have normals
-                    if (attribute == gltfPrimitive.attributes.end())
-                        return std::vector<glm::vec3>();
-
-                    const auto& accessor = gltfModel.accessors[attribute->second];
-                    const auto& view = gltfModel.bufferViews[accessor.bufferView];
-                    const uint8_t* data = gltfModel.buffers[view.buffer].data.data();
-
-                    const size_t start = accessor.byteOffset + view.byteOffset;
-                    const size_t dataSize = accessor.count * 3;
-
-                    // Normals should already be normalized
-                    std::vector<glm::vec3> normals;
-                    for (size_t i = 0; i < dataSize - 2; i += 3) {
-                        normals.emplace_back(glm::make_vec3(
-                            &reinterpret_cast<const float*>(&data[start])[i]
-                        ));
-                    }
+                const auto& accessor = gltfModel.accessors[attribute->second];
+                const auto& view = gltfModel.bufferViews[accessor.bufferView];
+                const uint8_t* data = gltfModel.buffers[view.buffer].data.data();
 
-                    return normals;
-                }();
-                primitive.tangents = [&]{
-                    const auto& attribute = gltfPrimitive.attributes.find("TANGENT");
-                    // We might not have tangents
-                    if (attribute == gltfPrimitive.attributes.end())
-                        return std::vector<glm::vec4>();
-
-                    const auto& accessor = gltfModel.accessors[attribute->second];
-                    const auto& view = gltfModel.bufferViews[accessor.bufferView];
-                    const uint8_t* data = gltfModel.buffers[view.buffer].data.data();
-
-                    const size_t start = accessor.byteOffset + view.byteOffset;
-                    const size_t dataSize = accessor.count * 4;
-
-                    std::vector<glm::vec4> tangents;
-                    for (size_t i = 0; i < dataSize - 3; i += 4) {
-                        tangents.emplace_back(glm::make_vec4(
-                            &reinterpret_cast<const float*>(&data[start])[i]
-                        ));
-                    }
+                const size_t start = accessor.byteOffset + view.byteOffset;
+                const size_t dataSize = accessor.count * 3;
 
-                    return tangents;
-                }();
-                primitive.texCoord0s = [&]{
-                    const auto& attribute = gltfPrimitive.attributes.find("TEXCOORD_0");
-                    // We might not have texCoord0s
-                    if (attribute == gltfPrimitive.attributes.end())
-                        return std::vector<glm::vec2>();
-
-                    const auto& accessor = gltfModel.accessors[attribute->second];
-                    const auto& view = gltfModel.bufferViews[accessor.bufferView];
-                    const uint8_t* data = gltfModel.buffers[view.buffer].data.data();
-
-                    const size_t start = accessor.byteOffset + view.byteOffset;
-                    const size_t dataSize = accessor.count * 2;
-
-                    std::vector<glm::vec2> texCoord0s;
-                    for (size_t i = 0; i < dataSize - 1; i += 2) {
-                        texCoord0s.emplace_back(glm::make_vec2(
-                            &reinterpret_cast<const float*>(&data[start])[i]
-                        ));
-                    }
+                std::vector<glm::vec3> positions;
+                for (size_t i = 0; i < dataSize - 2; i += 3) {
+                    positions.emplace_back(glm::make_vec3(
+                        &reinterpret_cast<const float*>(&data[start])[i]
+                    ));
+                    primitive.min = glm::min(primitive.min, positions.back());
+                    primitive.max = glm::max(primitive.max, positions.back());
+                }
 
-                    return texCoord0s;
-                }();
-
-                primitive.tris = [&] {
-                    assert(gltfPrimitive.indices > -1);
-
-                    const auto& accessor = gltfModel.accessors[gltfPrimitive.indices];
-                    const auto& view = gltfModel.bufferViews[accessor.bufferView];
-                    const uint8_t* data = gltfModel.buffers[view.buffer].data.data();
-
-                    const size_t start = accessor.byteOffset + view.byteOffset;
-
-                    std::vector<uint32_t> is;
-                    if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT) {
-                        is = std::vector(
-                            reinterpret_cast<const uint32_t*>(&data[start]),
-                            reinterpret_cast<const uint32_t*>(&data[start]) + accessor.count
-                        );
-                    } else if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT) {
-                        is.resize(accessor.count);
-                        for (size_t i = 0; i < accessor.count; ++i)
-                            is[i] = reinterpret_cast<const uint16_t*>(&data[start])[i];
-                    } else {
-                        is.resize(accessor.count);
-                        for (size_t i = 0; i < accessor.count; ++i)
-                            is[i] = reinterpret_cast<const uint8_t*>(&data[start])[i];
-                    }
+                return positions;
+            }();
+            primitive.normals = [&]{
+                const auto& attribute = gltfPrimitive.attributes.find("NORMAL");
+                // We might not have normals
+                if (attribute == gltfPrimitive.attributes.end())
+                    return std::vector<glm::vec3>();
 
-                    std::vector<TriIndices> tris;
-                    for (size_t i = 0; i < is.size() - 2; i += 3)
-                        tris.emplace_back(is[i], is[i + 1], is[i + 2]);
+                const auto& accessor = gltfModel.accessors[attribute->second];
+                const auto& view = gltfModel.bufferViews[accessor.bufferView];
+                const uint8_t* data = gltfModel.buffers[view.buffer].data.data();
 
-                    return tris;
-                }();
+                const size_t start = accessor.byteOffset + view.byteOffset;
+                const size_t dataSize = accessor.count * 3;
 
-                assert(gltfPrimitive.material != -1);
+                // Normals should already be normalized
+                std::vector<glm::vec3> normals;
+                for (size_t i = 0; i < dataSize - 2; i += 3) {
+                    normals.emplace_back(glm::make_vec3(
+                        &reinterpret_cast<const float*>(&data[start])[i]
+                    ));
+                }
 
-                primitive.material = &materials[gltfPrimitive.material];
+                return normals;
+            }();
+            primitive.tangents = [&]{
+                const auto& attribute = gltfPrimitive.attributes.find("TANGENT");
+                // We might not have tangents
+                if (attribute == gltfPrimitive.attributes.end())
+                    return std::vector<glm::vec4>();
 
-                mesh.primitives.push_back(std::move(primitive));
+                const auto& accessor = gltfModel.accessors[attribute->second];
+                const auto& view = gltfModel.bufferViews[accessor.bufferView];
+                const uint8_t* data = gltfModel.buffers[view.buffer].data.data();
+
+                const size_t start = accessor.byteOffset + view.byteOffset;
+                const size_t dataSize = accessor.count * 4;
+
+                std::vector<glm::vec4> tangents;
+                for (size_t i = 0; i < dataSize - 3; i += 4) {
+                    tangents.emplace_back(glm::make_vec4(
+                        &reinterpret_cast<const float*>(&data[start])[i]
+                    ));
+                }
+
+                return tangents;
+            }();
+            primitive.texCoord0s = [&]{
+                const auto& attribute = gltfPrimitive.attributes.find("TEXCOORD_0");
+                // We might not have texCoord0s
+                if (attribute == gltfPrimitive.attributes.end())
+                    return std::vector<glm::vec2>();
+
+                const auto& accessor = gltfModel.accessors[attribute->second];
+                const auto& view = gltfModel.bufferViews[accessor.bufferView];
+                const uint8_t* data = gltfModel.buffers[view.buffer].data.data();
+
+                const size_t start = accessor.byteOffset + view.byteOffset;
+                const size_t dataSize = accessor.count * 2;
+
+                std::vector<glm::vec2> texCoord0s;
+                for (size_t i = 0; i < dataSize - 1; i += 2) {
+                    texCoord0s.emplace_back(glm::make_vec2(
+                        &reinterpret_cast<const float*>(&data[start])[i]
+                    ));
+                }
+
+                return texCoord0s;
+            }();
+
+            // Influences are used as is, skinning normalizes the weights
+            primitive.joints = [&]{
+                const auto& attribute = gltfPrimitive.attributes.find("JOINTS_0");
+                if (attribute == gltfPrimitive.attributes.end())
+                    return std::vector<glm::u16vec4>();
+
+                const std::vector<float> values = readFloats(gltfModel, attribute->second, 4);
+                std::vector<glm::u16vec4> joints;
+                for (size_t i = 0; i < values.size(); i += 4)
+                    joints.emplace_back(glm::make_vec4(&values[i]));
+
+                return joints;
+            }();
+            primitive.weights = [&]{
+                const auto& attribute = gltfPrimitive.attributes.find("WEIGHTS_0");
+                if (attribute == gltfPrimitive.attributes.end() || primitive.joints.empty())
+                    return std::vector<glm::vec4>();
+
+                const std::vector<float> values = readFloats(gltfModel, attribute->second, 4);
+                std::vector<glm::vec4> weights;
+                for (size_t i = 0; i < values.size(); i += 4)
+                    weights.push_back(glm::make_vec4(&values[i]));
+
+                return weights;
+            }();
+            if (primitive.weights.empty())
+                primitive.joints.clear();
+
+            primitive.tris = [&] {
+                assert(gltfPrimitive.indices > -1);
+
+                const auto& accessor = gltfModel.accessors[gltfPrimitive.indices];
+                const auto& view = gltfModel.bufferViews[accessor.bufferView];
+                const uint8_t* data = gltfModel.buffers[view.buffer].data.data();
+
+                const size_t start = accessor.byteOffset + view.byteOffset;
+
+                std::vector<uint32_t> is;
+                if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT) {
+                    is = std::vector(
+                        reinterpret_cast<const uint32_t*>(&data[start]),
+                        reinterpret_cast<const uint32_t*>(&data[start]) + accessor.count
+                    );
+                } else if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT) {
+                    is.resize(accessor.count);
+                    for (size_t i = 0; i < accessor.count; ++i)
+                        is[i] = reinterpret_cast<const uint16_t*>(&data[start])[i];
+                } else {
+                    is.resize(accessor.count);
+                    for (size_t i = 0; i < accessor.count; ++i)
+                        is[i] = reinterpret_cast<const uint8_t*>(&data[start])[i];
+                }
+
+                std::vector<TriIndices> tris;
+                for (size_t i = 0; i < is.size() - 2; i += 3)
+                    tris.emplace_back(is[i], is[i + 1], is[i + 2]);
+
+                return tris;
+            }();
+
+            assert(gltfPrimitive.material != -1);
+
+            primitive.material = &materials[gltfPrimitive.material];
+
+            weldVertices(&primitive);
+            if (pack)
+                packVertices(&primitive);
+
+            mesh.primitives.push_back(std::move(primitive));
+        }
+
+        mesh.min = glm::vec3(std::numeric_limits<float>::max());
+        mesh.max = glm::vec3(std::numeric_limits<float>::min());
+        for (const auto& primitive : mesh.primitives) {
+            mesh.min = glm::min(mesh.min, primitive.min);
+            mesh.max = glm::max(mesh.max, primitive.max);
+        }
+
+        return mesh;
+    }
+
+    // One mesh per shared glTF mesh, see Sharing, meshes that aren't kept
+    // stay empty
+    std::vector<Mesh> loadMeshes(const tinygltf::Model& gltfModel, const std::vector<size_t>& sources, const std::vector<char>& keep, const std::vector<Material>& materials, bool pack, JobSystem* jobs)
+    {
+        std::vector<Mesh> meshes(sources.size());
+        jobs->parallelFor(0, meshes.size(), 1, [&](size_t begin, size_t end){
+            for (size_t i = begin; i < end; ++i) {
+                if (keep[i])
+                    meshes[i] = loadMesh(gltfModel, gltfModel.meshes[sources[i]], materials, pack);
             }
+        });
+        return meshes;
+    }
 
+    // Primitives without data, bounds come from the position accessors
+    std::vector<Mesh> loadMeshBounds(const tinygltf::Model& gltfModel, const std::vector<size_t>& sources, const std::vector<Material>& materials)
+    {
+        std::vector<Mesh> meshes;
+        for (const size_t source : sources) {
+            const auto& gltfMesh = gltfModel.meshes[source];
+            Mesh mesh;
             mesh.min = glm::vec3(std::numeric_limits<float>::max());
-            mesh.max = glm::vec3(std::numeric_limits<float>::min());
-            for (const auto& primitive : mesh.primitives) {
+            mesh.max = glm::vec3(std::numeric_limits<float>::lowest());
+            for (const auto& gltfPrimitive : gltfMesh.primitives) {
+                Primitive primitive;
+                const auto& attribute = gltfPrimitive.attributes.find("POSITION");
+                assert(attribute != gltfPrimitive.attributes.end());
+                const auto& accessor = gltfModel.accessors[attribute->second];
+                // Required by the spec
+                if (accessor.minValues.size() == 3 && accessor.maxValues.size() == 3) {
+                    primitive.min = glm::vec3(
+                        accessor.minValues[0], accessor.minValues[1], accessor.minValues[2]
+                    );
+                    primitive.max = glm::vec3(
+                        accessor.maxValues[0], accessor.maxValues[1], accessor.maxValues[2]
+                    );
+                }
+                assert(gltfPrimitive.material != -1);
+                primitive.material = &materials[gltfPrimitive.material];
+
                 mesh.min = glm::min(mesh.min, primitive.min);
                 mesh.max = glm::max(mesh.max, primitive.max);
+                mesh.primitives.push_back(std::move(primitive));
             }
-
             meshes.push_back(std::move(mesh));
         }
-
         return meshes;
     }
 
-    std::vector<Scene::Node> loadNodes(const tinygltf::Model& gltfModel, const std::vector<Mesh>& meshes)
+    std::vector<Skin> loadSkins(const tinygltf::Model& gltfModel)
+    {
+        std::vector<Skin> skins;
+        for (const auto& gltfSkin : gltfModel.skins) {
+            Skin skin;
+            skin.joints.assign(gltfSkin.joints.begin(), gltfSkin.joints.end());
+            skin.inverseBinds.resize(skin.joints.size(), glm::mat4(1.f));
+            if (gltfSkin.inverseBindMatrices > -1) {
+                const std::vector<float> values = readFloats(gltfModel, gltfSkin.inverseBindMatrices, 16);
+                for (size_t j = 0; j < skin.inverseBinds.size() && j * 16 < values.size(); ++j)
+                    skin.inverseBinds[j] = glm::make_mat4(&values[j * 16]);
+            }
+            skins.push_back(std::move(skin));
+        }
+        return skins;
+    }
+
+    std::vector<Animation> loadAnimations(const tinygltf::Model& gltfModel)
+    {
+        std::vector<Animation> animations;
+        for (const auto& gltfAnimation : gltfModel.animations) {
+            Animation animation;
+            for (const auto& gltfChannel : gltfAnimation.channels) {
+                Animation::Channel channel;
+                // TODO: Morph target weights
+                if (gltfChannel.target_path == "translation")
+                    channel.path = Animation::Path::Translation;
+                else if (gltfChannel.target_path == "rotation")
+                    channel.path = Animation::Path::Rotation;
+                else if (gltfChannel.target_path == "scale")
+                    channel.path = Animation::Path::Scale;
+                else
+                    continue;
+                if (gltfChannel.target_node < 0)
+                    continue;
+                channel.node = gltfChannel.target_node;
+
+                const auto& sampler = gltfAnimation.samplers[gltfChannel.sampler];
+                if (sampler.interpolation == "STEP")
+                    channel.interpolation = Animation::Interpolation::Step;
+                else if (sampler.interpolation == "CUBICSPLINE")
+                    channel.interpolation = Animation::Interpolation::CubicSpline;
+                else
+                    channel.interpolation = Animation::Interpolation::Linear;
+
+                channel.times = readFloats(gltfModel, sampler.input, 1);
+                const size_t components = channel.path == Animation::Path::Rotation ? 4 : 3;
+                const std::vector<float> values = readFloats(gltfModel, sampler.output, components);
+                for (size_t i = 0; i + components <= values.size(); i += components) {
+                    glm::vec4 value(0.f);
+                    for (size_t c = 0; c < components; ++c)
+                        value[c] = values[i + c];
+                    channel.values.push_back(value);
+                }
+
+                const size_t valuesPerKey =
+                    channel.interpolation == Animation::Interpolation::CubicSpline ? 3 : 1;
+                if (channel.times.empty() || channel.values.size() != channel.times.size() * valuesPerKey)
+                    throw std::runtime_error("Animation sampler key counts don't match");
+
+                animation.duration = std::max(animation.duration, channel.times.back());
+                animation.channels.push_back(std::move(channel));
+            }
+            animations.push_back(std::move(animation));
+        }
+        return animations;
+    }
+
+    // Mesh indices map glTF meshes to the shared ones
+    std::vector<Scene::Node> loadNodes(const tinygltf::Model& gltfModel, const std::vector<Mesh>& meshes, const std::vector<size_t>& meshIndices, const std::vector<Skin>& skins)
     {
         // TODO: More complex nodes
         std::vector<Scene::Node> nodes(gltfModel.nodes.size());
@@ -229,7 +723,9 @@ namespace {
                 [&](int i){ return &nodes[i]; }
             );
             if (gltfNode.mesh > -1)
-                nodes[n].mesh = &meshes[gltfNode.mesh];
+                nodes[n].mesh = &meshes[meshIndices[gltfNode.mesh]];
+            if (gltfNode.skin > -1)
+                nodes[n].skin = &skins[gltfNode.skin];
             if (gltfNode.matrix.size() == 16) {
                 // Spec defines the matrix to be decomposeable to T * R * S
                 const glm::mat4 matrix = glm::make_mat4(gltfNode.matrix.data());
@@ -338,6 +834,9 @@ Mesh loadOBJ(const std::string& path)
         lineNum++;
     }
 
+    // Some exporters write every face corner as its own vertex
+    weldVertices(&primitive);
+
     printf("%zu verts and %zu tris\n", primitive.positions.size(), primitive.tris.size());
     printf(
         "min (%.2f, %.2f, %.2f) max (%.2f, %.2f, %.2f)\n",
@@ -348,30 +847,60 @@ Mesh loadOBJ(const std::string& path)
     return {primitive.min, primitive.max, {primitive}};
 }
 
-World loadGLTF(const std::string& path)
+World loadGLTF(const std::string& path, JobSystem* jobs, bool packVertices, const NodeFilter& filter)
 {
-    const tinygltf::Model gltfModel = [&](){
-        tinygltf::Model model;
-        tinygltf::TinyGLTF loader;
-        std::string warn;
-        std::string err;
-
-        const bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, path);
-        if (!warn.empty())
-            throw std::runtime_error(warn);
-        if (!err.empty())
-            throw std::runtime_error(err);
-        if (!ret)
-            throw std::runtime_error("Parsing glTF failed");
+    tinygltf::Model gltfModel = parseGLTF(path);
+    const Sharing sharing = findSharing(gltfModel);
 
-        return model;
-    }();
+    // Shared meshes and images that the kept nodes draw
+    std::vector<uint8_t> keepNodes(gltfModel.nodes.size(), true);
+    std::vector<char> keepMeshes(sharing.meshSources.size(), filter == nullptr);
+    std::vector<char> keepImages(sharing.images.size(), filter == nullptr);
+    if (filter != nullptr) {
+        keepNodes = filter(nodeTriangles(gltfModel));
+        for (size_t n = 0; n < gltfModel.nodes.size(); ++n) {
+            const int mesh = gltfModel.nodes[n].mesh;
+            if (keepNodes[n] && mesh > -1)
+                keepMeshes[sharing.meshes[mesh]] = true;
+        }
+        for (size_t m = 0; m < keepMeshes.size(); ++m) {
+            if (!keepMeshes[m])
+                continue;
+            for (const auto& gltfPrimitive : gltfModel.meshes[sharing.meshSources[m]].primitives) {
+                if (gltfPrimitive.material < 0)
+                    continue;
+                for (const int texture : materialTextures(gltfModel.materials[gltfPrimitive.material]))
+                    keepImages[sharing.textures[texture]] = true;
+            }
+        }
+    }
 
     World world;
-    world.textures = loadTextures(gltfModel);
-    world.materials = loadMaterials(gltfModel, world.textures);
-    world.meshes = loadMeshes(gltfModel, world.materials);
-    world.nodes = loadNodes(gltfModel, world.meshes);
+    // Textures are filled in once their images are decoded, materials only
+    // point at them
+    world.textures = std::vector<Texture>(sharing.images.size());
+    world.materials = loadMaterials(gltfModel, world.textures, sharing.textures);
+    world.meshes = loadMeshes(gltfModel, sharing.meshSources, keepMeshes, world.materials, packVertices, jobs);
+    world.skins = loadSkins(gltfModel);
+    world.animations = loadAnimations(gltfModel);
+    world.nodes = loadNodes(gltfModel, world.meshes, sharing.meshes, world.skins);
+    for (size_t n = 0; n < world.nodes.size(); ++n) {
+        if (!keepNodes[n])
+            world.nodes[n].mesh = nullptr;
+    }
+
+    // Images were copied out of the buffers while parsing, so the raw
+    // geometry can go before they are decoded
+    std::vector<tinygltf::Buffer>().swap(gltfModel.buffers);
+    std::vector<size_t> images;
+    for (size_t i = 0; i < sharing.images.size(); ++i) {
+        if (keepImages[i])
+            images.push_back(sharing.images[i]);
+    }
+    decodeImages(&gltfModel, images, jobs);
+    std::vector<Texture> textures = loadTextures(gltfModel, sharing.images, keepImages);
+    for (size_t i = 0; i < textures.size(); ++i)
+        world.textures[i] = std::move(textures[i]);
     auto [scenes, currentScene] = loadScenes(gltfModel, &world.nodes);
     world.scenes = scenes;
     world.currentScene = currentScene;
@@ -380,3 +909,125 @@ World loadGLTF(const std::string& path)
 
     return world;
 }
+
+WorldLoader::WorldLoader(const std::string& path, JobSystem* jobs, bool packVertices, bool geometry) :
+    _jobs(jobs),
+    _packVertices(packVertices),
+    _geometry(geometry)
+{
+    _thread = std::thread([this, path]{
+        try {
+            load(path);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _error = std::current_exception();
+        }
+    });
+}
+
+WorldLoader::~WorldLoader()
+{
+    _cancel = true;
+    _thread.join();
+}
+
+bool WorldLoader::update(World* world)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_error != nullptr)
+        std::rethrow_exception(_error);
+
+    // Moving keeps the elements in place so pointers between them stay valid
+    if (_skeleton != nullptr) {
+        *world = std::move(*_skeleton);
+        _skeleton.reset();
+    }
+
+    for (auto& [index, loaded] : _meshes) {
+        Mesh& mesh = world->meshes[index];
+        for (size_t p = 0; p < mesh.primitives.size(); ++p) {
+            Primitive& primitive = mesh.primitives[p];
+            Primitive& loadedPrimitive = loaded.primitives[p];
+            primitive.min = loadedPrimitive.min;
+            primitive.max = loadedPrimitive.max;
+            swapGeometry(&primitive, &loadedPrimitive);
+        }
+        mesh.min = loaded.min;
+        mesh.max = loaded.max;
+    }
+    _meshes.clear();
+
+    for (size_t i = 0; i < _textures.size(); ++i)
+        world->textures[i] = std::move(_textures[i]);
+    _textures.clear();
+
+    return _done;
+}
+
+const std::vector<std::string>& WorldLoader::sourceFiles() const
+{
+    return _sourceFiles;
+}
+
+void WorldLoader::load(const std::string& path)
+{
+    tinygltf::Model gltfModel = parseGLTF(path);
+    const Sharing sharing = findSharing(gltfModel);
+
+    // Embedded buffers change with the glTF itself
+    std::vector<std::string> sourceFiles{path};
+    const std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+    for (const auto& buffer : gltfModel.buffers) {
+        if (!buffer.uri.empty() && buffer.uri.compare(0, 5, "data:") != 0)
+            sourceFiles.push_back(directory + buffer.uri);
+    }
+
+    // Scene graph with empty primitives goes first so rendering can start
+    // Loaded meshes only carry data over so their materials can point anywhere
+    std::vector<Material> materials;
+    {
+        auto world = std::make_unique<World>();
+        world->textures = std::vector<Texture>(sharing.images.size());
+        world->materials = loadMaterials(gltfModel, world->textures, sharing.textures);
+        world->meshes = loadMeshBounds(gltfModel, sharing.meshSources, world->materials);
+        world->skins = loadSkins(gltfModel);
+        world->animations = loadAnimations(gltfModel);
+        world->nodes = loadNodes(gltfModel, world->meshes, sharing.meshes, world->skins);
+        auto [scenes, currentScene] = loadScenes(gltfModel, &world->nodes);
+        world->scenes = scenes;
+        world->currentScene = currentScene;
+        materials = world->materials;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _skeleton = std::move(world);
+    }
+
+    // Meshes are handed over one by one as they finish
+    // Decoding runs at background priority so a frame waiting on its own
+    // jobs never picks up a whole mesh or image
+    if (_geometry) {
+        _jobs->parallelFor(0, sharing.meshSources.size(), 1, [&](size_t begin, size_t end){
+            for (size_t i = begin; i < end && !_cancel; ++i) {
+                const auto& gltfMesh = gltfModel.meshes[sharing.meshSources[i]];
+                Mesh mesh = loadMesh(gltfModel, gltfMesh, materials, _packVertices);
+                std::lock_guard<std::mutex> lock(_mutex);
+                _meshes.emplace_back(i, std::move(mesh));
+            }
+        }, JobSystem::Priority::Background);
+    }
+    if (_cancel)
+        return;
+
+    // Images were copied out of the buffers while parsing, so the raw
+    // geometry can go before they are decoded
+    std::vector<tinygltf::Buffer>().swap(gltfModel.buffers);
+
+    decodeImages(&gltfModel, sharing.images, _jobs, JobSystem::Priority::Background);
+    std::vector<Texture> textures =
+        loadTextures(gltfModel, sharing.images, std::vector<char>(sharing.images.size(), true));
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _textures = std::move(textures);
+    _sourceFiles = std::move(sourceFiles);
+    _done = true;
+}
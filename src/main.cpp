@@ -5,13 +5,30 @@
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <future>
 #include <iostream>
-#include <unordered_set>
+#include <numeric>
+#include <string>
+#include <thread>
 
+#include "animator.hpp"
 #include "camera.hpp"
-#include "clip.hpp"
+#include "commandList.hpp"
+#include "distributed.hpp"
+#include "dynamicResolution.hpp"
 #include "frameBuffer.hpp"
+#include "geometryCache.hpp"
+#include "jobSystem.hpp"
+#include "lineBatch.hpp"
 #include "loader.hpp"
+#include "memoryReport.hpp"
+#include "presenter.hpp"
+#include "renderer.hpp"
+#include "residency.hpp"
 #include "timer.hpp"
 
 using std::cout;
@@ -23,91 +40,60 @@ namespace {
     glm::uvec2 RES(640, 480);
     uint32_t OUTPUT_SCALE = 2;
     glm::uvec2 OUTPUT_RES = RES * OUTPUT_SCALE;
+    // Samples per pixel, smooths edges without raising RES
+    uint32_t MSAA_SAMPLES = 1;
 
-    const glm::vec3 LIGHT_DIR = glm::normalize(glm::vec3(-1.f, -1.f, -2.f));
+    // Frames rendered without a window
+    size_t HEADLESS_FRAMES = 100;
+    // Animation time step without a window so output doesn't depend on speed
+    const float HEADLESS_FRAME_SECONDS = 1.f / 60.f;
+    // Encoding of frames written with --output
+    ImageFormat OUTPUT_FORMAT = ImageFormat::Ppm;
 
-    const Color white(255, 255, 255);
-    const Color red(255, 0, 0);
+    // Zero uses all hardware threads
+    uint32_t THREADS = 0;
+    bool PIN_THREADS = false;
+    // Core of the first pinned thread, set for workers by the compositor
+    uint32_t FIRST_CORE = 0;
 
-    std::tuple<size_t, size_t> drawMesh(const Mesh& mesh, const glm::mat4& modelToWorld, const Camera& camera, FrameBuffer* fb)
-    {
-        size_t drawnTris = 0;
-        size_t culledTris = 0;
+    // Draw time to hold by lowering the resolution, zero renders at RES
+    float TARGET_MILLIS = 0.f;
 
-        for (const auto& primitive : mesh.primitives) {
-            // This is basically a "vertex shader"
-            for (const auto& tri : primitive.tris) {
-                const glm::vec4 p0World = modelToWorld * glm::vec4(primitive.positions[tri.v0], 1.f);
-                const glm::vec4 p1World = modelToWorld * glm::vec4(primitive.positions[tri.v1], 1.f);
-                const glm::vec4 p2World = modelToWorld * glm::vec4(primitive.positions[tri.v2], 1.f);
-
-                const glm::vec3 n = glm::normalize(glm::cross(
-                    glm::vec3(p1World - p0World),
-                    glm::vec3(p2World - p0World)
-                ));
-
-                // Do back-face culling
-                const glm::vec3 v = glm::normalize(camera.eye() - glm::vec3(p0World));
-                const float NoV = glm::dot(n, v);
-                if (NoV <= 0) {
-                    culledTris++;
-                    continue;
-                }
+    // Quantizes vertex attributes to a third of the memory
+    bool PACK_VERTICES = false;
 
-                const float NoL = glm::dot(n, -LIGHT_DIR);
-                const Color shade(255 * NoL);
+    // Megabytes of resident scene geometry, zero keeps everything in memory
+    size_t STREAM_BUDGET = 0;
 
-                const std::array<glm::vec4, 3> clipVerts = [&](){
-                    return std::array<glm::vec4, 3>{
-                        camera.worldToClip() * p0World,
-                        camera.worldToClip() * p1World,
-                        camera.worldToClip() * p2World
-                    };
-                }();
+    bool DEPTH_PREPASS = false;
+    bool SHADOWS = false;
 
-                drawnTris += drawTri(clipVerts, shade, fb);
-            }
-        }
+    // Starts with wireframes over the scene, e.g. to measure what they cost
+    bool WIREFRAME = false;
+    // Keeps wireframes from disappearing into the surfaces they outline
+    const float WIREFRAME_DEPTH_BIAS = 1e-5f;
 
-        return std::make_pair(drawnTris, culledTris);
-    }
+    // Processes that each draw part of the scene for this one to composite,
+    // zero draws everything here
+    size_t WORKERS = 0;
 
-    std::tuple<size_t, size_t> drawWorld(const World& world, const Camera& camera, FrameBuffer *fb)
-    {
-        size_t drawnTris = 0;
-        size_t culledTris = 0;
+    // Draws the scene for a left and right eye side by side, the views share
+    // their vertex work
+    bool STEREO = false;
+    // Distance between the eyes in scene units, the default view is about a
+    // hundred across
+    const float EYE_SEPARATION = 2.f;
 
-        // Go through scene graph using DFS while keeping track of stacked transform
-        std::vector<glm::mat4> parentTransforms({ glm::mat4(1.f) });
-        std::unordered_set<Scene::Node*> visited;
-        std::vector<Scene::Node*> nodeStack = world.scenes[world.currentScene].nodes;
-        while (!nodeStack.empty()) {
-            const auto node = nodeStack.back();
-            if (visited.find(node) != visited.end()) {
-                nodeStack.pop_back();
-                parentTransforms.pop_back();
-            } else {
-                visited.emplace(node);
-                nodeStack.insert(nodeStack.end(), node->children.begin(), node->children.end());
-
-                const glm::mat4 transform =
-                    parentTransforms.back() *
-                    glm::translate(glm::mat4(1.f), node->translation) *
-                    glm::mat4_cast(node->rotation) *
-                    glm::scale(glm::mat4(1.f), node->scale);
-
-                if (node->mesh != nullptr) {
-                    const auto [drawn, culled] = drawMesh(*node->mesh, transform, camera, fb);
-                    drawnTris += drawn;
-                    culledTris += culled;
-                }
+    const std::string SCENE_PATH = RES_DIRECTORY "res/the_noble_craftsman/scene.gltf";
 
-                parentTransforms.push_back(std::move(transform));
-            }
-        }
+    // Largest meshes and textures listed in the memory window
+    const size_t MEMORY_TOP_COUNT = 8;
+    // How often the memory window is refreshed
+    const float MEMORY_WINDOW_SECONDS = 0.5f;
 
-        return std::make_pair(drawnTris, culledTris);
-    }
+    const Color white(255, 255, 255);
+    const Color red(255, 0, 0);
+    const Color green(0, 255, 0);
 
     void keyCallback(GLFWwindow* window, int32_t key, int32_t scancode, int32_t action,
                     int32_t mods)
@@ -122,80 +108,275 @@ namespace {
     {
         cerr << "GLFW error " << error << ": " << description << endl;
     }
+
+    float megabytes(size_t bytes)
+    {
+        return bytes / float(1 << 20);
+    }
+
+    // Lists the largest entries of usages by reserved bytes
+    void memoryTree(const char* label, const std::vector<MemoryUsage>& usages)
+    {
+        if (!ImGui::TreeNode(label, "%s (%zu)", label, usages.size()))
+            return;
+
+        std::vector<size_t> order(usages.size());
+        std::iota(order.begin(), order.end(), 0);
+        const size_t count = std::min(order.size(), MEMORY_TOP_COUNT);
+        std::partial_sort(order.begin(), order.begin() + count, order.end(), [&](size_t a, size_t b){
+            return usages[a].reserved > usages[b].reserved;
+        });
+        for (size_t i = 0; i < count; ++i) {
+            const MemoryUsage& usage = usages[order[i]];
+            ImGui::Text(
+                "#%zu %.2fMB (%.2fMB wasted)",
+                order[i], megabytes(usage.reserved), megabytes(usage.wasted())
+            );
+        }
+        ImGui::TreePop();
+    }
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-    // Init GLFW-context
-    glfwSetErrorCallback(errorCallback);
-    if (!glfwInit()) exit(EXIT_FAILURE);
-
-    // Set desired context hints
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
-
-    // Create the window
-    GLFWwindow* windowPtr;
-    windowPtr = glfwCreateWindow(OUTPUT_RES.x, OUTPUT_RES.y, WINDOW_TITLE, NULL, NULL);
-    if (!windowPtr) {
-        glfwTerminate();
-        cerr << "Error creating GLFW-window!" << endl;
+    bool headless = false;
+    const char* outputDir = nullptr;
+    const char* memoryReportPath = nullptr;
+    // Shared memory of the compositor if this is one of its workers
+    const char* workerFrame = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--headless") == 0)
+            headless = true;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            HEADLESS_FRAMES = std::stoul(argv[++i]);
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            outputDir = argv[++i];
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            const char* format = argv[++i];
+            if (strcmp(format, "ppm") == 0)
+                OUTPUT_FORMAT = ImageFormat::Ppm;
+            else if (strcmp(format, "qoi") == 0)
+                OUTPUT_FORMAT = ImageFormat::Qoi;
+            else if (strcmp(format, "png") == 0)
+                OUTPUT_FORMAT = ImageFormat::Png;
+            else {
+                cerr << "Unknown output format " << format << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--msaa") == 0 && i + 1 < argc)
+            MSAA_SAMPLES = std::stoul(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            THREADS = std::stoul(argv[++i]);
+        else if (strcmp(argv[i], "--pin-threads") == 0)
+            PIN_THREADS = true;
+        else if (strcmp(argv[i], "--first-core") == 0 && i + 1 < argc)
+            FIRST_CORE = std::stoul(argv[++i]);
+        else if (strcmp(argv[i], "--target-ms") == 0 && i + 1 < argc)
+            TARGET_MILLIS = std::stof(argv[++i]);
+        else if (strcmp(argv[i], "--pack-vertices") == 0)
+            PACK_VERTICES = true;
+        else if (strcmp(argv[i], "--stream-budget") == 0 && i + 1 < argc)
+            STREAM_BUDGET = std::stoul(argv[++i]);
+        else if (strcmp(argv[i], "--depth-prepass") == 0)
+            DEPTH_PREPASS = true;
+        else if (strcmp(argv[i], "--shadows") == 0)
+            SHADOWS = true;
+        else if (strcmp(argv[i], "--wireframe") == 0)
+            WIREFRAME = true;
+        else if (strcmp(argv[i], "--memory-report") == 0 && i + 1 < argc)
+            memoryReportPath = argv[++i];
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            WORKERS = std::stoul(argv[++i]);
+        else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc)
+            workerFrame = argv[++i];
+        else if (strcmp(argv[i], "--stereo") == 0)
+            STEREO = true;
+        else {
+            cerr << "Usage: " << argv[0] <<
+                " [--headless] [--frames N] [--output DIR]"
+                " [--format ppm|qoi|png] [--msaa 1|2|4|8] [--threads N]"
+                " [--pin-threads] [--target-ms MS]"
+                " [--pack-vertices] [--stream-budget MB] [--depth-prepass]"
+                " [--shadows] [--wireframe] [--memory-report PATH]"
+                " [--workers N] [--stereo]" << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (STEREO && WORKERS > 0) {
+        cerr << "--stereo doesn't work with --workers" << endl;
         exit(EXIT_FAILURE);
     }
-    glfwMakeContextCurrent(windowPtr);
-
-    // Init GL
-    if (gl3wInit()) {
-        glfwDestroyWindow(windowPtr);
-        glfwTerminate();
-        cerr << "Error initializing GL3W!" << endl;
+    // Workers would only see shadows of their own part
+    if (SHADOWS && WORKERS > 0) {
+        cerr << "--shadows doesn't work with --workers" << endl;
         exit(EXIT_FAILURE);
     }
 
-    // Set vsync on
-    glfwSwapInterval(1);
+    JobSystem jobs(THREADS, PIN_THREADS, FIRST_CORE);
 
-    // Init GL settings
-    glViewport(0, 0, OUTPUT_RES.x, OUTPUT_RES.y);
-    glClearColor(0.f, 0.f, 0.f, 1.f);
-
-    GLenum error = glGetError();
-    if(error != GL_NO_ERROR) {
-        glfwDestroyWindow(windowPtr);
-        glfwTerminate();
-        cerr << "Error initializing GL!" << endl;
-        exit(EXIT_FAILURE);
+    if (workerFrame != nullptr) {
+        bool succeeded = false;
+        try {
+            succeeded = runRenderWorker(workerFrame, SCENE_PATH, &jobs, PACK_VERTICES);
+        } catch (const std::runtime_error& e) {
+            cerr << e.what() << endl;
+        }
+        exit(succeeded ? EXIT_SUCCESS : EXIT_FAILURE);
     }
 
-    // Set glfw-callbacks, these will pass to imgui's callbacks if overridden
-    glfwSetKeyCallback(windowPtr, keyCallback);
+    GLFWwindow* windowPtr = nullptr;
+    if (!headless) {
+        // Init GLFW-context
+        glfwSetErrorCallback(errorCallback);
+        if (!glfwInit()) exit(EXIT_FAILURE);
+
+        // Set desired context hints
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+
+        // Create the window
+        windowPtr = glfwCreateWindow(OUTPUT_RES.x, OUTPUT_RES.y, WINDOW_TITLE, NULL, NULL);
+        if (!windowPtr) {
+            glfwTerminate();
+            cerr << "Error creating GLFW-window!" << endl;
+            exit(EXIT_FAILURE);
+        }
+        glfwMakeContextCurrent(windowPtr);
+
+        // Init GL
+        if (gl3wInit()) {
+            glfwDestroyWindow(windowPtr);
+            glfwTerminate();
+            cerr << "Error initializing GL3W!" << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        // Set vsync on
+        glfwSwapInterval(1);
+
+        // Init GL settings
+        glViewport(0, 0, OUTPUT_RES.x, OUTPUT_RES.y);
+        glClearColor(0.f, 0.f, 0.f, 1.f);
+
+        GLenum error = glGetError();
+        if(error != GL_NO_ERROR) {
+            glfwDestroyWindow(windowPtr);
+            glfwTerminate();
+            cerr << "Error initializing GL!" << endl;
+            exit(EXIT_FAILURE);
+        }
 
-    // Init imgui
-    IMGUI_CHECKVERSION();
-    ImGui::CreateContext();
-    ImGui_ImplGlfw_InitForOpenGL(windowPtr, true);
-    ImGui_ImplOpenGL3_Init("#version 410");
+        // Set glfw-callbacks, these will pass to imgui's callbacks if overridden
+        glfwSetKeyCallback(windowPtr, keyCallback);
+
+        // Init imgui
+        IMGUI_CHECKVERSION();
+        ImGui::CreateContext();
+        ImGui_ImplGlfw_InitForOpenGL(windowPtr, true);
+        ImGui_ImplOpenGL3_Init("#version 410");
+    }
 
     ImGuiWindowFlags mainWindowFlags =
         ImGuiWindowFlags_NoTitleBar |
         ImGuiWindowFlags_NoResize;
 
-    // Init buffer
-    FrameBuffer fb(RES, OUTPUT_RES);
+    // Init buffers
+    std::unique_ptr<PresentBackend> presentBackend;
+    if (!headless)
+        presentBackend = std::make_unique<GLPresentBackend>(RES, OUTPUT_RES);
+    else if (outputDir != nullptr)
+        presentBackend = std::make_unique<FilePresentBackend>(outputDir, OUTPUT_FORMAT);
+    else
+        presentBackend = std::make_unique<NullPresentBackend>();
+    auto presenter = std::make_unique<Presenter>(std::move(presentBackend), RES, MSAA_SAMPLES);
+
+    // Workers split the hardware threads between them
+    std::unique_ptr<DistributedRenderer> distributed;
+    if (WORKERS > 0) {
+        const size_t workerThreads = THREADS > 0 ?
+            THREADS : std::max(std::thread::hardware_concurrency() / WORKERS, size_t(1));
+        std::vector<std::string> workerArgs{argv[0], "--threads", std::to_string(workerThreads)};
+        if (PACK_VERTICES)
+            workerArgs.push_back("--pack-vertices");
+        // Caught so the shared memory is unlinked while unwinding
+        try {
+            distributed = std::make_unique<DistributedRenderer>(
+                &jobs, workerArgs, WORKERS, RES, MSAA_SAMPLES, PIN_THREADS ? workerThreads : 0
+            );
+        } catch (const std::runtime_error& e) {
+            cerr << e.what() << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Do the scene
+    Renderer renderer(&jobs);
+    const glm::vec3 cameraEye(0.f, 50.f, 100.f);
+    const glm::vec3 cameraTarget(0.f, 25.f, 0.f);
+    const glm::vec3 cameraUp(0.f, 1.f, 0.f);
     Camera camera;
-    camera.lookAt(
-        glm::vec3(0.f, 50.f, 100.f),
-        glm::vec3(0.f, 25.f, 0.f),
-        glm::vec3(0.f, 1.f, 0.f)
-    );
+    camera.lookAt(cameraEye, cameraTarget, cameraUp);
     camera.perspective(glm::radians(59.f), float(RES.x) / RES.y, 0.1f, 500.f);
 
-    World world = loadGLTF(RES_DIRECTORY "res/the_noble_craftsman/scene.gltf");
+    // Eyes look the same way from either side of the camera and are drawn
+    // into halves of the frame
+    std::array<Camera, 2> eyeCameras;
+    std::vector<FrameBuffer> eyeBuffers;
+    if (STEREO) {
+        const glm::vec3 fwd = glm::normalize(cameraTarget - cameraEye);
+        const glm::vec3 right = glm::normalize(glm::cross(fwd, cameraUp));
+        const glm::uvec2 eyeRes(RES.x / 2, RES.y);
+        for (size_t i = 0; i < 2; ++i) {
+            const float side = i == 0 ? -0.5f : 0.5f;
+            eyeCameras[i].orient(cameraEye + right * (side * EYE_SEPARATION), fwd, cameraUp);
+            eyeCameras[i].perspective(glm::radians(59.f), float(eyeRes.x) / eyeRes.y, 0.1f, 500.f);
+            eyeBuffers.emplace_back(eyeRes, MSAA_SAMPLES);
+        }
+    }
+    std::array<Renderer::View, 2> eyeViews;
+    std::array<std::tuple<size_t, size_t>, 2> eyeCounts;
+    for (size_t i = 0; i < eyeBuffers.size(); ++i)
+        eyeViews[i] = {&eyeCameras[i], &eyeBuffers[i]};
+
+    // Rendering starts right away and the scene fills in as it loads
+    // Workers load the scene themselves
+    World world;
+    std::unique_ptr<WorldLoader> worldLoader;
+
+    // Geometry is paged in from a cache next to the scene when streaming
+    // A cache that still matches the scene replaces decoding its geometry
+    const std::string cachePath = SCENE_PATH + ".geom";
+    std::unique_ptr<GeometryCache> geometryCache;
+    if (distributed == nullptr && STREAM_BUDGET > 0) {
+        try {
+            geometryCache = std::make_unique<GeometryCache>(cachePath, PACK_VERTICES);
+        } catch (const std::runtime_error& e) {
+            // Missing, stale or from an older version
+            cout << e.what() << ", rebuilding it once the scene is in" << endl;
+        }
+    }
+    std::unique_ptr<ResidencyManager> residency;
+    // A missing cache is written in the background while the loaded scene is
+    // drawn from memory, nothing touches the geometry until it's opened
+    std::future<void> cacheWrite;
+    const auto startResidency = [&]{
+        residency = std::make_unique<ResidencyManager>(
+            &world, geometryCache.get(), STREAM_BUDGET << 20
+        );
+        renderer.setResidency(residency.get());
+    };
+
+    if (distributed == nullptr) {
+        worldLoader = std::make_unique<WorldLoader>(
+            SCENE_PATH, &jobs, PACK_VERTICES, geometryCache == nullptr
+        );
+    }
+    // Plays the first animation once the scene is in
+    std::unique_ptr<Animator> animator;
 
     Mesh bunny = loadOBJ(RES_DIRECTORY "res/bunny.obj");
     // Scale and center bunny
@@ -215,15 +396,42 @@ int main()
             offset
         );
 
+    bool occlusionCulling = true;
+    // Benchmarks should render every frame
+    bool frameReuse = !headless;
+    bool depthPrepass = DEPTH_PREPASS;
+    bool shadows = SHADOWS;
+    bool animate = true;
+    // Debug overlays
+    bool wireframe = WIREFRAME;
+    bool bounds = false;
+    bool hierarchy = false;
+    bool overlaid = false;
+
+    CommandList commands;
+    LineBatch lines;
+    MemoryTracker memory;
+
+    // Frames are drawn into a corner of the back buffer and scaled up
+    std::unique_ptr<DynamicResolution> resolution;
+    if (TARGET_MILLIS > 0.f)
+        resolution = std::make_unique<DynamicResolution>(RES, TARGET_MILLIS);
+
     Timer t;
     Timer gt;
-    while (!glfwWindowShouldClose(windowPtr)) {
-        glfwPollEvents();
-
-        // Init imgui frame
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
+    Timer memoryTimer;
+    size_t frame = 0;
+    float totalDrawTime = 0.f;
+    int exitStatus = EXIT_SUCCESS;
+    while (headless ? frame < HEADLESS_FRAMES : !glfwWindowShouldClose(windowPtr)) {
+        if (!headless) {
+            glfwPollEvents();
+
+            // Init imgui frame
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+        }
 
         // camera.lookAt(
         //     glm::vec3(0.f, 0.f, -gt.getSeconds()),
@@ -231,25 +439,194 @@ int main()
         //     glm::vec3(0.f, 1.f, 0.f)
         // );
 
-        // Setup frame buffer
-        t.reset();
-        fb.clearDepth(1.f);
-        fb.clear(Color(0, 0, 0));
-        float clearTime = t.getMillis();
+        // Lines aren't tracked between frames, so frames are drawn whole while
+        // there are any and once after they're gone
+        const bool overlay = wireframe || bounds || hierarchy;
+        renderer.setOcclusionCulling(occlusionCulling);
+        renderer.setFrameReuse(frameReuse && !overlay && !overlaid);
+        overlaid = overlay;
+        renderer.setDepthPrepass(depthPrepass);
+        renderer.setShadows(shadows);
+
+        if (worldLoader != nullptr) {
+            // The loader replaces the world's primitives, edges are only kept
+            // for them once it's done
+            lines.clearEdges();
+            const bool loaded = worldLoader->update(&world);
+            // Cached geometry streams in as soon as the scene graph is there
+            if (geometryCache != nullptr && residency == nullptr && !world.meshes.empty())
+                startResidency();
+            if (loaded) {
+                // Building the cache needs the whole scene
+                if (STREAM_BUDGET > 0 && geometryCache == nullptr) {
+                    cacheWrite = std::async(
+                        std::launch::async, writeGeometryCache, cachePath, std::cref(world),
+                        worldLoader->sourceFiles(), PACK_VERTICES
+                    );
+                }
+                worldLoader.reset();
+                if (!world.animations.empty() || !world.skins.empty())
+                    animator = std::make_unique<Animator>(&world, &jobs);
+            }
+        }
+        if (cacheWrite.valid() &&
+            cacheWrite.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            // A cache that failed to write or doesn't open leaves the scene
+            // drawn from memory
+            try {
+                cacheWrite.get();
+                geometryCache = std::make_unique<GeometryCache>(cachePath, PACK_VERTICES);
+                startResidency();
+            } catch (const std::runtime_error& e) {
+                cerr << "Geometry cache not written: " << e.what() << endl;
+            }
+        }
+        // Headless frames only start once the scene is in so captures and
+        // timings don't depend on how fast it loads
+        if (headless && (worldLoader != nullptr || cacheWrite.valid())) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            gt.reset();
+            continue;
+        }
+        // Last frame's requests
+        if (residency != nullptr)
+            residency->update();
+        // Skinning has to see the geometry residency left in
+        const float seconds = headless ? frame * HEADLESS_FRAME_SECONDS : gt.getSeconds();
+        if (animator != nullptr && animate)
+            animator->update(0, seconds);
+
+        commands.reset();
+        // commands.drawMesh(bunny, bunnyToWorld);
+        commands.drawWorld(world, animator.get());
+
+        lines.reset();
+        if (wireframe) {
+            lines.setState({true, WIREFRAME_DEPTH_BIAS});
+            lines.addWireframes(commands, green);
+        }
+        if (bounds) {
+            lines.setState(LineState());
+            lines.addBounds(commands, red);
+        }
+        if (hierarchy) {
+            // Whole hierarchy shows through the scene
+            lines.setState({false, 0.f});
+            lines.addHierarchy(world, animator.get());
+        }
 
-        t.reset();
-        // const auto [drawnTris, culledTris] = drawMesh(bunny, bunnyToWorld, camera, &fb);
-        const auto [drawnTris, culledTris] = drawWorld(world, camera, &fb);
-        float drawTime = t.getMillis();
+        // Unchanged frames show the last image again
+        FrameBuffer& fb = presenter->backBuffer();
+        if (resolution != nullptr)
+            fb.setRes(resolution->res());
+        float clearTime = 0.f;
+        float drawTime = 0.f;
+        float displayTime = 0.f;
+        size_t drawnTris = 0;
+        size_t culledTris = 0;
+        size_t drawnLines = 0;
+        bool drawn = false;
+        if (distributed != nullptr) {
+            // Workers clear and draw their parts, only merging happens here
+            t.reset();
+            const WorkerSettings settings{
+                occlusionCulling, frameReuse, depthPrepass, animate, seconds
+            };
+            // A failed worker ends the run through the regular shutdown so
+            // every worker is stopped and its shared memory unlinked
+            try {
+                std::tie(drawn, drawnTris, culledTris) = distributed->render(camera, settings, &fb);
+            } catch (const std::runtime_error& e) {
+                cerr << e.what() << endl;
+                exitStatus = EXIT_FAILURE;
+                if (!headless)
+                    ImGui::EndFrame();
+                break;
+            }
+            if (drawn)
+                fb.resolve();
+            drawTime = t.getMillis();
+        } else if (STEREO) {
+            // Views are drawn whole every frame
+            drawn = true;
+            t.reset();
+            const glm::uvec2 eyeRes(fb.res().x / 2, fb.res().y);
+            for (size_t i = 0; i < 2; ++i) {
+                eyeBuffers[i].setRes(eyeRes);
+                eyeBuffers[i].clear(Color(0, 0, 0));
+                eyeBuffers[i].clearDepth(1.f);
+            }
+            clearTime = t.getMillis();
+
+            t.reset();
+            renderer.executeViews(commands, eyeViews.data(), eyeViews.size(), eyeCounts.data());
+            for (const auto& [eyeDrawn, eyeCulled] : eyeCounts) {
+                drawnTris += eyeDrawn;
+                culledTris += eyeCulled;
+            }
+            for (size_t i = 0; i < 2; ++i) {
+                if (overlay)
+                    drawnLines += renderer.drawLines(lines, eyeCameras[i], &eyeBuffers[i]);
+                fb.copy(eyeBuffers[i], glm::uvec2(i * eyeRes.x, 0));
+            }
+            fb.resolve();
+            drawTime = t.getMillis();
+        } else if (renderer.beginFrame(commands, camera, fb)) {
+            drawn = true;
+            // Setup frame buffer
+            t.reset();
+            renderer.clear(Color(0, 0, 0), 1.f, &fb);
+            clearTime = t.getMillis();
+
+            t.reset();
+            std::tie(drawnTris, culledTris) = renderer.execute(commands, camera, &fb);
+            if (overlay)
+                drawnLines = renderer.drawLines(lines, camera, &fb);
+            renderer.resolve(&fb);
+            drawTime = t.getMillis();
+        }
 
-        t.reset();
-        fb.display();
-        float displayTime = t.getMillis();
+        if (drawn) {
+            totalDrawTime += drawTime;
+            if (resolution != nullptr)
+                resolution->update(clearTime + drawTime);
+
+            // Previous frame gets displayed here while this one is written out
+            t.reset();
+            presenter->present();
+            displayTime = t.getMillis();
+        } else
+            presenter->repeat();
+
+        // The report file tracks peaks so it needs every frame, the window
+        // only a few a second and headless runs without one none at all
+        const bool reportMemory =
+            memoryReportPath != nullptr ||
+            (!headless && (frame == 0 || memoryTimer.getSeconds() > MEMORY_WINDOW_SECONDS));
+        if (reportMemory) {
+            memoryTimer.reset();
+            MemoryReport report;
+            report.addWorld(world);
+            if (animator != nullptr)
+                report.add(MemoryCategory::Vertices, animator->memoryUsage());
+            report.add(MemoryCategory::FrameBuffers, presenter->memoryUsage());
+            for (const auto& eyeBuffer : eyeBuffers)
+                report.add(MemoryCategory::FrameBuffers, eyeBuffer.memoryUsage());
+            if (distributed != nullptr)
+                report.add(MemoryCategory::FrameBuffers, distributed->memoryUsage());
+            report.add(MemoryCategory::RenderScratch, renderer.memoryUsage());
+            report.add(MemoryCategory::RenderScratch, lines.memoryUsage());
+            memory.update(std::move(report));
+        }
+
+        frame++;
+        if (headless)
+            continue;
 
         // Draw profiler
         {
             ImGui::SetNextWindowPos(ImVec2(48, 48), ImGuiCond_Once);
-            ImGui::SetNextWindowSize(ImVec2(300, 64), ImGuiCond_Once);
+            ImGui::SetNextWindowSize(ImVec2(300, 210), ImGuiCond_Once);
 
             ImGui::Begin("MainWindow", nullptr, mainWindowFlags);
 
@@ -261,7 +638,53 @@ int main()
                 "clear %.2fms draw %.2fms display %.2fms",
                 clearTime, drawTime, displayTime
             );
-            ImGui::Text("avg frame %.2fms", 1000.f / ImGui::GetIO().Framerate);
+            ImGui::Text(
+                "avg frame %.2fms at %ux%u",
+                1000.f / ImGui::GetIO().Framerate, fb.res().x, fb.res().y
+            );
+            ImGui::Checkbox("Occlusion culling", &occlusionCulling);
+            ImGui::Checkbox("Frame reuse", &frameReuse);
+            ImGui::Checkbox("Depth prepass", &depthPrepass);
+            if (distributed == nullptr)
+                ImGui::Checkbox("Shadows", &shadows);
+            ImGui::Checkbox("Animate", &animate);
+            ImGui::Checkbox("Wireframe", &wireframe);
+            ImGui::SameLine();
+            ImGui::Checkbox("Bounds", &bounds);
+            ImGui::SameLine();
+            ImGui::Checkbox("Hierarchy", &hierarchy);
+            if (overlay)
+                ImGui::Text("%zu lines drawn", drawnLines);
+
+            ImGui::End();
+        }
+
+        // Draw memory footprint
+        {
+            ImGui::SetNextWindowPos(ImVec2(48, 270), ImGuiCond_Once);
+            ImGui::SetNextWindowSize(ImVec2(300, 200), ImGuiCond_Once);
+
+            ImGui::Begin("Memory");
+
+            const MemoryReport& report = memory.current();
+            const MemoryUsage total = report.total();
+            ImGui::Text(
+                "steady state %.2fMB peak %.2fMB wasted %.2fMB",
+                megabytes(total.reserved), megabytes(memory.peakTotal()),
+                megabytes(total.wasted())
+            );
+            ImGui::Separator();
+            for (size_t i = 0; i < MEMORY_CATEGORY_COUNT; ++i) {
+                const auto category = static_cast<MemoryCategory>(i);
+                const MemoryUsage& usage = report.categories[i];
+                ImGui::Text(
+                    "%s %.2fMB peak %.2fMB wasted %.2fMB",
+                    memoryCategoryName(category), megabytes(usage.reserved),
+                    megabytes(memory.peak(category)), megabytes(usage.wasted())
+                );
+            }
+            memoryTree("Meshes", report.meshes);
+            memoryTree("Textures", report.textures);
 
             ImGui::End();
         }
@@ -273,6 +696,27 @@ int main()
         glfwSwapBuffers(windowPtr);
     }
 
+    if (memoryReportPath != nullptr)
+        memory.writeJson(memoryReportPath);
+
+    // exit() skips destructors, the cache write would be cut off mid-file
+    if (cacheWrite.valid())
+        cacheWrite.wait();
+    // Workers are stopped and their shared memory unlinked
+    distributed.reset();
+    // Last frames can still fail, the destructor can't tell
+    presenter->flush();
+    // GL resources need to go before the context
+    presenter.reset();
+
+    if (headless) {
+        printf(
+            "%zu frames in %.2fs, avg draw %.2fms\n",
+            frame, gt.getSeconds(), totalDrawTime / std::max(frame, size_t(1))
+        );
+        exit(exitStatus);
+    }
+
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
@@ -280,5 +724,5 @@ int main()
     glfwDestroyWindow(windowPtr);
     glfwTerminate();
 
-    exit(EXIT_SUCCESS);
+    exit(exitStatus);
 }
@@ -0,0 +1,151 @@
+#include "memoryReport.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include "world.hpp"
+
+namespace {
+    MemoryUsage primitiveUsage(const Primitive& primitive, MemoryUsage* indices)
+    {
+        MemoryUsage usage;
+        usage.add(primitive.positions);
+        usage.add(primitive.normals);
+        usage.add(primitive.tangents);
+        usage.add(primitive.texCoord0s);
+        usage.add(primitive.packed.positions);
+        usage.add(primitive.packed.normals);
+        usage.add(primitive.packed.tangents);
+        usage.add(primitive.packed.texCoord0s);
+        usage.add(primitive.joints);
+        usage.add(primitive.weights);
+        indices->add(primitive.tris);
+        return usage;
+    }
+
+    void writeUsage(std::ofstream& file, const MemoryUsage& usage)
+    {
+        file << "{\"used\": " << usage.used
+             << ", \"reserved\": " << usage.reserved
+             << ", \"wasted\": " << usage.wasted() << "}";
+    }
+
+    void writeUsages(std::ofstream& file, const std::vector<MemoryUsage>& usages)
+    {
+        file << "[";
+        for (size_t i = 0; i < usages.size(); ++i) {
+            file << (i > 0 ? ",\n    " : "\n    ");
+            writeUsage(file, usages[i]);
+        }
+        file << (usages.empty() ? "]" : "\n  ]");
+    }
+}
+
+const char* memoryCategoryName(MemoryCategory category)
+{
+    switch (category) {
+    case MemoryCategory::Textures:
+        return "textures";
+    case MemoryCategory::Vertices:
+        return "vertices";
+    case MemoryCategory::Indices:
+        return "indices";
+    case MemoryCategory::FrameBuffers:
+        return "frameBuffers";
+    case MemoryCategory::RenderScratch:
+        return "renderScratch";
+    default:
+        return "unknown";
+    }
+}
+
+void MemoryReport::addWorld(const World& world)
+{
+    meshes.clear();
+    for (const auto& mesh : world.meshes) {
+        MemoryUsage vertices;
+        MemoryUsage indices;
+        for (const auto& primitive : mesh.primitives)
+            vertices.add(primitiveUsage(primitive, &indices));
+        add(MemoryCategory::Vertices, vertices);
+        add(MemoryCategory::Indices, indices);
+
+        vertices.add(indices);
+        meshes.push_back(vertices);
+    }
+
+    textures.clear();
+    for (const auto& texture : world.textures) {
+        const MemoryUsage usage = texture.memoryUsage();
+        add(MemoryCategory::Textures, usage);
+        textures.push_back(usage);
+    }
+}
+
+void MemoryReport::add(MemoryCategory category, const MemoryUsage& usage)
+{
+    categories[static_cast<size_t>(category)].add(usage);
+}
+
+MemoryUsage MemoryReport::total() const
+{
+    MemoryUsage usage;
+    for (const auto& category : categories)
+        usage.add(category);
+    return usage;
+}
+
+void MemoryTracker::update(MemoryReport report)
+{
+    _current = std::move(report);
+    for (size_t i = 0; i < MEMORY_CATEGORY_COUNT; ++i)
+        _peaks[i] = std::max(_peaks[i], _current.categories[i].reserved);
+    _peakTotal = std::max(_peakTotal, _current.total().reserved);
+}
+
+const MemoryReport& MemoryTracker::current() const
+{
+    return _current;
+}
+
+size_t MemoryTracker::peak(MemoryCategory category) const
+{
+    return _peaks[static_cast<size_t>(category)];
+}
+
+size_t MemoryTracker::peakTotal() const
+{
+    return _peakTotal;
+}
+
+void MemoryTracker::writeJson(const std::string& path) const
+{
+    std::ofstream file(path);
+    if (!file)
+        throw std::runtime_error("Failed to open " + path + " for writing");
+
+    // Loading buffers and momentary copies aren't in the reports
+    file << "{\n  \"scope\": \"steadyState\",\n  \"total\": ";
+    writeUsage(file, _current.total());
+    file << ",\n  \"peakTotal\": " << _peakTotal;
+
+    file << ",\n  \"categories\": {";
+    for (size_t i = 0; i < MEMORY_CATEGORY_COUNT; ++i) {
+        const MemoryUsage& usage = _current.categories[i];
+        file << (i > 0 ? ",\n    \"" : "\n    \"")
+             << memoryCategoryName(static_cast<MemoryCategory>(i))
+             << "\": {\"used\": " << usage.used
+             << ", \"reserved\": " << usage.reserved
+             << ", \"wasted\": " << usage.wasted()
+             << ", \"peak\": " << _peaks[i] << "}";
+    }
+    file << "\n  },\n  \"meshes\": ";
+    writeUsages(file, _current.meshes);
+    file << ",\n  \"textures\": ";
+    writeUsages(file, _current.textures);
+    file << "\n}\n";
+
+    if (!file)
+        throw std::runtime_error("Failed to write " + path);
+}
@@ -0,0 +1,190 @@
+#include "mesh.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <cstring>
+
+namespace {
+    const float UNORM16_MAX = 65535.f;
+
+    glm::i16vec2 packOctahedral(const glm::vec3& n)
+    {
+        // Degenerate or NaN vectors would divide 0/0, store them as +z
+        const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+        if (!(l1 > 0.f))
+            return glm::i16vec2(0);
+
+        glm::vec2 p = glm::vec2(n) / l1;
+        // Fold the lower hemisphere over the diagonals
+        if (n.z < 0.f) {
+            p = glm::vec2(
+                (1.f - std::abs(p.y)) * (p.x >= 0.f ? 1.f : -1.f),
+                (1.f - std::abs(p.x)) * (p.y >= 0.f ? 1.f : -1.f)
+            );
+        }
+        return glm::i16vec2(
+            static_cast<int16_t>(glm::packSnorm1x16(p.x)),
+            static_cast<int16_t>(glm::packSnorm1x16(p.y))
+        );
+    }
+
+    // Calls fn with each unpacked per-vertex attribute
+    template<typename Fn>
+    void forEachAttribute(Primitive* primitive, const Fn& fn)
+    {
+        fn(&primitive->positions);
+        fn(&primitive->normals);
+        fn(&primitive->tangents);
+        fn(&primitive->texCoord0s);
+        fn(&primitive->joints);
+        fn(&primitive->weights);
+    }
+
+    // FNV-1a over the attributes of vertex v
+    size_t vertexHash(Primitive* primitive, size_t v)
+    {
+        size_t hash = 14695981039346656037ull;
+        forEachAttribute(primitive, [&](const auto* values){
+            if (values->empty())
+                return;
+            const auto* bytes = reinterpret_cast<const uint8_t*>(&(*values)[v]);
+            for (size_t i = 0; i < sizeof((*values)[v]); ++i)
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+        });
+        return hash;
+    }
+
+    // Bitwise so that welding never changes what gets drawn
+    bool sameVertex(Primitive* primitive, size_t a, size_t b)
+    {
+        bool same = true;
+        forEachAttribute(primitive, [&](const auto* values){
+            if (same && !values->empty())
+                same = std::memcmp(&(*values)[a], &(*values)[b], sizeof((*values)[a])) == 0;
+        });
+        return same;
+    }
+}
+
+size_t vertexCount(const Primitive& primitive)
+{
+    return primitive.positions.empty() ?
+        primitive.packed.positions.size() : primitive.positions.size();
+}
+
+bool hasNormals(const Primitive& primitive)
+{
+    return !primitive.normals.empty() || !primitive.packed.normals.empty();
+}
+
+void swapGeometry(Primitive* a, Primitive* b)
+{
+    a->positions.swap(b->positions);
+    a->normals.swap(b->normals);
+    a->tangents.swap(b->tangents);
+    a->texCoord0s.swap(b->texCoord0s);
+    a->tris.swap(b->tris);
+    a->packed.positions.swap(b->packed.positions);
+    a->packed.normals.swap(b->packed.normals);
+    a->packed.tangents.swap(b->packed.tangents);
+    a->packed.texCoord0s.swap(b->packed.texCoord0s);
+    a->joints.swap(b->joints);
+    a->weights.swap(b->weights);
+}
+
+void weldVertices(Primitive* primitive)
+{
+    const size_t count = primitive->positions.size();
+    bool matching = true;
+    forEachAttribute(primitive, [&](const auto* values){
+        matching = matching && (values->empty() || values->size() == count);
+    });
+    if (count == 0 || !matching)
+        return;
+
+    // Open addressing table of welded vertices, at most half full
+    size_t tableSize = 1;
+    while (tableSize < count * 2)
+        tableSize *= 2;
+    std::vector<size_t> table(tableSize, SIZE_MAX);
+
+    // Unique vertices are compacted in place, the ones before v are already
+    // welded and v itself is still untouched
+    std::vector<size_t> remap(count);
+    size_t welded = 0;
+    for (size_t v = 0; v < count; ++v) {
+        size_t slot = vertexHash(primitive, v) & (tableSize - 1);
+        while (table[slot] != SIZE_MAX && !sameVertex(primitive, table[slot], v))
+            slot = (slot + 1) & (tableSize - 1);
+
+        if (table[slot] == SIZE_MAX) {
+            forEachAttribute(primitive, [&](auto* values){
+                if (!values->empty())
+                    (*values)[welded] = (*values)[v];
+            });
+            table[slot] = welded;
+            remap[v] = welded++;
+        } else
+            remap[v] = table[slot];
+    }
+    if (welded == count)
+        return;
+
+    forEachAttribute(primitive, [&](auto* values){
+        if (!values->empty()) {
+            values->resize(welded);
+            values->shrink_to_fit();
+        }
+    });
+
+    std::vector<TriIndices> tris;
+    tris.reserve(primitive->tris.size());
+    for (const auto& tri : primitive->tris) {
+        const TriIndices t(remap[tri.v0], remap[tri.v1], remap[tri.v2]);
+        if (t.v0 != t.v1 && t.v1 != t.v2 && t.v2 != t.v0)
+            tris.push_back(t);
+    }
+    primitive->tris = std::move(tris);
+}
+
+void packVertices(Primitive* primitive)
+{
+    PackedVertices packed;
+
+    const glm::vec3 extent = primitive->max - primitive->min;
+    const glm::vec3 scale = glm::vec3(UNORM16_MAX) / glm::max(extent, glm::vec3(1e-20f));
+    packed.positions.reserve(primitive->positions.size());
+    for (const auto& p : primitive->positions) {
+        const glm::vec3 q = glm::clamp(glm::round((p - primitive->min) * scale), 0.f, UNORM16_MAX);
+        packed.positions.emplace_back(q);
+    }
+
+    packed.normals.reserve(primitive->normals.size());
+    for (const auto& n : primitive->normals)
+        packed.normals.push_back(packOctahedral(n));
+
+    packed.tangents.reserve(primitive->tangents.size());
+    for (const auto& t : primitive->tangents) {
+        glm::i16vec2 p = packOctahedral(glm::vec3(t));
+        p.y = static_cast<int16_t>((p.y & ~1) | (t.w < 0.f ? 1 : 0));
+        packed.tangents.push_back(p);
+    }
+
+    packed.texCoord0s.reserve(primitive->texCoord0s.size());
+    for (const auto& uv : primitive->texCoord0s)
+        packed.texCoord0s.emplace_back(glm::packHalf1x16(uv.x), glm::packHalf1x16(uv.y));
+
+    primitive->packed = std::move(packed);
+    std::vector<glm::vec3>().swap(primitive->positions);
+    std::vector<glm::vec3>().swap(primitive->normals);
+    std::vector<glm::vec4>().swap(primitive->tangents);
+    std::vector<glm::vec2>().swap(primitive->texCoord0s);
+}
+
+glm::mat4 unpackPositionTransform(const Primitive& primitive)
+{
+    const glm::vec3 extent = primitive.max - primitive.min;
+    return glm::scale(
+        glm::translate(glm::mat4(1.f), primitive.min),
+        extent / UNORM16_MAX
+    );
+}
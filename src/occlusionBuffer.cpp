@@ -0,0 +1,133 @@
+#include "occlusionBuffer.hpp"
+
+#include <algorithm>
+#include <limits>
+
+OcclusionBuffer::OcclusionBuffer(const glm::uvec2& res) :
+    _res(res),
+    _tiles((res + TILE_SIZE - 1u) / TILE_SIZE),
+    _maxDepth(_tiles.x * _tiles.y, 1.f),
+    _dirty(_tiles.x * _tiles.y, 0)
+{ }
+
+const glm::uvec2& OcclusionBuffer::res() const
+{
+    return _res;
+}
+
+void OcclusionBuffer::setRes(const glm::uvec2& res)
+{
+    _res = res;
+    _tiles = (res + TILE_SIZE - 1u) / TILE_SIZE;
+    _maxDepth.assign(_tiles.x * _tiles.y, 1.f);
+    _dirty.assign(_tiles.x * _tiles.y, 0);
+}
+
+void OcclusionBuffer::clear()
+{
+    std::fill(_maxDepth.begin(), _maxDepth.end(), 1.f);
+    std::fill(_dirty.begin(), _dirty.end(), 0);
+}
+
+bool OcclusionBuffer::project(const glm::vec3& min, const glm::vec3& max, const glm::mat4& modelToClip, const glm::uvec2& res, ScreenRect* rect)
+{
+    rect->min = glm::vec2(std::numeric_limits<float>::max());
+    rect->max = glm::vec2(std::numeric_limits<float>::lowest());
+    rect->depth = std::numeric_limits<float>::max();
+
+    const glm::vec2 halfRes(glm::vec2(res) / 2.f);
+    for (uint32_t i = 0; i < 8; ++i) {
+        const glm::vec3 corner(
+            i & 1 ? max.x : min.x,
+            i & 2 ? max.y : min.y,
+            i & 4 ? max.z : min.z
+        );
+        const glm::vec4 clipP = modelToClip * glm::vec4(corner, 1.f);
+        if (clipP.w <= 0.f)
+            return false;
+
+        const glm::vec3 ndcP = glm::vec3(clipP) / clipP.w;
+        const glm::vec2 windowP = (glm::vec2(ndcP) + 1.f) * halfRes;
+        rect->min = glm::min(rect->min, windowP);
+        rect->max = glm::max(rect->max, windowP);
+        rect->depth = std::min(rect->depth, ndcP.z);
+    }
+
+    return true;
+}
+
+bool OcclusionBuffer::visible(const ScreenRect& rect, const FrameBuffer& fb)
+{
+    // Outside the viewport or beyond the far plane
+    if (rect.max.x < 0.f || rect.max.y < 0.f ||
+        rect.min.x >= _res.x || rect.min.y >= _res.y ||
+        rect.depth > 1.f)
+        return false;
+
+    const glm::uvec2 tMin = tileMin(rect);
+    const glm::uvec2 tMax = tileMax(rect);
+    for (uint32_t y = tMin.y; y < tMax.y; ++y) {
+        for (uint32_t x = tMin.x; x < tMax.x; ++x) {
+            if (rect.depth < tileDepth(glm::uvec2(x, y), fb))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+void OcclusionBuffer::invalidate(const ScreenRect& rect)
+{
+    if (rect.max.x < 0.f || rect.max.y < 0.f ||
+        rect.min.x >= _res.x || rect.min.y >= _res.y)
+        return;
+
+    const glm::uvec2 tMin = tileMin(rect);
+    const glm::uvec2 tMax = tileMax(rect);
+    for (uint32_t y = tMin.y; y < tMax.y; ++y)
+        std::fill(&_dirty[y * _tiles.x + tMin.x], &_dirty[y * _tiles.x + tMax.x], 1);
+}
+
+void OcclusionBuffer::invalidateAll()
+{
+    std::fill(_dirty.begin(), _dirty.end(), 1);
+}
+
+MemoryUsage OcclusionBuffer::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.add(_maxDepth);
+    usage.add(_dirty);
+    return usage;
+}
+
+glm::uvec2 OcclusionBuffer::tileMin(const ScreenRect& rect) const
+{
+    const glm::vec2 p = glm::max(glm::floor(rect.min), glm::vec2(0.f));
+    return glm::uvec2(p) / TILE_SIZE;
+}
+
+glm::uvec2 OcclusionBuffer::tileMax(const ScreenRect& rect) const
+{
+    const glm::vec2 p = glm::min(glm::ceil(rect.max), glm::vec2(_res));
+    return (glm::uvec2(p) + TILE_SIZE - 1u) / TILE_SIZE;
+}
+
+float OcclusionBuffer::tileDepth(const glm::uvec2& tile, const FrameBuffer& fb)
+{
+    const size_t i = tile.y * _tiles.x + tile.x;
+    if (_dirty[i]) {
+        const glm::uvec2 pMin = tile * TILE_SIZE;
+        const glm::uvec2 pMax = glm::min(pMin + TILE_SIZE, _res);
+        float maxDepth = 0.f;
+        for (uint32_t y = pMin.y; y < pMax.y; ++y) {
+            for (uint32_t x = pMin.x; x < pMax.x; ++x) {
+                for (uint32_t s = 0; s < fb.samples(); ++s)
+                    maxDepth = std::max(maxDepth, fb.depth(glm::ivec2(x, y), s));
+            }
+        }
+        _maxDepth[i] = maxDepth;
+        _dirty[i] = 0;
+    }
+    return _maxDepth[i];
+}
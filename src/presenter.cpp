@@ -0,0 +1,493 @@
+#include "presenter.hpp"
+
+#include <stb_image_write.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+    void encodePpm(const glm::uvec2& res, const std::vector<Color>& pixels, std::vector<uint8_t>* out)
+    {
+        const std::string header =
+            "P6\n" + std::to_string(res.x) + " " + std::to_string(res.y) + "\n255\n";
+        out->assign(header.begin(), header.end());
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(pixels.data());
+        out->insert(out->end(), bytes, bytes + res.x * res.y * sizeof(Color));
+    }
+
+    // See https://qoiformat.org/qoi-specification.pdf
+    void encodeQoi(const glm::uvec2& res, const std::vector<Color>& pixels, std::vector<uint8_t>* out)
+    {
+        const auto put32 = [&](uint32_t value){
+            for (int32_t shift = 24; shift >= 0; shift -= 8)
+                out->push_back(static_cast<uint8_t>(value >> shift));
+        };
+
+        out->clear();
+        out->insert(out->end(), {'q', 'o', 'i', 'f'});
+        put32(res.x);
+        put32(res.y);
+        // RGB, sRGB
+        out->push_back(3);
+        out->push_back(0);
+
+        // Opaque colors as rgba so they never match the zeroed entries
+        std::array<uint32_t, 64> seen{};
+        Color prev(0, 0, 0);
+        uint32_t run = 0;
+        const size_t count = res.x * res.y;
+        for (size_t i = 0; i < count; ++i) {
+            const Color& px = pixels[i];
+            if (px.r == prev.r && px.g == prev.g && px.b == prev.b) {
+                if (++run == 62 || i + 1 == count) {
+                    out->push_back(0xc0 | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                out->push_back(0xc0 | (run - 1));
+                run = 0;
+            }
+
+            const uint32_t rgba = px.r << 24 | px.g << 16 | px.b << 8 | 0xff;
+            const size_t hash = (px.r * 3 + px.g * 5 + px.b * 7 + 255 * 11) % 64;
+            if (seen[hash] == rgba)
+                out->push_back(static_cast<uint8_t>(hash));
+            else {
+                seen[hash] = rgba;
+                const int32_t dr = static_cast<int8_t>(px.r - prev.r);
+                const int32_t dg = static_cast<int8_t>(px.g - prev.g);
+                const int32_t db = static_cast<int8_t>(px.b - prev.b);
+                const int32_t drDg = dr - dg;
+                const int32_t dbDg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                    out->push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                else if (dg >= -32 && dg <= 31 && drDg >= -8 && drDg <= 7 && dbDg >= -8 && dbDg <= 7) {
+                    out->push_back(0x80 | (dg + 32));
+                    out->push_back((drDg + 8) << 4 | (dbDg + 8));
+                } else
+                    out->insert(out->end(), {0xfe, px.r, px.g, px.b});
+            }
+            prev = px;
+        }
+
+        out->insert(out->end(), {0, 0, 0, 0, 0, 0, 0, 1});
+    }
+
+    void encodePng(const glm::uvec2& res, const std::vector<Color>& pixels, std::vector<uint8_t>* out)
+    {
+        out->clear();
+        const auto append = [](void* context, void* data, int size){
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            static_cast<std::vector<uint8_t>*>(context)->insert(
+                static_cast<std::vector<uint8_t>*>(context)->end(), bytes, bytes + size
+            );
+        };
+        if (!stbi_write_png_to_func(append, out, res.x, res.y, 3, pixels.data(), res.x * sizeof(Color)))
+            throw std::runtime_error("Failed to encode png");
+    }
+
+    template<typename T>
+    MemoryUsage vectorUsage(const std::vector<T>& values)
+    {
+        MemoryUsage usage;
+        usage.add(values);
+        return usage;
+    }
+
+    // Moves running totals by how much a buffer changed since before, the
+    // subtraction wraps around when it shrank
+    template<typename T>
+    void trackUsage(
+        const MemoryUsage& before,
+        const std::vector<T>& values,
+        std::atomic<size_t>* used,
+        std::atomic<size_t>* reserved
+    )
+    {
+        const MemoryUsage after = vectorUsage(values);
+        *used += after.used - before.used;
+        *reserved += after.reserved - before.reserved;
+    }
+}
+
+Presenter::Presenter(
+    std::unique_ptr<PresentBackend> backend,
+    const glm::uvec2& res,
+    uint32_t samples,
+    size_t bufferCount
+) :
+    _backend(std::move(backend))
+{
+    if (bufferCount < 2)
+        throw std::runtime_error("Presenter needs at least two buffers");
+
+    _buffers.reserve(bufferCount);
+    for (size_t i = 0; i < bufferCount; ++i)
+        _buffers.emplace_back(res, samples);
+
+    _worker = std::thread([this]{ work(); });
+}
+
+Presenter::~Presenter()
+{
+    // Errors are only reported by an explicit flush()
+    try {
+        flush();
+    } catch (...) { }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _queued.notify_one();
+    _worker.join();
+}
+
+FrameBuffer& Presenter::backBuffer()
+{
+    return _buffers[_current];
+}
+
+void Presenter::present()
+{
+    _backend->begin(_current);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(_current);
+    }
+    _queued.notify_one();
+    _inFlight.push_back({_current, _presented++});
+
+    // Next back buffer is free once at most the other ones are in flight
+    while (_inFlight.size() > _buffers.size() - 1)
+        retireOldest();
+
+    _current = (_current + 1) % _buffers.size();
+}
+
+void Presenter::repeat()
+{
+    // Frames still in flight end up on screen as they finish
+    if (!_inFlight.empty()) {
+        while (!_inFlight.empty())
+            retireOldest();
+    } else
+        _backend->repeat();
+}
+
+void Presenter::flush()
+{
+    while (!_inFlight.empty())
+        retireOldest();
+    _backend->flush();
+}
+
+MemoryUsage Presenter::memoryUsage() const
+{
+    MemoryUsage usage;
+    for (const auto& buffer : _buffers)
+        usage.add(buffer.memoryUsage());
+    usage.add(_backend->memoryUsage());
+    return usage;
+}
+
+void Presenter::retireOldest()
+{
+    const InFlight oldest = _inFlight.front();
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _written.wait(lock, [&]{ return _writtenFrames > oldest.frame; });
+        error = _error;
+    }
+    _inFlight.pop_front();
+    if (error)
+        std::rethrow_exception(error);
+    _backend->end(oldest.slot);
+}
+
+void Presenter::work()
+{
+    while (true) {
+        size_t slot;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _queued.wait(lock, [&]{ return _stop || !_queue.empty(); });
+            if (_queue.empty())
+                return;
+            slot = _queue.front();
+            _queue.pop_front();
+        }
+
+        // Errors go to the render thread, the frame still counts as written
+        // so nothing waits on it forever
+        std::exception_ptr error;
+        try {
+            _backend->write(_buffers[slot], slot);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (error && !_error)
+                _error = error;
+            _writtenFrames++;
+        }
+        _written.notify_one();
+    }
+}
+
+GLPresentBackend::GLPresentBackend(const glm::uvec2& res, const glm::uvec2& outRes, size_t bufferCount) :
+    _res(res),
+    _outRes(outRes),
+    _byteSize(res.x * res.y * sizeof(Color)),
+    _slotRes(bufferCount, res),
+    _shownRes(res),
+    _pbos(bufferCount),
+    _mapped(bufferCount, nullptr)
+{
+    glGenFramebuffers(1, &_fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _fbo);
+
+    // Storage is allocated once, frames are streamed in with glTexSubImage2D
+    glGenTextures(1, &_textureID);
+    glBindTexture(GL_TEXTURE_2D, _textureID);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, _res.x, _res.y, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Bind to fbo
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _textureID, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+
+    // Rows of Color aren't padded
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    glGenBuffers(_pbos.size(), _pbos.data());
+    for (const GLuint pbo : _pbos) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, _byteSize, nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+GLPresentBackend::~GLPresentBackend()
+{
+    for (size_t i = 0; i < _pbos.size(); ++i) {
+        if (_mapped[i] != nullptr) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbos[i]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(_pbos.size(), _pbos.data());
+    glDeleteFramebuffers(1, &_fbo);
+    glDeleteTextures(1, &_textureID);
+}
+
+void GLPresentBackend::begin(size_t slot)
+{
+    // Invalidating lets the driver hand out fresh storage instead of waiting
+    // on a pending upload from the buffer
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbos[slot]);
+    _mapped[slot] = glMapBufferRange(
+        GL_PIXEL_UNPACK_BUFFER,
+        0,
+        _byteSize,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT
+    );
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (_mapped[slot] == nullptr)
+        throw std::runtime_error("Failed to map pixel buffer");
+}
+
+void GLPresentBackend::write(const FrameBuffer& fb, size_t slot)
+{
+    const glm::uvec2& res = fb.res();
+    if (res.x > _res.x || res.y > _res.y)
+        throw std::runtime_error("Frame doesn't fit the present texture");
+
+    _slotRes[slot] = res;
+    memcpy(_mapped[slot], fb.pixels().data(), res.x * res.y * sizeof(Color));
+}
+
+void GLPresentBackend::end(size_t slot)
+{
+    // Upload is sourced from the pbo so the call returns without waiting for it
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbos[slot]);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    _mapped[slot] = nullptr;
+    glBindTexture(GL_TEXTURE_2D, _textureID);
+    _shownRes = _slotRes[slot];
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _shownRes.x, _shownRes.y, GL_RGB, GL_UNSIGNED_BYTE, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    blit();
+}
+
+void GLPresentBackend::repeat()
+{
+    // Texture still holds the last frame
+    blit();
+}
+
+void GLPresentBackend::blit()
+{
+    // Blit to default buffer
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, _fbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    // Linear filtering hides the steps of lowered resolutions better
+    const GLenum filter = _shownRes == _res ? GL_NEAREST : GL_LINEAR;
+    glBlitFramebuffer(0, 0, _shownRes.x, _shownRes.y, 0, 0, _outRes.x, _outRes.y, GL_COLOR_BUFFER_BIT, filter);
+}
+
+void NullPresentBackend::write(const FrameBuffer& fb, size_t slot)
+{
+    (void) fb;
+    (void) slot;
+}
+
+FilePresentBackend::FilePresentBackend(const std::string& directory, ImageFormat format, uint32_t threadCount) :
+    _directory(directory),
+    _format(format)
+{
+    if (threadCount == 0)
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+    // One frame to encode and one to copy into per thread
+    _bufferCount = 2 * threadCount;
+    for (size_t i = 0; i < _bufferCount; ++i)
+        _free.push_back(std::make_unique<Frame>());
+    for (uint32_t i = 0; i < threadCount; ++i)
+        _threads.emplace_back([this]{ work(); });
+}
+
+FilePresentBackend::~FilePresentBackend()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _queued.notify_all();
+    for (auto& thread : _threads)
+        thread.join();
+}
+
+void FilePresentBackend::write(const FrameBuffer& fb, size_t slot)
+{
+    (void) slot;
+
+    std::unique_ptr<Frame> frame;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _recycled.wait(lock, [&]{ return !_free.empty() || _error; });
+        if (_error)
+            std::rethrow_exception(_error);
+        frame = std::move(_free.back());
+        _free.pop_back();
+    }
+
+    frame->index = _frame++;
+    frame->res = fb.res();
+    const MemoryUsage before = vectorUsage(frame->pixels);
+    frame->pixels.resize(frame->res.x * frame->res.y);
+    trackUsage(before, frame->pixels, &_usedBytes, &_reservedBytes);
+    // Window coordinates start from the bottom-left
+    const Color* rows = fb.pixels().data();
+    for (uint32_t y = 0; y < frame->res.y; ++y) {
+        std::copy_n(
+            &rows[(frame->res.y - 1 - y) * frame->res.x],
+            frame->res.x,
+            &frame->pixels[y * frame->res.x]
+        );
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(std::move(frame));
+    }
+    _queued.notify_one();
+}
+
+void FilePresentBackend::flush()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _recycled.wait(lock, [&]{ return _free.size() == _bufferCount; });
+    if (_error)
+        std::rethrow_exception(_error);
+}
+
+MemoryUsage FilePresentBackend::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.reserved = _reservedBytes;
+    // The totals are updated one after the other
+    usage.used = std::min(size_t(_usedBytes), usage.reserved);
+    return usage;
+}
+
+void FilePresentBackend::work()
+{
+    // Reused between frames like the frames themselves
+    std::vector<uint8_t> encoded;
+    while (true) {
+        std::unique_ptr<Frame> frame;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            // Queued frames are still written when stopping
+            _queued.wait(lock, [&]{ return _stop || !_queue.empty(); });
+            if (_queue.empty())
+                return;
+            frame = std::move(_queue.front());
+            _queue.pop_front();
+        }
+
+        const MemoryUsage before = vectorUsage(encoded);
+        try {
+            const char* extension = nullptr;
+            switch (_format) {
+            case ImageFormat::Ppm:
+                encodePpm(frame->res, frame->pixels, &encoded);
+                extension = "ppm";
+                break;
+            case ImageFormat::Qoi:
+                encodeQoi(frame->res, frame->pixels, &encoded);
+                extension = "qoi";
+                break;
+            case ImageFormat::Png:
+                encodePng(frame->res, frame->pixels, &encoded);
+                extension = "png";
+                break;
+            }
+
+            char filename[32];
+            snprintf(filename, 32, "frame_%05zu.%s", frame->index, extension);
+            std::ofstream file(_directory + "/" + filename, std::ios::binary);
+            if (!file.is_open())
+                throw std::runtime_error("Failed to open frame output");
+            file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+            if (!file)
+                throw std::runtime_error("Failed to write frame output");
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_error)
+                _error = std::current_exception();
+        }
+        trackUsage(before, encoded, &_usedBytes, &_reservedBytes);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _free.push_back(std::move(frame));
+        }
+        _recycled.notify_all();
+    }
+}
@@ -0,0 +1,1267 @@
+#include "renderer.hpp"
+
+#include <glm/gtc/matrix_access.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <new>
+#include <numeric>
+
+namespace {
+    const glm::vec3 LIGHT_DIR = glm::normalize(glm::vec3(-1.f, -1.f, -2.f));
+
+    // Shadow depth bias in [0,1] depth and per unit of depth slope over a
+    // shadow map texel, the slope part covers the filter footprint
+    const float SHADOW_BIAS = 5e-4f;
+    const float SHADOW_SLOPE_BIAS = 1.5f;
+    const float MAX_SHADOW_BIAS = 0.01f;
+    // Texels around a lookup that the shadow filter reads
+    const float SHADOW_FILTER_TEXELS = 1.f;
+
+    // World space planes of the view frustum, normals point inwards
+    std::array<glm::vec4, 6> frustumPlanes(const glm::mat4& worldToClip)
+    {
+        const glm::vec4 x = glm::row(worldToClip, 0);
+        const glm::vec4 y = glm::row(worldToClip, 1);
+        const glm::vec4 z = glm::row(worldToClip, 2);
+        const glm::vec4 w = glm::row(worldToClip, 3);
+        std::array<glm::vec4, 6> planes = {w + x, w - x, w + y, w - y, w + z, w - z};
+        for (auto& plane : planes)
+            plane /= glm::length(glm::vec3(plane));
+        return planes;
+    }
+
+    // Triangles per wave, draws in the same wave don't occlude each other
+    const size_t WAVE_TRIS = 1 << 15;
+
+    // Oldest frame buffer that can be partially redrawn, covers triple buffering
+    const size_t MAX_FRAME_AGE = 4;
+
+    // States of the world space vertices views share
+    const uint8_t SHARED_EMPTY = 0;
+    const uint8_t SHARED_FILLING = 1;
+    const uint8_t SHARED_DONE = 2;
+
+    bool sameState(const DrawState& a, const DrawState& b)
+    {
+        return a.raster.depthTest == b.raster.depthTest &&
+               a.raster.depthWrite == b.raster.depthWrite &&
+               a.raster.colorWrite == b.raster.colorWrite &&
+               a.raster.depthLessEqual == b.raster.depthLessEqual &&
+               a.cullBackFaces == b.cullBackFaces &&
+               a.occlusionCulling == b.occlusionCulling;
+    }
+
+    // Draws that the depth passes cover
+    bool writesDepth(const DrawState& state)
+    {
+        return state.raster.depthTest && state.raster.depthWrite;
+    }
+
+    // Draws that the transparent pass blends over all others, the rest of
+    // the passes leave them out
+    bool blended(const CommandList::Draw& draw)
+    {
+        return draw.material != nullptr && draw.material->blend && draw.state.raster.colorWrite;
+    }
+
+    // Skinned draws move within bounds of their own
+    std::tuple<glm::vec3, glm::vec3> drawBounds(const CommandList::Draw& draw)
+    {
+        if (draw.skinned != nullptr)
+            return std::make_tuple(draw.skinned->min, draw.skinned->max);
+        return std::make_tuple(draw.primitive->min, draw.primitive->max);
+    }
+
+    // View independent part of the vertex work for an instance
+    struct InstanceVertices {
+        const Primitive& primitive;
+        // Replaces positions, normals and tangents if set
+        const SkinnedVertices* skinned;
+        glm::mat4 modelToWorld;
+        glm::mat3 normalToWorld;
+        // Shading attributes are only filled in for smooth primitives
+        bool smooth;
+        // Shadow coordinates are only filled in if set
+        const glm::mat4* worldToShadow;
+
+        InstanceVertices(const Primitive& primitive, const SkinnedVertices* skinned, const glm::mat4& modelToWorld, bool smooth, const glm::mat4* worldToShadow) :
+            primitive(primitive),
+            skinned(skinned),
+            modelToWorld(modelToWorld),
+            normalToWorld(glm::transpose(glm::inverse(glm::mat3(modelToWorld)))),
+            smooth(smooth),
+            worldToShadow(worldToShadow)
+        { }
+
+        void positions(glm::vec4* worldPositions) const
+        {
+            const size_t vertices = vertexCount(primitive);
+            if (skinned != nullptr) {
+                for (size_t v = 0; v < vertices; ++v)
+                    worldPositions[v] = modelToWorld * glm::vec4(skinned->positions[v], 1.f);
+            } else if (primitive.positions.empty()) {
+                // Dequantization rides along with the model transform
+                const glm::mat4 packedToWorld = modelToWorld * unpackPositionTransform(primitive);
+                for (size_t v = 0; v < vertices; ++v)
+                    worldPositions[v] = packedToWorld * glm::vec4(glm::vec3(primitive.packed.positions[v]), 1.f);
+            } else {
+                for (size_t v = 0; v < vertices; ++v)
+                    worldPositions[v] = modelToWorld * glm::vec4(primitive.positions[v], 1.f);
+            }
+        }
+
+        Varyings varyings(size_t v, const glm::vec4& worldPosition) const
+        {
+            const PackedVertices& p = primitive.packed;
+            const bool packed = primitive.positions.empty();
+            Varyings varyings;
+            if (worldToShadow != nullptr)
+                varyings.shadowCoord = glm::vec3(*worldToShadow * worldPosition);
+            if (!smooth)
+                return varyings;
+            if (skinned != nullptr)
+                varyings.normal = normalToWorld * skinned->normals[v];
+            else {
+                varyings.normal = normalToWorld *
+                    (packed ? unpackOctahedral(p.normals[v]) : primitive.normals[v]);
+            }
+            if (!primitive.texCoord0s.empty())
+                varyings.texCoord0 = primitive.texCoord0s[v];
+            else if (!p.texCoord0s.empty())
+                varyings.texCoord0 = unpackTexCoord(p.texCoord0s[v]);
+            if (!primitive.tangents.empty() || !p.tangents.empty()) {
+                const glm::vec4 tangent =
+                    skinned != nullptr ? skinned->tangents[v] :
+                    packed ? unpackTangent(p.tangents[v]) : primitive.tangents[v];
+                varyings.tangent = glm::vec4(glm::mat3(modelToWorld) * glm::vec3(tangent), tangent.w);
+            }
+            return varyings;
+        }
+    };
+
+    Primitive unitCube()
+    {
+        Primitive cube;
+        for (uint32_t i = 0; i < 8; ++i)
+            cube.positions.emplace_back(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+        // Two ccw triangles per face as seen from outside
+        cube.tris = {
+            {0, 2, 1}, {1, 2, 3}, {4, 5, 6}, {5, 7, 6},
+            {0, 1, 4}, {1, 5, 4}, {2, 6, 3}, {3, 6, 7},
+            {0, 4, 2}, {2, 4, 6}, {1, 3, 5}, {3, 7, 5}
+        };
+        cube.max = glm::vec3(1.f);
+        return cube;
+    }
+}
+
+Renderer::Renderer(JobSystem* jobs) :
+    _jobs(jobs),
+    _proxy(unitCube())
+{
+    for (uint32_t i = 0; i <= _jobs->threadCount(); ++i)
+        _arenas.emplace_back(std::make_unique<FrameArena>());
+}
+
+void Renderer::setOcclusionCulling(bool enabled)
+{
+    _occlusionCulling = enabled;
+}
+
+void Renderer::setResidency(ResidencyManager* residency)
+{
+    _residency = residency;
+}
+
+void Renderer::setFrameReuse(bool enabled)
+{
+    _frameReuse = enabled;
+}
+
+void Renderer::setDepthPrepass(bool enabled)
+{
+    _depthPrepass = enabled;
+}
+
+void Renderer::setShadows(bool enabled)
+{
+    // Shadows change every tile
+    if (enabled != _shadows)
+        _lastRes = glm::uvec2(0);
+    _shadows = enabled;
+}
+
+bool Renderer::beginFrame(const CommandList& commands, const Camera& camera, const FrameBuffer& fb)
+{
+    const auto& draws = commands.draws();
+    const auto& transforms = commands.transforms();
+    const glm::uvec2& res = fb.res();
+    const glm::uvec2 binCount = (res + TILE_SIZE - 1u) / TILE_SIZE;
+
+    // Shadows are fitted to the camera, a different fit changes every tile
+    const glm::mat4 lastWorldToShadow = _worldToShadow;
+    const Camera* cameras = &camera;
+    if (_shadows)
+        fitShadowMap(commands, &cameras, 1);
+    const bool shadowsMoved = _shadows && _worldToShadow != lastWorldToShadow;
+
+    _nextKeys.clear();
+    _nextBins.clear();
+    _nextShadowRects.clear();
+    for (const auto& draw : draws) {
+        const auto [boundsMin, boundsMax] = drawBounds(draw);
+        for (size_t t = draw.transform; t < draw.transform + draw.instanceCount; ++t) {
+            const glm::mat4& modelToWorld = transforms[t];
+            _nextKeys.push_back(drawKey(draw, modelToWorld));
+
+            ScreenRect rect;
+            const bool bounded = OcclusionBuffer::project(
+                boundsMin,
+                boundsMax,
+                camera.worldToClip() * modelToWorld,
+                res,
+                &rect
+            );
+            glm::uvec2 min, max;
+            rectBins(rect, bounded, res, &min, &max);
+            _nextBins.emplace_back(min.x, min.y, max.x, max.y);
+
+            if (_shadows) {
+                const glm::uvec2& shadowRes = _shadowMap->res();
+                ScreenRect shadowRect;
+                if (!OcclusionBuffer::project(boundsMin, boundsMax, _light.worldToClip() * modelToWorld, shadowRes, &shadowRect)) {
+                    shadowRect.min = glm::vec2(0.f);
+                    shadowRect.max = glm::vec2(shadowRes);
+                }
+                _nextShadowRects.emplace_back(shadowRect.min.x, shadowRect.min.y, shadowRect.max.x, shadowRect.max.y);
+            }
+        }
+    }
+
+    // Changed draws dirty the bins they covered and cover now
+    // Frame f keeps its changes in slot (f - 1) % MAX_FRAME_AGE
+    _changes.resize(MAX_FRAME_AGE);
+    std::vector<uint8_t>& changes = _changes[_frame % MAX_FRAME_AGE];
+    const bool everything =
+        !_frameReuse ||
+        res != _lastRes ||
+        camera.worldToClip() != _lastWorldToClip ||
+        _nextKeys.size() != _drawKeys.size() ||
+        shadowsMoved;
+    changes.assign(binCount.x * binCount.y, everything);
+    bool changed = everything;
+    if (!everything) {
+        const auto markBins = [&](const glm::uvec4& bins){
+            for (uint32_t y = bins.y; y < bins.w; ++y) {
+                for (uint32_t x = bins.x; x < bins.z; ++x)
+                    changes[y * binCount.x + x] = 1;
+            }
+            changed |= bins.x < bins.z && bins.y < bins.w;
+        };
+        // Shadow map texels changed casters covered before and cover now
+        _shadowChanges.clear();
+        for (size_t i = 0; i < _nextKeys.size(); ++i) {
+            if (!sameDraw(_nextKeys[i], _drawKeys[i])) {
+                markBins(_drawBins[i]);
+                markBins(_nextBins[i]);
+                if (_shadows) {
+                    _shadowChanges.push_back(_shadowRects[i]);
+                    _shadowChanges.push_back(_nextShadowRects[i]);
+                }
+            }
+        }
+        // Receivers only look up the map inside their own rects, grown by
+        // the filter footprint
+        for (size_t i = 0; i < _nextShadowRects.size() && !_shadowChanges.empty(); ++i) {
+            const glm::vec4& rect = _nextShadowRects[i];
+            for (const auto& change : _shadowChanges) {
+                if (rect.x - SHADOW_FILTER_TEXELS <= change.z && change.x <= rect.z + SHADOW_FILTER_TEXELS &&
+                    rect.y - SHADOW_FILTER_TEXELS <= change.w && change.y <= rect.w + SHADOW_FILTER_TEXELS) {
+                    markBins(_nextBins[i]);
+                    break;
+                }
+            }
+        }
+    }
+
+    _drawKeys.swap(_nextKeys);
+    _drawBins.swap(_nextBins);
+    _shadowRects.swap(_nextShadowRects);
+    _lastRes = res;
+    _lastWorldToClip = camera.worldToClip();
+
+    // Slot gets reused by the next frame that changes something
+    if (!changed) {
+        _dirtyBins.assign(binCount.x * binCount.y, 0);
+        return false;
+    }
+    _frame++;
+
+    // fb is missing everything that changed since it was last drawn
+    const auto drawn = _drawnFrames.find(&fb);
+    const size_t age = drawn == _drawnFrames.end() ? MAX_FRAME_AGE + 1 : _frame - drawn->second;
+    _drawnFrames[&fb] = _frame;
+    if (everything || age > MAX_FRAME_AGE) {
+        _dirtyBins.clear();
+        return true;
+    }
+
+    _dirtyBins.assign(binCount.x * binCount.y, 0);
+    for (size_t f = _frame - age + 1; f <= _frame; ++f) {
+        const std::vector<uint8_t>& frameChanges = _changes[(f - 1) % MAX_FRAME_AGE];
+        for (size_t i = 0; i < _dirtyBins.size(); ++i)
+            _dirtyBins[i] |= frameChanges[i];
+    }
+
+    return true;
+}
+
+void Renderer::rectBins(const ScreenRect& rect, bool bounded, const glm::uvec2& res, glm::uvec2* min, glm::uvec2* max) const
+{
+    const glm::uvec2 binCount = (res + TILE_SIZE - 1u) / TILE_SIZE;
+    if (!bounded) {
+        *min = glm::uvec2(0);
+        *max = binCount;
+        return;
+    }
+
+    // Grown by a pixel to cover samples on the edges
+    const glm::vec2 pMin = glm::clamp(rect.min - 1.f, glm::vec2(0.f), glm::vec2(res));
+    const glm::vec2 pMax = glm::clamp(rect.max + 1.f, glm::vec2(0.f), glm::vec2(res));
+    if (rect.max.x < 0.f || rect.max.y < 0.f || pMin.x >= res.x || pMin.y >= res.y) {
+        *min = glm::uvec2(0);
+        *max = glm::uvec2(0);
+        return;
+    }
+    *min = glm::uvec2(pMin) / TILE_SIZE;
+    *max = glm::min(glm::uvec2(pMax) / TILE_SIZE + 1u, binCount);
+}
+
+bool Renderer::binDirty(size_t bin) const
+{
+    return _dirtyBins.empty() || _dirtyBins[bin];
+}
+
+void Renderer::clear(const Color& color, float depth, FrameBuffer* fb)
+{
+    forEachBin(fb->res(), [&](const glm::uvec2& min, const glm::uvec2& max){
+        fb->clear(color, min, max);
+        fb->clearDepth(depth, min, max);
+    });
+}
+
+void Renderer::resolve(FrameBuffer* fb)
+{
+    if (fb->samples() == 1)
+        return;
+
+    forEachBin(fb->res(), [&](const glm::uvec2& min, const glm::uvec2& max){
+        fb->resolve(min, max);
+    });
+}
+
+std::tuple<size_t, size_t> Renderer::execute(const CommandList& commands, const Camera& camera, FrameBuffer* fb)
+{
+    if (_shadows) {
+        const Camera* cameras = &camera;
+        fitShadowMap(commands, &cameras, 1);
+        if (_shadowStale)
+            renderShadowMap(commands);
+    }
+
+    sortDraws(commands, camera);
+
+    return drawSorted(commands, camera, fb);
+}
+
+void Renderer::executeViews(const CommandList& commands, const View* views, size_t viewCount, std::tuple<size_t, size_t>* counts)
+{
+    if (_shadows) {
+        _viewCameras.clear();
+        for (size_t i = 0; i < viewCount; ++i)
+            _viewCameras.push_back(views[i].camera);
+        fitShadowMap(commands, _viewCameras.data(), viewCount);
+        if (_shadowStale)
+            renderShadowMap(commands);
+    }
+
+    while (_views.size() < viewCount)
+        _views.emplace_back(std::make_unique<Renderer>(_jobs));
+    for (size_t i = 0; i < viewCount; ++i) {
+        Renderer& view = *_views[i];
+        view._occlusionCulling = _occlusionCulling;
+        view._depthPrepass = _depthPrepass;
+        view._residency = _residency;
+        view._shared = this;
+    }
+
+    // Every view culls and sorts on its own, vertices are then transformed
+    // once for everything that any of them might draw
+    _jobs->parallelFor(0, viewCount, 1, [&](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i)
+            _views[i]->sortDraws(commands, *views[i].camera);
+    });
+    shareVertices(commands, viewCount);
+
+    _jobs->parallelFor(0, viewCount, 1, [&](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i)
+            counts[i] = _views[i]->drawSorted(commands, *views[i].camera, views[i].fb);
+    });
+}
+
+size_t Renderer::drawLines(const LineBatch& lines, const Camera& camera, FrameBuffer* fb)
+{
+    for (auto& arena : _arenas)
+        arena->reset();
+
+    const glm::uvec2& res = fb->res();
+    _binCount = (res + TILE_SIZE - 1u) / TILE_SIZE;
+    _lineBins.resize(std::max(_lineBins.size(), size_t(_binCount.x * _binCount.y)));
+
+    // Separate lines come first, wireframes follow in order
+    const auto& separate = lines.lines();
+    const auto& wireframes = lines.wireframes();
+    size_t* firstLines = _arenas[_jobs->threadIndex()]->allocate<size_t>(wireframes.size());
+    size_t lineCount = separate.size();
+    for (size_t i = 0; i < wireframes.size(); ++i) {
+        firstLines[i] = lineCount;
+        lineCount += wireframes[i].edges->vertices.size();
+    }
+    _lines.resize(lineCount);
+
+    const auto binLine = [&](const glm::vec3& windowP0, const glm::vec3& windowP1, const Color& color, const LineState& state, BinnedLine* binned){
+        if (!setupLine(windowP0, windowP1, res, &binned->setup)) {
+            binned->binMin = glm::uvec2(0);
+            binned->binMax = glm::uvec2(0);
+            return;
+        }
+        binned->color = color;
+        binned->state = state;
+        binned->binMin = glm::uvec2(binned->setup.pMin) / TILE_SIZE;
+        binned->binMax = (glm::uvec2(binned->setup.pMax) - 1u) / TILE_SIZE + 1u;
+    };
+    const auto clipAndBinLine = [&](const glm::vec4& clipP0, const glm::vec4& clipP1, const Color& color, const LineState& state, BinnedLine* binned){
+        glm::vec3 windowP0;
+        glm::vec3 windowP1;
+        if (clipLine(clipP0, clipP1, res, &windowP0, &windowP1))
+            binLine(windowP0, windowP1, color, state, binned);
+        else {
+            binned->binMin = glm::uvec2(0);
+            binned->binMax = glm::uvec2(0);
+        }
+    };
+
+    const glm::mat4& worldToClip = camera.worldToClip();
+    _jobs->parallelFor(0, separate.size(), 1024, [&](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i) {
+            const LineBatch::Line& line = separate[i];
+            clipAndBinLine(
+                worldToClip * glm::vec4(line.p0, 1.f),
+                worldToClip * glm::vec4(line.p1, 1.f),
+                line.color,
+                line.state,
+                &_lines[i]
+            );
+        }
+    });
+
+    // Vertices are transformed once and shared by their edges
+    const glm::vec2 halfRes(glm::vec2(res) / 2.f);
+    _jobs->parallelFor(0, wireframes.size(), 1, [&](size_t begin, size_t end){
+        FrameArena& arena = *_arenas[_jobs->threadIndex()];
+        for (size_t i = begin; i < end; ++i) {
+            const LineBatch::Wireframe& wireframe = wireframes[i];
+            const Primitive& primitive = *wireframe.primitive;
+            const InstanceVertices instanceVertices(
+                primitive,
+                wireframe.skinned,
+                wireframe.modelToWorld,
+                false,
+                nullptr
+            );
+            const size_t vertices = vertexCount(primitive);
+            glm::vec4* worldPositions = arena.allocate<glm::vec4>(vertices);
+            glm::vec4* clipPositions = arena.allocate<glm::vec4>(vertices);
+            instanceVertices.positions(worldPositions);
+
+            // Edges between vertices in the clip volume skip clipping and
+            // share the perspective divide
+            glm::vec3* windowPositions = arena.allocate<glm::vec3>(vertices);
+            uint8_t* inside = arena.allocate<uint8_t>(vertices);
+            for (size_t v = 0; v < vertices; ++v) {
+                const glm::vec4 clipP = worldToClip * worldPositions[v];
+                clipPositions[v] = clipP;
+                inside[v] =
+                    std::abs(clipP.x) <= clipP.w &&
+                    std::abs(clipP.y) <= clipP.w &&
+                    std::abs(clipP.z) <= clipP.w &&
+                    clipP.w > 0.f;
+                if (inside[v]) {
+                    const glm::vec3 ndcP = glm::vec3(clipP) * (1.f / clipP.w);
+                    windowPositions[v] = glm::vec3((glm::vec2(ndcP) + 1.f) * halfRes, ndcP.z);
+                }
+            }
+
+            // Back faces are found once per triangle instead of per edge from
+            // the winding of the clip space vertices, which needs no divide
+            uint8_t* frontFaces = nullptr;
+            if (wireframe.cullBackFaces) {
+                frontFaces = arena.allocate<uint8_t>(primitive.tris.size());
+                for (size_t t = 0; t < primitive.tris.size(); ++t) {
+                    const TriIndices& tri = primitive.tris[t];
+                    const glm::vec4& p0 = clipPositions[tri.v0];
+                    const glm::vec4& p1 = clipPositions[tri.v1];
+                    const glm::vec4& p2 = clipPositions[tri.v2];
+                    // Determinant of the x, y and w rows
+                    frontFaces[t] = glm::dot(
+                        glm::vec3(p0.x, p0.y, p0.w),
+                        glm::cross(glm::vec3(p1.x, p1.y, p1.w), glm::vec3(p2.x, p2.y, p2.w))
+                    ) > 0.f;
+                }
+            }
+
+            const LineBatch::Edges& edges = *wireframe.edges;
+            BinnedLine* binned = &_lines[firstLines[i]];
+            for (size_t e = 0; e < edges.vertices.size(); ++e, ++binned) {
+                const glm::uvec2& faces = edges.faces[e];
+                if (frontFaces != nullptr && faces.x != LineBatch::SHARED_FACES &&
+                    !frontFaces[faces.x] && !frontFaces[faces.y]) {
+                    binned->binMin = glm::uvec2(0);
+                    binned->binMax = glm::uvec2(0);
+                    continue;
+                }
+                const glm::uvec2& edge = edges.vertices[e];
+                if (inside[edge.x] && inside[edge.y])
+                    binLine(windowPositions[edge.x], windowPositions[edge.y], wireframe.color, wireframe.state, binned);
+                else
+                    clipAndBinLine(clipPositions[edge.x], clipPositions[edge.y], wireframe.color, wireframe.state, binned);
+            }
+        }
+    });
+
+    // Bins keep recording order so results match drawing serially
+    for (size_t i = 0; i < _binCount.x * _binCount.y; ++i)
+        _lineBins[i].clear();
+    size_t drawnLines = 0;
+    for (size_t i = 0; i < lineCount; ++i) {
+        const BinnedLine& binned = _lines[i];
+        drawnLines += binned.binMin.x < binned.binMax.x;
+        for (uint32_t y = binned.binMin.y; y < binned.binMax.y; ++y) {
+            for (uint32_t x = binned.binMin.x; x < binned.binMax.x; ++x) {
+                const size_t bin = y * _binCount.x + x;
+                if (binDirty(bin))
+                    _lineBins[bin].push_back(uint32_t(i));
+            }
+        }
+    }
+
+    _jobs->parallelFor(0, _binCount.x * _binCount.y, 1, [&](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i) {
+            const glm::uvec2 bin(i % _binCount.x, i / _binCount.x);
+            const glm::uvec2 min = bin * TILE_SIZE;
+            const glm::uvec2 max = glm::min(min + TILE_SIZE, res);
+            for (const uint32_t line : _lineBins[i]) {
+                const BinnedLine& binned = _lines[line];
+                drawLine(binned.setup, binned.color, binned.state, min, max, fb);
+            }
+        }
+    });
+
+    return drawnLines;
+}
+
+MemoryUsage Renderer::memoryUsage() const
+{
+    MemoryUsage usage;
+    // Arenas are reset after every wave, their blocks stay for the next one
+    for (const auto& arena : _arenas) {
+        usage.used += arena->capacity();
+        usage.reserved += arena->capacity();
+    }
+    usage.add(_instances);
+    usage.add(_order);
+    if (_occlusion)
+        usage.add(_occlusion->memoryUsage());
+    if (_shadowMap)
+        usage.add(_shadowMap->memoryUsage());
+    usage.add(_shadowKeys);
+    usage.add(_nextShadowKeys);
+    usage.add(_shadowOrder);
+    usage.add(_sharedFirst);
+    usage.used += _sharedFirst.size() * sizeof(std::atomic<uint8_t>);
+    usage.reserved += _sharedStateCapacity * sizeof(std::atomic<uint8_t>);
+    usage.add(_viewCameras);
+    usage.add(_sharedPositions);
+    usage.add(_sharedVaryings);
+    usage.add(_drawKeys);
+    usage.add(_drawBins);
+    usage.add(_nextKeys);
+    usage.add(_nextBins);
+    usage.add(_shadowRects);
+    usage.add(_nextShadowRects);
+    usage.add(_shadowChanges);
+    usage.add(_changes);
+    for (const auto& changes : _changes)
+        usage.add(changes);
+    usage.add(_dirtyBins);
+    usage.add(_wave);
+    usage.add(_bins);
+    for (const auto& bin : _bins)
+        usage.add(bin);
+    usage.add(_blendBins);
+    for (const auto& blend : _blendBins) {
+        if (blend != nullptr)
+            usage.add(blend->memoryUsage());
+    }
+    usage.add(_blendUsed);
+    usage.add(_lines);
+    usage.add(_lineBins);
+    for (const auto& bin : _lineBins)
+        usage.add(bin);
+    for (const auto& view : _views)
+        usage.add(view->memoryUsage());
+    return usage;
+}
+
+void Renderer::shareVertices(const CommandList& commands, size_t viewCount)
+{
+    // Instances are numbered in recording order in every view and get space
+    // if any of them might draw it, the first view that does fills it in
+    _sharedFirst.clear();
+    size_t vertices = 0;
+    for (const auto& draw : commands.draws()) {
+        for (size_t t = 0; t < draw.instanceCount; ++t) {
+            const size_t instance = _sharedFirst.size();
+            bool inside = false;
+            for (size_t v = 0; v < viewCount; ++v)
+                inside |= !_views[v]->_instances[instance].outside;
+
+            _sharedFirst.push_back(vertices);
+            if (inside)
+                vertices += vertexCount(drawnPrimitive(draw));
+        }
+    }
+    _sharedPositions.resize(vertices);
+    _sharedVaryings.resize(vertices);
+    // Atomics can't be moved, the array is only replaced when it grows
+    if (_sharedStateCapacity < _sharedFirst.size()) {
+        _sharedStates = std::make_unique<std::atomic<uint8_t>[]>(_sharedFirst.size());
+        _sharedStateCapacity = _sharedFirst.size();
+    }
+    for (size_t i = 0; i < _sharedFirst.size(); ++i)
+        _sharedStates[i].store(0, std::memory_order_relaxed);
+}
+
+std::tuple<size_t, size_t> Renderer::drawSorted(const CommandList& commands, const Camera& camera, FrameBuffer* fb)
+{
+    std::tuple<size_t, size_t> counts;
+    if (!_depthPrepass)
+        counts = executeDraws(commands, camera, Pass::Color, fb);
+    else {
+        // Prepass culls and draws the same triangles so the color pass can
+        // trust its depth and visibility
+        executeDraws(commands, camera, Pass::Depth, fb);
+        counts = executeDraws(commands, camera, Pass::ColorOverDepth, fb);
+    }
+
+    // Blended draws need the depth of everything opaque
+    const auto& draws = commands.draws();
+    if (std::any_of(draws.begin(), draws.end(), blended)) {
+        const auto [drawnTris, culledTris] = executeDraws(commands, camera, Pass::Transparent, fb);
+        std::get<0>(counts) += drawnTris;
+        std::get<1>(counts) += culledTris;
+    }
+    return counts;
+}
+
+Renderer::DrawKey Renderer::drawKey(const CommandList::Draw& draw, const glm::mat4& modelToWorld)
+{
+    return {
+        draw.primitive,
+        draw.skinned != nullptr ?
+            static_cast<const void*>(draw.skinned->positions.data()) :
+        draw.primitive->positions.empty() ?
+            static_cast<const void*>(draw.primitive->packed.positions.data()) :
+            static_cast<const void*>(draw.primitive->positions.data()),
+        draw.primitive->tris.data(),
+        draw.material,
+        draw.state,
+        modelToWorld
+    };
+}
+
+bool Renderer::sameDraw(const DrawKey& a, const DrawKey& b)
+{
+    return a.primitive == b.primitive && a.positions == b.positions &&
+           a.tris == b.tris && a.material == b.material &&
+           sameState(a.state, b.state) && a.transform == b.transform;
+}
+
+void Renderer::fitShadowMap(const CommandList& commands, const Camera* const* cameras, size_t cameraCount)
+{
+    const auto& draws = commands.draws();
+    const auto& transforms = commands.transforms();
+
+    // Light looks down LIGHT_DIR, boxes in its view space around all draws
+    // and around the cameras' frusta
+    Camera light;
+    const glm::vec3 up = std::abs(LIGHT_DIR.y) < 0.99f ? glm::vec3(0.f, 1.f, 0.f) : glm::vec3(1.f, 0.f, 0.f);
+    light.orient(glm::vec3(0.f), LIGHT_DIR, up);
+    glm::vec3 sceneMin(std::numeric_limits<float>::max());
+    glm::vec3 sceneMax(std::numeric_limits<float>::lowest());
+    _nextShadowKeys.clear();
+    for (const auto& draw : draws) {
+        const auto [boundsMin, boundsMax] = drawBounds(draw);
+        const glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+        const glm::vec3 halfExtent = (boundsMax - boundsMin) * 0.5f;
+        for (size_t t = draw.transform; t < draw.transform + draw.instanceCount; ++t) {
+            _nextShadowKeys.push_back(drawKey(draw, transforms[t]));
+
+            const glm::mat4 modelToLight = light.worldToCamera() * transforms[t];
+            const glm::vec3 lightCenter(modelToLight * glm::vec4(center, 1.f));
+            glm::vec3 lightExtent(0.f);
+            for (uint32_t i = 0; i < 3; ++i)
+                lightExtent += glm::abs(glm::vec3(modelToLight[i])) * halfExtent[i];
+            sceneMin = glm::min(sceneMin, lightCenter - lightExtent);
+            sceneMax = glm::max(sceneMax, lightCenter + lightExtent);
+        }
+    }
+    if (draws.empty()) {
+        sceneMin = glm::vec3(-1.f);
+        sceneMax = glm::vec3(1.f);
+    }
+
+    glm::vec3 viewMin(std::numeric_limits<float>::max());
+    glm::vec3 viewMax(std::numeric_limits<float>::lowest());
+    for (size_t c = 0; c < cameraCount; ++c) {
+        const glm::mat4 clipToLight = light.worldToCamera() * glm::inverse(cameras[c]->worldToClip());
+        for (uint32_t i = 0; i < 8; ++i) {
+            const glm::vec4 corner = clipToLight * glm::vec4(
+                i & 1 ? 1.f : -1.f, i & 2 ? 1.f : -1.f, i & 4 ? 1.f : 0.f, 1.f
+            );
+            const glm::vec3 p = glm::vec3(corner) / corner.w;
+            viewMin = glm::min(viewMin, p);
+            viewMax = glm::max(viewMax, p);
+        }
+    }
+
+    // Receivers are what the cameras see of the scene and casters anything
+    // between them and the light, which looks down -z
+    glm::vec3 min(glm::max(glm::vec2(sceneMin), glm::vec2(viewMin)), std::max(sceneMin.z, viewMin.z));
+    glm::vec3 max(glm::min(glm::vec2(sceneMax), glm::vec2(viewMax)), sceneMax.z);
+    if (min.x > max.x || min.y > max.y || min.z > max.z) {
+        // Nothing in view casts or receives, the map only has to be valid
+        min = sceneMin;
+        max = sceneMax;
+    }
+    // Keeps flat scenes from collapsing the box and filter taps inside it
+    const glm::vec3 pad = glm::vec3(1e-3f * glm::length(max - min) + 1e-6f);
+    min -= pad;
+    max += pad;
+    light.orthographic(min.x, max.x, min.y, max.y, -max.z, -min.z);
+
+    if (_shadowMap == nullptr)
+        _shadowMap = std::make_unique<FrameBuffer>(glm::uvec2(SHADOW_MAP_SIZE));
+    const glm::vec2 halfRes(glm::vec2(_shadowMap->res()) / 2.f);
+    const glm::mat4 worldToShadow =
+        glm::translate(glm::mat4(1.f), glm::vec3(halfRes, 0.f)) *
+        glm::scale(glm::mat4(1.f), glm::vec3(halfRes, 1.f)) *
+        light.worldToClip();
+
+    bool same = worldToShadow == _worldToShadow && _nextShadowKeys.size() == _shadowKeys.size();
+    for (size_t i = 0; i < _shadowKeys.size() && same; ++i)
+        same = sameDraw(_nextShadowKeys[i], _shadowKeys[i]);
+    _shadowStale |= !same;
+    _shadowKeys.swap(_nextShadowKeys);
+    _light = light;
+    _worldToShadow = worldToShadow;
+}
+
+void Renderer::renderShadowMap(const CommandList& commands)
+{
+    // The map is always drawn whole and the view keeps its own order
+    std::vector<uint8_t> dirtyBins;
+    dirtyBins.swap(_dirtyBins);
+    _order.swap(_shadowOrder);
+
+    forEachBin(_shadowMap->res(), [&](const glm::uvec2& min, const glm::uvec2& max){
+        _shadowMap->clearDepth(1.f, min, max);
+    });
+    sortDraws(commands, _light);
+    executeDraws(commands, _light, Pass::Shadow, _shadowMap.get());
+
+    dirtyBins.swap(_dirtyBins);
+    _order.swap(_shadowOrder);
+    _shadowStale = false;
+}
+
+void Renderer::sortDraws(const CommandList& commands, const Camera& camera)
+{
+    const auto& draws = commands.draws();
+    const auto& transforms = commands.transforms();
+    const std::array<glm::vec4, 6> frustum = frustumPlanes(camera.worldToClip());
+
+    _instances.clear();
+    for (size_t i = 0; i < draws.size(); ++i) {
+        const auto& draw = draws[i];
+
+        // Bounding sphere is shared by all instances
+        const auto [boundsMin, boundsMax] = drawBounds(draw);
+        const glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+        const float radius = glm::length(boundsMax - center);
+
+        for (size_t t = draw.transform; t < draw.transform + draw.instanceCount; ++t) {
+            const glm::mat4& modelToWorld = transforms[t];
+            const glm::vec3 worldCenter(modelToWorld * glm::vec4(center, 1.f));
+            const float scale = std::max({
+                glm::length(glm::vec3(modelToWorld[0])),
+                glm::length(glm::vec3(modelToWorld[1])),
+                glm::length(glm::vec3(modelToWorld[2]))
+            });
+
+            bool outside = false;
+            for (const auto& plane : frustum)
+                outside |= glm::dot(glm::vec3(plane), worldCenter) + plane.w < -radius * scale;
+
+            // Sort key is the view depth of the bounds' center
+            const float depth = -(camera.worldToCamera() * glm::vec4(worldCenter, 1.f)).z;
+            _instances.push_back({i, t, depth, outside, false});
+        }
+    }
+
+    const auto closer = [&](size_t a, size_t b){ return _instances[a].depth < _instances[b].depth; };
+
+    // Recording order is stable for an unchanged scene so last frame's order
+    // stays valid for the same instances
+    if (_order.size() != _instances.size()) {
+        _order.resize(_instances.size());
+        std::iota(_order.begin(), _order.end(), 0);
+        std::sort(_order.begin(), _order.end(), closer);
+        return;
+    }
+
+    // Insertion sort is linear on the nearly sorted order we get from small
+    // camera movements, fall back to a full sort if the view changed a lot
+    const size_t maxShifts = 8 * _order.size();
+    size_t shifts = 0;
+    for (size_t i = 1; i < _order.size(); ++i) {
+        const size_t instance = _order[i];
+        size_t j = i;
+        for (; j > 0 && closer(instance, _order[j - 1]); --j)
+            _order[j] = _order[j - 1];
+        _order[j] = instance;
+
+        shifts += i - j;
+        if (shifts > maxShifts) {
+            std::sort(_order.begin(), _order.end(), closer);
+            return;
+        }
+    }
+}
+
+std::tuple<size_t, size_t> Renderer::executeDraws(const CommandList& commands, const Camera& camera, Pass pass, FrameBuffer* fb)
+{
+    const auto& draws = commands.draws();
+    const auto& transforms = commands.transforms();
+
+    const glm::uvec2& res = fb->res();
+    if (_occlusion == nullptr)
+        _occlusion = std::make_unique<OcclusionBuffer>(res);
+    else if (_occlusion->res() != res)
+        _occlusion->setRes(res);
+    _occlusion->clear();
+    // Kept tiles aren't cleared and earlier passes filled the depth, it is
+    // read back as needed
+    if (!_dirtyBins.empty() || pass == Pass::ColorOverDepth || pass == Pass::Transparent)
+        _occlusion->invalidateAll();
+    const bool depthOnly = pass == Pass::Depth || pass == Pass::Shadow;
+
+    _binCount = (res + TILE_SIZE - 1u) / TILE_SIZE;
+    // Only grows so bins keep their memory when the resolution drops
+    _bins.resize(std::max(_bins.size(), size_t(_binCount.x * _binCount.y)));
+    if (pass == Pass::Transparent) {
+        _blendBins.resize(std::max(_blendBins.size(), size_t(_binCount.x * _binCount.y)));
+        _blendUsed.assign(_binCount.x * _binCount.y, 0);
+    }
+
+    size_t drawnTris = 0;
+    size_t culledTris = 0;
+    size_t next = 0;
+    while (next < _order.size()) {
+        for (auto& arena : _arenas)
+            arena->reset();
+
+        // Gather draws that survive culling against the previous waves
+        _waveSize = 0;
+        size_t waveTris = 0;
+        for (; next < _order.size() && waveTris < WAVE_TRIS; ++next) {
+            Instance& instance = _instances[_order[next]];
+            const auto& draw = draws[instance.draw];
+            if ((pass == Pass::Transparent) != blended(draw))
+                continue;
+            if (instance.outside || (pass == Pass::ColorOverDepth && instance.hidden)) {
+                culledTris += drawnPrimitive(draw).tris.size();
+                continue;
+            }
+            // Depth passes leave out draws that don't write depth, the
+            // color pass draws them normally
+            const bool prepassed = _depthPrepass && writesDepth(draw.state);
+            if (depthOnly && !writesDepth(draw.state))
+                continue;
+
+            const auto [boundsMin, boundsMax] = drawBounds(draw);
+            ScreenRect rect;
+            const bool bounded = OcclusionBuffer::project(
+                boundsMin,
+                boundsMax,
+                camera.worldToClip() * transforms[instance.transform],
+                res,
+                &rect
+            );
+            // Nothing to redraw under the draw
+            if (!_dirtyBins.empty()) {
+                glm::uvec2 min, max;
+                rectBins(rect, bounded, res, &min, &max);
+                bool dirty = false;
+                for (uint32_t y = min.y; y < max.y && !dirty; ++y) {
+                    for (uint32_t x = min.x; x < max.x && !dirty; ++x)
+                        dirty = _dirtyBins[y * _binCount.x + x];
+                }
+                if (!dirty) {
+                    culledTris += drawnPrimitive(draw).tris.size();
+                    continue;
+                }
+            }
+
+            // Draws that ignore depth can't be hidden, ones covered by the
+            // prepass were already tested
+            const bool occlusionCulling =
+                _occlusionCulling && draw.state.occlusionCulling && draw.state.raster.depthTest &&
+                !(pass == Pass::ColorOverDepth && prepassed);
+            if (occlusionCulling && bounded && !_occlusion->visible(rect, *fb)) {
+                instance.hidden = true;
+                culledTris += drawnPrimitive(draw).tris.size();
+                continue;
+            }
+
+            // Bigger on screen loads first, shadow casters only load with
+            // the view's priority
+            if (_residency != nullptr) {
+                const float priority =
+                    pass == Pass::Shadow ? 0.f :
+                    bounded ? (rect.max.x - rect.min.x) * (rect.max.y - rect.min.y) :
+                    std::numeric_limits<float>::max();
+                _residency->request(draw.primitive, priority);
+            }
+
+            if (_waveSize == _wave.size())
+                _wave.emplace_back();
+            WaveDraw& waveDraw = _wave[_waveSize++];
+            waveDraw.instance = _order[next];
+            waveDraw.bounded = bounded;
+            waveDraw.rect = rect;
+            waveTris += drawnPrimitive(draw).tris.size();
+        }
+
+        _jobs->parallelFor(0, _waveSize, 1, [&](size_t begin, size_t end){
+            for (size_t i = begin; i < end; ++i)
+                processDraw(commands, camera, res, pass, &_wave[i]);
+        });
+
+        // Bins keep submission order so results match drawing serially
+        for (size_t i = 0; i < _binCount.x * _binCount.y; ++i)
+            _bins[i].clear();
+        for (size_t i = 0; i < _waveSize; ++i) {
+            const WaveDraw& waveDraw = _wave[i];
+            drawnTris += waveDraw.triCount;
+            culledTris += waveDraw.culledTris;
+            for (size_t t = 0; t < waveDraw.triCount; ++t) {
+                const Triangle& tri = waveDraw.tris[t];
+                for (uint32_t y = tri.binMin.y; y < tri.binMax.y; ++y) {
+                    for (uint32_t x = tri.binMin.x; x < tri.binMax.x; ++x) {
+                        const size_t bin = y * _binCount.x + x;
+                        if (binDirty(bin))
+                            _bins[bin].push_back(&tri);
+                    }
+                }
+            }
+        }
+
+        if (pass == Pass::Transparent)
+            blendBins(fb);
+        else
+            rasterizeBins(fb);
+
+        for (size_t i = 0; i < _waveSize; ++i) {
+            if (_wave[i].bounded)
+                _occlusion->invalidate(_wave[i].rect);
+            else
+                _occlusion->invalidateAll();
+        }
+    }
+
+    // Blended samples are only complete after the last wave
+    if (pass == Pass::Transparent)
+        compositeBins(fb);
+
+    return std::make_pair(drawnTris, culledTris);
+}
+
+const Primitive& Renderer::drawnPrimitive(const CommandList::Draw& draw) const
+{
+    if (_residency != nullptr && !_residency->resident(draw.primitive))
+        return _proxy;
+    return *draw.primitive;
+}
+
+glm::mat4 Renderer::drawnTransform(const CommandList::Draw& draw, const glm::mat4& modelToWorld) const
+{
+    if (&drawnPrimitive(draw) != &_proxy)
+        return modelToWorld;
+
+    // Keep flat bounds from collapsing the cube
+    const auto [min, max] = drawBounds(draw);
+    const glm::vec3 extent = glm::max(max - min, glm::vec3(1e-4f * glm::length(max - min)));
+    return modelToWorld *
+        glm::translate(glm::mat4(1.f), min) *
+        glm::scale(glm::mat4(1.f), extent);
+}
+
+void Renderer::processDraw(const CommandList& commands, const Camera& camera, const glm::uvec2& res, Pass pass, WaveDraw* waveDraw) const
+{
+    const Instance& instance = _instances[waveDraw->instance];
+    const auto& draw = commands.draws()[instance.draw];
+    const Primitive& primitive = drawnPrimitive(draw);
+    const glm::mat4 modelToWorld = drawnTransform(draw, commands.transforms()[instance.transform]);
+    // The proxy or a primitive that was swapped since skinning has vertices
+    // of its own
+    const SkinnedVertices* skinned =
+        draw.skinned != nullptr && &primitive == draw.primitive &&
+        draw.skinned->positions.size() == vertexCount(primitive) ? draw.skinned : nullptr;
+    const glm::vec2 halfRes(glm::vec2(res) / 2.f);
+
+    // Depth passes skip shading, the color pass over the prepass only
+    // shades where its depth survived
+    const bool depthOnly = pass == Pass::Depth || pass == Pass::Shadow;
+    RasterState rasterState = draw.state.raster;
+    if (depthOnly)
+        rasterState.colorWrite = false;
+    else if (pass == Pass::ColorOverDepth && writesDepth(draw.state)) {
+        rasterState.depthWrite = false;
+        rasterState.depthLessEqual = true;
+    }
+
+    // Views get the shadow map and world space vertices from the renderer
+    // that fans them out
+    const Renderer& shared = _shared != nullptr ? *_shared : *this;
+
+    // Lit per-pixel if the primitive has normals, per-face otherwise
+    const bool smooth = !depthOnly && hasNormals(primitive);
+    const bool shadowed = !depthOnly && shared._shadows && shared._shadowMap != nullptr;
+    const Shading shading =
+        smooth ?
+            (shadowed ? Shading::LambertShadowed : Shading::Lambert) :
+            (shadowed ? Shading::FlatShadowed : Shading::Flat);
+    const RasterFn raster = rasterVariant(rasterState, shading);
+    const BlendFn blend = pass == Pass::Transparent ? blendVariant(rasterState, shading) : nullptr;
+    const float alpha = pass == Pass::Transparent ? glm::clamp(draw.material->baseColorFactor.w, 0.f, 1.f) : 1.f;
+    const InstanceVertices instanceVertices(
+        primitive,
+        skinned,
+        modelToWorld,
+        smooth,
+        shadowed ? &shared._worldToShadow : nullptr
+    );
+
+    FrameArena& arena = *_arenas[_jobs->threadIndex()];
+    waveDraw->tris = arena.allocate<Triangle>(primitive.tris.size());
+    waveDraw->triCount = 0;
+    waveDraw->culledTris = 0;
+
+    // This is basically a "vertex shader"
+    // Vertices are transformed once and shared by their triangles
+    const size_t vertices = vertexCount(primitive);
+    const glm::vec4* worldPositions = nullptr;
+    const Varyings* worldVaryings = nullptr;
+    if (_shared != nullptr) {
+        // Claim the shared vertices or use them if they're done, there is no
+        // point in waiting for another view that's still at it
+        const size_t first = _shared->_sharedFirst[waveDraw->instance];
+        std::atomic<uint8_t>& state = _shared->_sharedStates[waveDraw->instance];
+        uint8_t expected = SHARED_EMPTY;
+        if (state.compare_exchange_strong(expected, SHARED_FILLING)) {
+            // Filled for whatever pass comes after this one
+            const InstanceVertices sharedVertices(
+                primitive,
+                skinned,
+                modelToWorld,
+                hasNormals(primitive),
+                shared._shadows && shared._shadowMap != nullptr ? &shared._worldToShadow : nullptr
+            );
+            glm::vec4* positions = &_shared->_sharedPositions[first];
+            Varyings* varyings = &_shared->_sharedVaryings[first];
+            sharedVertices.positions(positions);
+            for (size_t v = 0; v < vertices; ++v)
+                varyings[v] = sharedVertices.varyings(v, positions[v]);
+            state = SHARED_DONE;
+            expected = SHARED_DONE;
+        }
+        if (expected == SHARED_DONE) {
+            worldPositions = &_shared->_sharedPositions[first];
+            worldVaryings = &_shared->_sharedVaryings[first];
+        }
+    }
+    if (worldPositions == nullptr) {
+        glm::vec4* transformed = arena.allocate<glm::vec4>(vertices);
+        instanceVertices.positions(transformed);
+        worldPositions = transformed;
+    }
+    glm::vec4* clipPositions = arena.allocate<glm::vec4>(vertices);
+    for (size_t v = 0; v < vertices; ++v)
+        clipPositions[v] = camera.worldToClip() * worldPositions[v];
+    const auto vertexVaryings = [&](size_t v){
+        if (worldVaryings != nullptr)
+            return worldVaryings[v];
+        return instanceVertices.varyings(v, worldPositions[v]);
+    };
+
+    for (const auto& tri : primitive.tris) {
+        const glm::vec4& p0World = worldPositions[tri.v0];
+        const glm::vec4& p1World = worldPositions[tri.v1];
+        const glm::vec4& p2World = worldPositions[tri.v2];
+
+        glm::vec3 n = glm::normalize(glm::cross(
+            glm::vec3(p1World - p0World),
+            glm::vec3(p2World - p0World)
+        ));
+
+        // Do back-face culling
+        const glm::vec3 v = camera.toEye(glm::vec3(p0World));
+        const float NoV = glm::dot(n, v);
+        const bool backFacing = NoV <= 0;
+        if (backFacing) {
+            if (draw.state.cullBackFaces) {
+                waveDraw->culledTris++;
+                continue;
+            }
+            // Back faces are lit from their side
+            n = -n;
+        }
+
+        const float NoL = glm::dot(n, -LIGHT_DIR);
+        const Color shade(255 * NoL);
+
+        // Back faces are flipped to the ccw winding the rasterizer expects
+        const std::array<glm::vec4, 3> clipVerts = [&](){
+            const glm::vec4& clip0 = clipPositions[tri.v0];
+            const glm::vec4& clip1 = clipPositions[tri.v1];
+            const glm::vec4& clip2 = clipPositions[tri.v2];
+            if (backFacing)
+                return std::array<glm::vec4, 3>{clip0, clip2, clip1};
+            return std::array<glm::vec4, 3>{clip0, clip1, clip2};
+        }();
+
+        // Rough clipping
+        if (outsideClip(clipVerts))
+            continue;
+
+        // Window space bounds pick the bins, vertices behind the eye could
+        // land anywhere
+        glm::uvec2 binMin(0);
+        glm::uvec2 binMax(_binCount);
+        if (clipVerts[0].w > 0.f && clipVerts[1].w > 0.f && clipVerts[2].w > 0.f) {
+            glm::vec2 wMin(std::numeric_limits<float>::max());
+            glm::vec2 wMax(std::numeric_limits<float>::lowest());
+            for (const auto& clipP : clipVerts) {
+                const glm::vec2 windowP = (glm::vec2(clipP) / clipP.w + 1.f) * halfRes;
+                wMin = glm::min(wMin, windowP);
+                wMax = glm::max(wMax, windowP);
+            }
+            wMin = glm::clamp(wMin, glm::vec2(0.f), glm::vec2(res));
+            wMax = glm::clamp(wMax, glm::vec2(0.f), glm::vec2(res));
+            binMin = glm::uvec2(wMin) / TILE_SIZE;
+            binMax = glm::min(glm::uvec2(wMax) / TILE_SIZE + 1u, _binCount);
+        }
+
+        Triangle& triangle = *new (&waveDraw->tris[waveDraw->triCount++]) Triangle;
+        triangle.clipVerts = clipVerts;
+        triangle.raster = raster;
+        triangle.blend = blend;
+        triangle.inputs.color = shade;
+        triangle.inputs.alpha = alpha;
+        triangle.inputs.lightDir = LIGHT_DIR;
+        if (smooth || shadowed) {
+            triangle.inputs.varyings = {
+                vertexVaryings(tri.v0),
+                vertexVaryings(tri.v1),
+                vertexVaryings(tri.v2)
+            };
+            if (backFacing) {
+                std::swap(triangle.inputs.varyings[1], triangle.inputs.varyings[2]);
+                for (auto& varyings : triangle.inputs.varyings)
+                    varyings.normal = -varyings.normal;
+            }
+        }
+        if (shadowed) {
+            // Bias grows with how fast depth changes across shadow map texels
+            const auto& varyings = triangle.inputs.varyings;
+            const glm::vec3 shadowN = glm::cross(
+                varyings[1].shadowCoord - varyings[0].shadowCoord,
+                varyings[2].shadowCoord - varyings[0].shadowCoord
+            );
+            const float slope = (std::abs(shadowN.x) + std::abs(shadowN.y)) /
+                std::max(std::abs(shadowN.z), std::numeric_limits<float>::min());
+            triangle.inputs.shadowMap = shared._shadowMap.get();
+            triangle.inputs.shadowBias = std::min(SHADOW_BIAS + SHADOW_SLOPE_BIAS * slope, MAX_SHADOW_BIAS);
+        }
+        triangle.binMin = binMin;
+        triangle.binMax = binMax;
+    }
+}
+
+void Renderer::rasterizeBins(FrameBuffer* fb)
+{
+    _jobs->parallelFor(0, _binCount.x * _binCount.y, 1, [&](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i) {
+            const glm::uvec2 bin(i % _binCount.x, i / _binCount.x);
+            const glm::uvec2 min = bin * TILE_SIZE;
+            const glm::uvec2 max = glm::min(min + TILE_SIZE, fb->res());
+            for (const Triangle* tri : _bins[i])
+                tri->raster(tri->clipVerts, tri->inputs, min, max, fb);
+        }
+    });
+}
+
+void Renderer::blendBins(FrameBuffer* fb)
+{
+    _jobs->parallelFor(0, _binCount.x * _binCount.y, 1, [&](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i) {
+            if (_bins[i].empty())
+                continue;
+            const glm::uvec2 bin(i % _binCount.x, i / _binCount.x);
+            const glm::uvec2 min = bin * TILE_SIZE;
+            const glm::uvec2 max = glm::min(min + TILE_SIZE, fb->res());
+            // Emptied by the first wave that reaches the bin
+            if (!_blendUsed[i]) {
+                if (_blendBins[i] == nullptr)
+                    _blendBins[i] = std::make_unique<BlendBuffer>();
+                _blendBins[i]->reset(min, max, fb->samples());
+                _blendUsed[i] = 1;
+            }
+            for (const Triangle* tri : _bins[i])
+                tri->blend(tri->clipVerts, tri->inputs, min, max, fb, _blendBins[i].get());
+        }
+    });
+}
+
+void Renderer::compositeBins(FrameBuffer* fb)
+{
+    _jobs->parallelFor(0, _binCount.x * _binCount.y, 1, [&](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i) {
+            if (_blendUsed[i])
+                _blendBins[i]->composite(fb);
+        }
+    });
+}
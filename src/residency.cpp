@@ -0,0 +1,215 @@
+#include "residency.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+    // Queued loads, bounds how stale the priorities can get
+    const size_t MAX_IN_FLIGHT = 16;
+
+    bool empty(const Primitive& primitive)
+    {
+        return vertexCount(primitive) == 0 && primitive.tris.empty();
+    }
+
+    // Empty primitives are left for the cache to fill in
+    bool matches(const GeometryCache::Entry& entry, const Primitive& primitive)
+    {
+        if (empty(primitive))
+            return true;
+        return entry.positions == primitive.positions.size() &&
+               entry.packedPositions == primitive.packed.positions.size() &&
+               entry.tris == primitive.tris.size();
+    }
+}
+
+ResidencyManager::ResidencyManager(World* world, const GeometryCache* cache, size_t budgetBytes) :
+    _cache(cache),
+    _budgetBytes(budgetBytes)
+{
+    // Check everything before dropping any geometry
+    size_t index = 0;
+    for (const auto& mesh : world->meshes) {
+        for (const auto& primitive : mesh.primitives) {
+            if (index >= cache->primitiveCount() || !matches(cache->entry(index++), primitive))
+                throw std::runtime_error("Geometry cache doesn't match the world");
+        }
+    }
+    if (index != cache->primitiveCount())
+        throw std::runtime_error("Geometry cache doesn't match the world");
+
+    for (auto& mesh : world->meshes) {
+        for (auto& primitive : mesh.primitives) {
+            auto slot = std::make_unique<Slot>();
+            slot->index = _slots.size();
+            slot->primitive = &primitive;
+            slot->bytes = cache->byteSize(slot->index);
+            if (empty(primitive)) {
+                primitive.min = cache->entry(slot->index).min;
+                primitive.max = cache->entry(slot->index).max;
+            }
+            evict(slot.get());
+
+            _slotIndices.emplace(&primitive, slot->index);
+            _slots.push_back(std::move(slot));
+        }
+    }
+
+    _loader = std::thread([this]{ work(); });
+}
+
+ResidencyManager::~ResidencyManager()
+{
+    // Queued loads are dropped, the current one finishes
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.clear();
+        _stop = true;
+    }
+    _queued.notify_one();
+    _loader.join();
+}
+
+bool ResidencyManager::resident(const Primitive* primitive) const
+{
+    const auto index = _slotIndices.find(primitive);
+    // Primitives we don't manage are always there
+    if (index == _slotIndices.end())
+        return true;
+    return _slots[index->second]->state == State::Resident;
+}
+
+void ResidencyManager::request(const Primitive* primitive, float priority)
+{
+    const auto index = _slotIndices.find(primitive);
+    if (index == _slotIndices.end())
+        return;
+
+    std::lock_guard<std::mutex> lock(_requestMutex);
+    Slot& slot = *_slots[index->second];
+    if (slot.lastUsed != _frame) {
+        slot.lastUsed = _frame;
+        slot.priority = priority;
+        if (slot.state == State::Evicted)
+            _requests.push_back(index->second);
+    } else
+        slot.priority = std::max(slot.priority, priority);
+}
+
+void ResidencyManager::update()
+{
+    // Commit finished loads
+    for (auto& slot : _slots) {
+        if (slot->state != State::Loading || !slot->loaded)
+            continue;
+
+        if (!slot->error.empty())
+            throw std::runtime_error(slot->error);
+
+        swapGeometry(slot->primitive, slot->staging.get());
+        slot->staging.reset();
+        slot->state = State::Resident;
+        _inFlight--;
+    }
+
+    // Most important first
+    std::sort(_requests.begin(), _requests.end(), [&](size_t a, size_t b){
+        return _slots[a]->priority > _slots[b]->priority;
+    });
+
+    for (size_t index : _requests) {
+        if (_inFlight >= MAX_IN_FLIGHT)
+            break;
+
+        Slot* slot = _slots[index].get();
+        // Primitives larger than the whole budget can never load, they stay
+        // proxies without holding up the rest
+        if (slot->state != State::Evicted || slot->bytes > _budgetBytes)
+            continue;
+        // Rest of the requests wait for space or a later frame
+        if (!makeRoom(slot->bytes))
+            break;
+
+        slot->state = State::Loading;
+        slot->loaded = false;
+        slot->staging = std::make_unique<Primitive>();
+        _usedBytes += slot->bytes;
+        _inFlight++;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queue.push_back(slot);
+        }
+        _queued.notify_one();
+    }
+    _requests.clear();
+
+    _frame++;
+}
+
+size_t ResidencyManager::budgetBytes() const
+{
+    return _budgetBytes;
+}
+
+size_t ResidencyManager::usedBytes() const
+{
+    return _usedBytes;
+}
+
+void ResidencyManager::evict(Slot* slot)
+{
+    // Swapping with an empty primitive frees the memory
+    Primitive empty;
+    swapGeometry(slot->primitive, &empty);
+
+    if (slot->state == State::Resident)
+        _usedBytes -= slot->bytes;
+    slot->state = State::Evicted;
+}
+
+bool ResidencyManager::makeRoom(size_t bytes)
+{
+    if (bytes > _budgetBytes)
+        return false;
+
+    while (_usedBytes + bytes > _budgetBytes) {
+        // Anything used this frame is still needed
+        Slot* oldest = nullptr;
+        for (auto& slot : _slots) {
+            if (slot->state == State::Resident && slot->lastUsed < _frame &&
+                (oldest == nullptr || slot->lastUsed < oldest->lastUsed))
+                oldest = slot.get();
+        }
+        if (oldest == nullptr)
+            return false;
+
+        evict(oldest);
+    }
+
+    return true;
+}
+
+void ResidencyManager::work()
+{
+    while (true) {
+        Slot* slot;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _queued.wait(lock, [&]{ return _stop || !_queue.empty(); });
+            if (_queue.empty())
+                return;
+            slot = _queue.front();
+            _queue.pop_front();
+        }
+
+        // Errors are thrown on the render thread by the next update
+        try {
+            _cache->read(slot->index, slot->staging.get());
+        } catch (const std::exception& e) {
+            slot->error = e.what();
+        }
+        slot->loaded = true;
+    }
+}
@@ -11,19 +11,18 @@ Texture::Texture(const tinygltf::Image& image) :
         throw std::runtime_error("Texture with bad components");
 }
 
-Texture::Texture(const Texture&& other) :
+Texture::Texture(Texture&& other) :
     _res(other._res),
     _component(other._component),
-    _pixels(other._pixels)
+    _pixels(std::move(other._pixels))
 { }
 
-Texture& Texture::operator=(const Texture&& other)
+Texture& Texture::operator=(Texture&& other)
 {
     if (this != &other) {
-        Texture texture;
-        texture._res = other._res;
-        texture._component = other._component;
-        texture._pixels = other._pixels;
+        _res = other._res;
+        _component = other._component;
+        _pixels = std::move(other._pixels);
     }
     return *this;
 }
@@ -38,6 +37,13 @@ Color Texture::sample(const glm::vec2& uv) const
     );
 }
 
+MemoryUsage Texture::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.add(_pixels);
+    return usage;
+}
+
 glm::uvec2 Texture::pixelCoord(const glm::vec2& uv) const
 {
     assert(uv.x >= 0.f && uv.x <= 1.f && uv.y >= 0.f && uv.y <= 1.f);